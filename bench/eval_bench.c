@@ -0,0 +1,232 @@
+//
+// eval_bench - compiled expressions against the syntax tree walk
+// ---------------------------------------------------------------------------------------------------
+//
+// eval_bench.c
+//
+// Description:
+// ---------------------------------------------------------------------------------------------------
+//
+// Matches one expression against a number of synthetic tag sets, first with the evaluate() tagstat had
+// before expressions were compiled, which walks the syntax tree and compares tag strings, then by
+// running the program tagstat compiles the expression to. Each tag set has 4 tags picked by a fixed
+// pseudo-random sequence from the tags of the expression and 60 others. The time of the program is
+// given both for bitsets built in advance and with looking up the tags of every set, which is what
+// tagstat does for every process.
+//
+// tagstat.c is compiled into this program so the very same parser, optimizer and program are used,
+// its evaluate() is renamed to tagstat_evaluate() to make room for the old one which is copied here
+// unchanged.
+//
+// USAGE
+//   eval_bench [<expr>] [<sets>]
+//
+//   <expr> defaults to 'web && !db || (cache ^^ batch)' and <sets> to
+//   1000000.
+//
+// COMPILE WITH
+//   make
+//
+// EXIT CODES
+//   0 - Exit success:              the times were printed
+//
+//   1 - Incorrect usage:           invalid number of sets
+//
+//   2 - Syntax error:              invalid expression
+//
+//   3 - Out of memory:             malloc failed
+//
+//   4 - Mismatch:                  the tree walk and the program disagree
+//
+
+#define main tagstat_main
+#define evaluate tagstat_evaluate
+#include "../tagstat/tagstat.c"
+#undef evaluate
+#undef main
+
+#include <time.h>
+
+#define SET_TAGS    4       // Tags in every set
+#define OTHER_TAGS  60      // Tags that aren't in the expression
+
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+/*
+ * Recursively descends the syntax tree of an expression and determines
+ * whether or not the expression evaluates to true or false given a set
+ * of tags
+ *
+ *  PARAMETERS
+ *      node - a pointer to the root of the syntax tree
+ *      tags - a set of tag strings to be matched by the expression
+ *
+ *  RETURN VALUE
+ *      1 if the provided set of tags matched the expression otherwise 0
+ */
+static int evaluate(struct expr_node* node, char** tags) {
+    char* tag;
+    
+    switch(node->type) {
+        case EXPR_TAG:
+            while( (tag = *(tags++)) != NULL ) {
+                // Iterate all tags if there are any matches return true
+                if(strlen(tag) == node->len && strncmp(tag, expr + node->start, node->len) == 0) {
+                    return 1;
+                }
+            }
+            
+            return 0;
+        
+        case EXPR_NOT:
+            return !evaluate(node->left, tags);
+        
+        case EXPR_XOR:
+            return ( evaluate(node->left, tags) != evaluate(node->right, tags) );
+        
+        case EXPR_OR:
+            return ( evaluate(node->left, tags) || evaluate(node->right, tags) );
+        
+        default:    // EXPR_AND
+            return ( evaluate(node->left, tags) && evaluate(node->right, tags) );
+    }
+}
+
+
+static void* bench_alloc(size_t size) {
+    void* mem = malloc(size);
+    if(mem == NULL) {
+        fprintf(stderr, "eval_bench: out of memory. qutting...\n");
+        exit(3);
+    }
+    
+    return mem;
+}
+
+
+int main(int argc, const char* argv[]) {
+    const char* arg = (argc > 1) ? argv[1] : "web && !db || (cache ^^ batch)";
+    long sets = (argc > 2) ? strtol(argv[2], NULL, 10) : 1000000;
+    
+    if(argc > 3 || sets <= 0) {
+        fprintf(stderr, "eval_bench: Incorrect usage.\n");
+        fprintf(stderr, "Usage:\n\teval_bench [<expr>] [<sets>]\n");
+        
+        return 1;
+    }
+    
+    char* arg_copy = bench_alloc(strlen(arg) + 1);
+    strcpy(arg_copy, arg);
+    
+    parse_expression(arg_copy);
+    
+    if(expr_root == NULL) {
+        fprintf(stderr, "eval_bench: Syntax error: invalid expression.\n");
+        return 2;
+    }
+    
+    plan_expression(NULL, 0);
+    compile_expression();
+    
+    // The tags to pick from, the ones of the expression first
+    int names = tag_ids + OTHER_TAGS;
+    char** name = bench_alloc(names*sizeof(char*));
+    
+    int i;
+    for(i = 0; i < names; i++) {
+        if(i < tag_ids) {
+            name[i] = bench_alloc(tag_entries[i].len + 1);
+            
+            memcpy(name[i], expr + tag_entries[i].start, tag_entries[i].len);
+            name[i][tag_entries[i].len] = '\0';
+        } else {
+            name[i] = bench_alloc(32);
+            snprintf(name[i], 32, "other%d", i - tag_ids);
+        }
+    }
+    
+    char**    tags = bench_alloc(sets*(SET_TAGS+1)*sizeof(char*));
+    uint64_t* bits = bench_alloc(sets*tag_words*sizeof(uint64_t));
+    
+    // Touched now so the first timed loop doesn't pay for faulting it in
+    memset(bits, 0, sets*tag_words*sizeof(uint64_t));
+    
+    uint32_t seed = 2463534242u;
+    
+    long s;
+    for(s = 0; s < sets; s++) {
+        for(i = 0; i < SET_TAGS; i++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            
+            tags[s*(SET_TAGS+1) + i] = name[seed % names];
+        }
+        
+        tags[s*(SET_TAGS+1) + SET_TAGS] = NULL;
+    }
+    
+    // Syntax tree walk
+    uint64_t start = now_ns();
+    long tree_matches = 0;
+    
+    for(s = 0; s < sets; s++) {
+        tree_matches += evaluate(expr_root, &tags[s*(SET_TAGS+1)]);
+    }
+    
+    uint64_t tree_ns = now_ns() - start;
+    
+    // Program with the tags of every set looked up first
+    start = now_ns();
+    long lookup_matches = 0;
+    
+    for(s = 0; s < sets; s++) {
+        uint64_t* set_bits = &bits[s*tag_words];
+        memset(set_bits, 0, tag_words*sizeof(uint64_t));
+        
+        for(i = 0; i < SET_TAGS; i++) {
+            const char* tag = tags[s*(SET_TAGS+1) + i];
+            int id = lookup_tag(tag, strlen(tag));
+            
+            if(id >= 0) {
+                set_bits[id >> 6] |= (uint64_t)1 << (id & 63);
+            }
+        }
+        
+        lookup_matches += tagstat_evaluate(set_bits);
+    }
+    
+    uint64_t lookup_ns = now_ns() - start;
+    
+    // Program on the bitsets built above
+    start = now_ns();
+    long program_matches = 0;
+    
+    for(s = 0; s < sets; s++) {
+        program_matches += tagstat_evaluate(&bits[s*tag_words]);
+    }
+    
+    uint64_t program_ns = now_ns() - start;
+    
+    printf("%ld tag sets, %d instructions\n", sets, program_len);
+    printf("%-24s %10.3f s %8.1f ns/set\n", "syntax tree walk", tree_ns/1e9, (double)tree_ns/sets);
+    printf("%-24s %10.3f s %8.1f ns/set\n", "program with lookups", lookup_ns/1e9, (double)lookup_ns/sets);
+    printf("%-24s %10.3f s %8.1f ns/set\n", "program", program_ns/1e9, (double)program_ns/sets);
+    printf("%ld matching sets\n", program_matches);
+    
+    if(tree_matches != program_matches || lookup_matches != program_matches) {
+        fprintf(stderr, "eval_bench: %ld sets match walking the tree but %ld running the program\n",
+                tree_matches, program_matches);
+        
+        return 4;
+    }
+    
+    return 0;
+}
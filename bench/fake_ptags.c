@@ -0,0 +1,80 @@
+//
+// fake_ptags - run tagstat and tagkill on a saved snapshot
+// ---------------------------------------------------------------------------------------------------
+//
+// fake_ptags.c
+//
+// Description:
+// ---------------------------------------------------------------------------------------------------
+//
+// Preloaded library that makes /proc/ptags open the file named by $PTAGS_FILE instead, so the
+// scanning and matching of tagstat and tagkill can be benchmarked on snapshots written by gen_ptags
+// on any kernel. Nothing else is changed, tagkill would still signal the pids in the file, only use it
+// with tagstat or with tagkill on pids that are safe to signal.
+//
+// USAGE
+//   LD_PRELOAD=./fake_ptags.so PTAGS_FILE=<file> tagstat <expr>
+//
+// COMPILE WITH
+//   make
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+
+
+/*
+ * Returns the file to open in place of 'path'
+ */
+static const char* redirect(const char* path) {
+    const char* file = getenv("PTAGS_FILE");
+    
+    if(file != NULL && strcmp(path, "/proc/ptags") == 0) {
+        return file;
+    }
+    
+    return path;
+}
+
+
+int open(const char* path, int flags, ...) {
+    static int (*real_open)(const char*, int, ...);
+    
+    if(real_open == NULL) {
+        real_open = dlsym(RTLD_NEXT, "open");
+    }
+    
+    mode_t mode = 0;
+    if(flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    
+    return real_open(redirect(path), flags, mode);
+}
+
+
+int open64(const char* path, int flags, ...) {
+    static int (*real_open64)(const char*, int, ...);
+    
+    if(real_open64 == NULL) {
+        real_open64 = dlsym(RTLD_NEXT, "open64");
+    }
+    
+    mode_t mode = 0;
+    if(flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    
+    return real_open64(redirect(path), flags, mode);
+}
@@ -0,0 +1,340 @@
+//
+// fork_bench - fork rate of tagged processes
+// ---------------------------------------------------------------------------------------------------
+//
+// fork_bench.c
+//
+// Description:
+// ---------------------------------------------------------------------------------------------------
+//
+// Measures how fast a tagged process can fork children that exit right away, the way a tagged build
+// system runs compilers. Every fork is timed from fork() until the child was reaped, which includes
+// copying the parent's tags into the child and dropping them when the child is reaped.
+//
+// Since children share the tag set of their parent, the time of a fork shouldn't depend on how many
+// tags the parent has. Every run is done with the parent having 0, 1, 16 and 128 tags unless other
+// numbers are given.
+//
+// The cost of tagging a child used to grow with the number of tagged processes on the system, since
+// every fork inserted the child into one list sorted by pid. The run is therefore repeated with a
+// number of other tagged processes waiting in the background, 0, 1000, 10000 and 50000 unless other
+// numbers are given. For each number of processes and tags the forks per second and the mean, 50th
+// and 99th percentile time of a fork are printed.
+//
+// USAGE
+//   fork_bench [--forks <n>] [--procs <n>[,<n>...]] [--tags <n>[,<n>...]]
+//
+//   --forks <n> times <n> forks for every number of processes and
+//   tags, 10000 by default.
+//
+//   --procs <n>,... the numbers of other tagged processes to run with.
+//
+//   --tags <n>,... the numbers of tags to give the forking process.
+//
+// COMPILE WITH
+//   make
+//
+// EXIT CODES
+//   0 - Exit success:              the numbers were printed
+//
+//   1 - Incorrect usage:           unknown option
+//
+//   3 - Out of memory:             malloc failed
+//
+//   5 - IO error:                  processes could not be started or tagged
+//
+
+#include "libptag.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// System call numbers of sys_ptag and sys_ptag_batch in the patched kernel
+#if defined(__x86_64__)
+#define SYS_PTAG       299
+#define SYS_PTAG_BATCH 301
+#else
+#define SYS_PTAG       337
+#define SYS_PTAG_BATCH 339
+#endif
+
+#define MAX_RUNS 32     // Most values --procs and --tags take
+
+
+static pid_t* sleepers;         // The other tagged processes
+static long sleeper_count;      // Number of them running
+
+
+static const char* const usage_str = "Usage:\n"
+                                     "\tfork_bench [--forks <n>] [--procs <n>[,<n>...]] [--tags <n>[,<n>...]]\n\n"
+
+                                     "\t--forks <n> times <n> forks for every number of processes and\n"
+                                     "\ttags, 10000 by default.\n\n"
+
+                                     "\t--procs <n>,... the numbers of other tagged processes to run with.\n\n"
+
+                                     "\t--tags <n>,... the numbers of tags to give the forking process.\n";
+
+
+static void out_of_memory() {
+    fprintf(stderr, "fork_bench: out of memory. qutting...\n");
+    exit(3);
+}
+
+
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+/*
+ * Kills and reaps every sleeper
+ */
+static void stop_sleepers() {
+    long i;
+    for(i = 0; i < sleeper_count; i++) {
+        kill(sleepers[i], SIGKILL);
+    }
+    
+    for(i = 0; i < sleeper_count; i++) {
+        waitpid(sleepers[i], NULL, 0);
+    }
+    
+    sleeper_count = 0;
+}
+
+
+/*
+ * Starts more sleepers until 'count' are running and tags the new ones.
+ * Exits with code 5 if they can't be started or tagged.
+ */
+static void start_sleepers(long count) {
+    long first = sleeper_count;
+    
+    sleepers = realloc(sleepers, (count + 1)*sizeof(pid_t));
+    if(sleepers == NULL) {
+        out_of_memory();
+    }
+    
+    while(sleeper_count < count) {
+        pid_t pid = fork();
+        
+        if(pid == 0) {
+            pause();
+            _exit(0);
+        }
+        
+        if(pid < 0) {
+            fprintf(stderr, "fork_bench: error starting process %ld: %s\n", sleeper_count + 1, strerror(errno));
+            
+            stop_sleepers();
+            exit(5);
+        }
+        
+        sleepers[sleeper_count++] = pid;
+    }
+    
+    long new_count = count - first;
+    struct ptag_batch_entry* entries = calloc(new_count + 1, sizeof(struct ptag_batch_entry));
+    if(entries == NULL) {
+        out_of_memory();
+    }
+    
+    long i;
+    for(i = 0; i < new_count; i++) {
+        entries[i].tag  = "fork_bench_sleeper";
+        entries[i].pid  = sleepers[first + i];
+        entries[i].mode = 'a';
+    }
+    
+    for(i = 0; i < new_count; i += PTAG_BATCH_MAX) {
+        long n = (new_count - i < PTAG_BATCH_MAX) ? new_count - i : PTAG_BATCH_MAX;
+        
+        if(syscall(SYS_PTAG_BATCH, entries + i, n) != 0) {
+            fprintf(stderr, "fork_bench: error tagging the processes\n");
+            
+            stop_sleepers();
+            exit(5);
+        }
+    }
+    
+    free(entries);
+}
+
+
+/*
+ * Replaces the tags of this process with 'count' tags. Exits with code 5
+ * if they can't be set.
+ */
+static void set_tags(long count) {
+    char tag[32];
+    
+    int failed = (syscall(SYS_PTAG, getpid(), NULL, 'c') != 0);
+    
+    long i;
+    for(i = 0; i < count && !failed; i++) {
+        snprintf(tag, sizeof(tag), "fork_bench%ld", i);
+        failed = (syscall(SYS_PTAG, getpid(), tag, 'a') != 0);
+    }
+    
+    if(failed) {
+        fprintf(stderr, "fork_bench: error tagging this process\n");
+        
+        stop_sleepers();
+        exit(5);
+    }
+}
+
+
+/*
+ * Reads a comma separated list of at most MAX_RUNS counts
+ *
+ *  PARAMETERS
+ *      list   - the list to read
+ *      counts - array the counts are stored in
+ *
+ *  RETURN VALUE
+ *      The number of counts, or 0 if the list isn't valid
+ */
+static int read_counts(const char* list, long* counts) {
+    int n;
+    for(n = 0; n < MAX_RUNS && *list != '\0'; n++) {
+        char* next;
+        counts[n] = strtol(list, &next, 10);
+        
+        if(next == list || counts[n] < 0 || (*next != ',' && *next != '\0')) {
+            return 0;
+        }
+        
+        list = (*next == ',') ? next + 1 : next;
+    }
+    
+    return (*list == '\0') ? n : 0;
+}
+
+
+static int compare_times(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Times 'forks' forks of this process, each one until the child has
+ * been reaped, and prints the results. Exits with code 5 if fork fails.
+ */
+static void time_forks(long forks, uint64_t* times, long procs, long tags) {
+    uint64_t start = now();
+    
+    long i;
+    for(i = 0; i < forks; i++) {
+        uint64_t fork_start = now();
+        
+        pid_t pid = fork();
+        if(pid == 0) {
+            _exit(0);
+        }
+        
+        if(pid < 0) {
+            fprintf(stderr, "fork_bench: fork failed: %s\n", strerror(errno));
+            
+            stop_sleepers();
+            exit(5);
+        }
+        
+        waitpid(pid, NULL, 0);
+        
+        times[i] = now() - fork_start;
+    }
+    
+    uint64_t total = now() - start;
+    
+    qsort(times, forks, sizeof(uint64_t), compare_times);
+    
+    printf("%10ld %6ld %12.0f %10.1f %10.1f %10.1f\n", procs, tags, forks/(total/1e9), total/1e3/forks,
+           times[forks/2]/1e3, times[forks*99/100]/1e3);
+}
+
+
+int main(int argc, const char* argv[]) {
+    long forks = 10000;
+    long procs[MAX_RUNS] = { 0, 1000, 10000, 50000 };
+    long tags[MAX_RUNS]  = { 0, 1, 16, 128 };
+    int proc_runs = 4;
+    int tag_runs = 4;
+    
+    int argi;
+    for(argi = 1; argi < argc; argi++) {
+        if(strncmp(argv[argi], "--forks", sizeof("--forks")) == 0 && argi+1 < argc) {
+            forks = strtol(argv[++argi], NULL, 10);
+        } else if(strncmp(argv[argi], "--procs", sizeof("--procs")) == 0 && argi+1 < argc) {
+            proc_runs = read_counts(argv[++argi], procs);
+            
+            // Counts have to be ascending, sleepers are only ever added
+            int run;
+            for(run = 1; run < proc_runs; run++) {
+                if(procs[run] < procs[run-1]) {
+                    proc_runs = 0;
+                }
+            }
+        } else if(strncmp(argv[argi], "--tags", sizeof("--tags")) == 0 && argi+1 < argc) {
+            tag_runs = read_counts(argv[++argi], tags);
+        } else {
+            forks = 0;
+            break;
+        }
+    }
+    
+    if(forks <= 0 || proc_runs == 0 || tag_runs == 0) {
+        fprintf(stderr, "fork_bench: Incorrect usage.\n");
+        fprintf(stderr, usage_str);
+        
+        return 1;
+    }
+    
+    uint64_t* times = malloc(forks*sizeof(uint64_t));
+    if(times == NULL) {
+        out_of_memory();
+    }
+    
+    // Tagging something is the check for the patched kernel
+    if(syscall(SYS_PTAG, getpid(), "fork_bench", 'a') != 0) {
+        fprintf(stderr, "fork_bench: error tagging this process, is this the patched kernel?\n");
+        return 5;
+    }
+    
+    printf("%10s %6s %12s %10s %10s %10s\n", "processes", "tags", "forks/s", "mean us", "p50 us", "p99 us");
+    
+    int proc_run;
+    for(proc_run = 0; proc_run < proc_runs; proc_run++) {
+        // Untagged so the sleepers don't get the tags of the parent
+        set_tags(0);
+        start_sleepers(procs[proc_run]);
+        
+        int tag_run;
+        for(tag_run = 0; tag_run < tag_runs; tag_run++) {
+            set_tags(tags[tag_run]);
+            time_forks(forks, times, procs[proc_run], tags[tag_run]);
+        }
+    }
+    
+    stop_sleepers();
+    
+    free(times);
+    free(sleepers);
+    
+    return 0;
+}
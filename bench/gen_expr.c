@@ -0,0 +1,198 @@
+//
+// gen_expr - long synthetic expressions
+// ---------------------------------------------------------------------------------------------------
+//
+// gen_expr.c
+//
+// Description:
+// ---------------------------------------------------------------------------------------------------
+//
+// Writes an expression of about the given number of characters to stdout, for timing the parsers of
+// tagstat and tagkill (see parse_bench.sh). Tags are picked from tag0 to tag15 so that they match
+// some processes of a gen_ptags snapshot. The shape of the expression is one of:
+//
+//   flat       - tag0 && tag1 || tag2 ^^ ... with no parenthesis at all
+//   nested     - tag0 && (tag1 || (tag2 ^^ (...))), nested to the right
+//   left       - (((tag0 && tag1) || tag2) ^^ ...), nested to the left
+//   groups     - (tag0 && !tag1) || (tag2 && not tag3) || ...
+//   escaped    - %(job (0) || x) || tag0 && %(job (1) || x) || tag1 ..., escaped tags that have
+//                parenthesis and operators in them
+//   unbalanced - nested with its last closing parenthesis missing, which is not valid
+//
+// USAGE
+//   gen_expr <shape> <characters>
+//
+// COMPILE WITH
+//   make
+//
+// EXIT CODES
+//   0 - Exit success:              the expression was written
+//
+//   1 - Incorrect usage:           unknown shape or invalid length
+//
+//   3 - Out of memory:             malloc failed
+//
+//   5 - IO error:                  stdout could not be written
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#define OP_COUNT 6
+
+static const char* const ops[OP_COUNT] = { " && ", " || ", " ^^ ", " and ", " or ", " xor " };
+
+static char* buf;       // The expression written so far
+static size_t len;      // Number of characters in buf
+static size_t size;     // Size of buf
+
+
+static const char* const usage_str = "Usage:\n"
+                                     "\tgen_expr <shape> <characters>\n\n"
+
+                                     "\t<shape> is one of flat, nested, left, groups, escaped and\n"
+                                     "\tunbalanced.\n";
+
+
+static void out_of_memory() {
+    fprintf(stderr, "gen_expr: out of memory. qutting...\n");
+    exit(3);
+}
+
+
+/*
+ * Appends printf formatted text to the expression
+ */
+static void append(const char* fmt, ...) {
+    while(1) {
+        va_list args;
+        
+        va_start(args, fmt);
+        int written = vsnprintf(buf + len, size - len, fmt, args);
+        va_end(args);
+        
+        if(written >= 0 && (size_t)written < size - len) {
+            len += written;
+            return;
+        }
+        
+        size = size*2 + 256;
+        
+        buf = realloc(buf, size);
+        if(buf == NULL) {
+            out_of_memory();
+        }
+    }
+}
+
+
+static void gen_flat(size_t chars) {
+    long i;
+    
+    append("tag0");
+    for(i = 1; len < chars; i++) {
+        append("%stag%ld", ops[i % OP_COUNT], i % 16);
+    }
+}
+
+
+static void gen_nested(size_t chars) {
+    long depth;
+    
+    // Every level adds 'tagN && (' here and a ')' at the end
+    for(depth = 0; len + depth + 16 < chars; depth++) {
+        append("tag%ld%s(", depth % 16, ops[depth % OP_COUNT]);
+    }
+    
+    append("tag%ld", depth % 16);
+    while(depth-- > 0) {
+        append(")");
+    }
+}
+
+
+static void gen_left(size_t chars) {
+    long depth;
+    
+    // The opening parenthesis are put in front once their number is known
+    append("tag0");
+    for(depth = 0; len + depth < chars; depth++) {
+        append("%stag%ld)", ops[depth % OP_COUNT], (depth + 1) % 16);
+    }
+    
+    append("%*s", (int)depth, "");
+    memmove(buf + depth, buf, len - depth);
+    memset(buf, '(', depth);
+}
+
+
+static void gen_groups(size_t chars) {
+    long i;
+    for(i = 0; len < chars; i++) {
+        append("%s(tag%ld && %stag%ld)", (i > 0) ? ops[i % OP_COUNT] : "", (2*i) % 16, (i % 2) ? "!" : "not ",
+               (2*i + 1) % 16);
+    }
+}
+
+
+static void gen_escaped(size_t chars) {
+    long i;
+    for(i = 0; len < chars; i++) {
+        append("%s%%(job (%ld) || x) || tag%ld", (i > 0) ? ops[i % OP_COUNT] : "", i, i % 16);
+    }
+}
+
+
+int main(int argc, const char* argv[]) {
+    long chars = (argc == 3) ? strtol(argv[2], NULL, 10) : 0;
+    
+    if(chars <= 0) {
+        fprintf(stderr, "gen_expr: Incorrect usage.\n");
+        fprintf(stderr, usage_str);
+        
+        return 1;
+    }
+    
+    size = chars + 256;
+    buf  = malloc(size);
+    if(buf == NULL) {
+        out_of_memory();
+    }
+    
+    if(strcmp(argv[1], "flat") == 0) {
+        gen_flat(chars);
+    } else if(strcmp(argv[1], "nested") == 0) {
+        gen_nested(chars);
+    } else if(strcmp(argv[1], "left") == 0) {
+        gen_left(chars);
+    } else if(strcmp(argv[1], "groups") == 0) {
+        gen_groups(chars);
+    } else if(strcmp(argv[1], "escaped") == 0) {
+        gen_escaped(chars);
+    } else if(strcmp(argv[1], "unbalanced") == 0) {
+        gen_nested(chars);
+        
+        // Nested expressions of more than a few characters end with a ')'
+        if(buf[len-1] == ')') {
+            len--;
+        }
+    } else {
+        fprintf(stderr, "gen_expr: Incorrect usage.\n");
+        fprintf(stderr, usage_str);
+        
+        return 1;
+    }
+    
+    fwrite(buf, 1, len, stdout);
+    
+    if(fflush(stdout) != 0) {
+        perror("gen_expr: error writing the expression");
+        return 5;
+    }
+    
+    free(buf);
+    
+    return 0;
+}
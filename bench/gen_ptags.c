@@ -0,0 +1,88 @@
+//
+// gen_ptags - synthetic /proc/ptags snapshots
+// ---------------------------------------------------------------------------------------------------
+//
+// gen_ptags.c
+//
+// Description:
+// ---------------------------------------------------------------------------------------------------
+//
+// Writes a snapshot in the format of /proc/ptags to stdout, for benchmarking tagstat and tagkill on
+// machines without the patched kernel (see fake_ptags.c). Every process has the tag 'all' followed by
+// <tags>-1 tags picked from tag0 to tag<distinct>-1 by a fixed pseudo-random sequence, so the same
+// arguments always give the same snapshot. Processes have ascending pids starting at 2, one in eight
+// of them is running and the others are sleeping. Like in /proc/ptags every line is followed by a
+// null byte.
+//
+// USAGE
+//   gen_ptags <processes> <tags> [<distinct>]
+//
+//   <processes> is the number of tagged processes, <tags> the number of
+//   tags each of them has (at least 1) and <distinct> the number of
+//   different tags to pick from, 1000 by default.
+//
+// COMPILE WITH
+//   make
+//
+// EXIT CODES
+//   0 - Exit success:              the snapshot was written
+//
+//   1 - Incorrect usage:           missing or invalid arguments
+//
+//   5 - IO error:                  stdout could not be written
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+
+static const char* const usage_str = "Usage:\n"
+                                     "\tgen_ptags <processes> <tags> [<distinct>]\n\n"
+
+                                     "\t<processes> is the number of tagged processes, <tags> the number of\n"
+                                     "\ttags each of them has (at least 1) and <distinct> the number of\n"
+                                     "\tdifferent tags to pick from, 1000 by default.\n";
+
+
+int main(int argc, const char* argv[]) {
+    long procs    = (argc > 2) ? strtol(argv[1], NULL, 10) : 0;
+    long tags     = (argc > 2) ? strtol(argv[2], NULL, 10) : 0;
+    long distinct = (argc > 3) ? strtol(argv[3], NULL, 10) : 1000;
+    
+    if(argc < 3 || argc > 4 || procs <= 0 || tags <= 0 || distinct <= 0) {
+        fprintf(stderr, "gen_ptags: Incorrect usage.\n");
+        fprintf(stderr, usage_str);
+        
+        return 1;
+    }
+    
+    static char buf[1 << 16];
+    setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+    
+    // xorshift, any fixed sequence will do
+    uint32_t seed = 2463534242u;
+    
+    long i, j;
+    for(i = 0; i < procs; i++) {
+        long pid = i + 2;
+        const char* state = (i % 8 == 0) ? "R (running)" : "S (sleeping)";
+        
+        printf("%ld : all : %s\n%c", pid, state, '\0');
+        
+        for(j = 1; j < tags; j++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            
+            printf("%ld : tag%lu : %s\n%c", pid, (unsigned long)(seed % distinct), state, '\0');
+        }
+    }
+    
+    if(fflush(stdout) != 0) {
+        perror("gen_ptags: error writing the snapshot");
+        return 5;
+    }
+    
+    return 0;
+}
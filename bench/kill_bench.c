@@ -0,0 +1,271 @@
+//
+// kill_bench - time tagkill killing thousands of tagged processes
+// ---------------------------------------------------------------------------------------------------
+//
+// kill_bench.c
+//
+// Description:
+// ---------------------------------------------------------------------------------------------------
+//
+// Starts 10000 processes (or the given number) that do nothing but wait, tags all of them with
+// 'kill_bench' through sys_ptag_batch and runs the given tagkill with the given options on that tag.
+// Prints how long tagkill ran and how long it took until every process was killed and reaped.
+// Processes still alive 30 seconds after tagkill exited are counted, killed and reaped by kill_bench.
+//
+// The sleepers are the children of kill_bench, which is not tagged itself, so only they match.
+//
+// USAGE
+//   kill_bench [--procs <n>] <tagkill> [<option>...]
+//
+//   e.g. kill_bench ../tagkill/tagkill --kernel
+//
+// COMPILE WITH
+//   make
+//
+// EXIT CODES
+//   0 - Exit success:              every process was killed
+//
+//   1 - Incorrect usage:           no tagkill given
+//
+//   3 - Out of memory:             malloc failed
+//
+//   4 - Survivors:                 tagkill failed or left processes alive
+//
+//   5 - IO error:                  the processes could not be started or tagged
+//
+
+#include "libptag.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// System call number of sys_ptag_batch in the patched kernel
+#if defined(__x86_64__)
+#define SYS_PTAG_BATCH 301
+#else
+#define SYS_PTAG_BATCH 339
+#endif
+
+#define REAP_TIMEOUT 30     // Seconds to wait for the processes once tagkill exited
+
+
+static pid_t* sleepers;         // The started processes, sorted once they are tagged
+static long sleeper_count;      // Number of processes started
+static char* reaped;            // reaped[i] is set once sleepers[i] was reaped
+
+
+static const char* const usage_str = "Usage:\n"
+                                     "\tkill_bench [--procs <n>] <tagkill> [<option>...]\n\n"
+
+                                     "\te.g. kill_bench ../tagkill/tagkill --kernel\n";
+
+
+static void* bench_alloc(size_t size) {
+    void* mem = calloc(1, size);
+    if(mem == NULL) {
+        fprintf(stderr, "kill_bench: out of memory. qutting...\n");
+        exit(3);
+    }
+    
+    return mem;
+}
+
+
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+/*
+ * Kills and reaps every sleeper that hasn't been reaped yet
+ */
+static void stop_sleepers() {
+    long i;
+    for(i = 0; i < sleeper_count; i++) {
+        if(!reaped[i]) {
+            kill(sleepers[i], SIGKILL);
+        }
+    }
+    
+    for(i = 0; i < sleeper_count; i++) {
+        if(!reaped[i]) {
+            waitpid(sleepers[i], NULL, 0);
+        }
+    }
+}
+
+
+static int compare_pids(const void* a, const void* b) {
+    pid_t x = *(const pid_t*)a;
+    pid_t y = *(const pid_t*)b;
+    
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Marks a reaped pid, returns non-zero if it was one of the sleepers
+ */
+static int mark_reaped(pid_t pid) {
+    pid_t* found = bsearch(&pid, sleepers, sleeper_count, sizeof(pid_t), compare_pids);
+    
+    if(found == NULL || reaped[found - sleepers]) {
+        return 0;
+    }
+    
+    reaped[found - sleepers] = 1;
+    return 1;
+}
+
+
+int main(int argc, char* argv[]) {
+    long count = 10000;
+    int argi = 1;
+    
+    if(argi + 1 < argc && strncmp(argv[argi], "--procs", sizeof("--procs")) == 0) {
+        count = strtol(argv[argi+1], NULL, 10);
+        argi += 2;
+    }
+    
+    if(argi >= argc || count <= 0) {
+        fprintf(stderr, "kill_bench: Incorrect usage.\n");
+        fprintf(stderr, usage_str);
+        
+        return 1;
+    }
+    
+    sleepers = bench_alloc(count*sizeof(pid_t));
+    reaped   = bench_alloc(count);
+    
+    for(sleeper_count = 0; sleeper_count < count; sleeper_count++) {
+        pid_t pid = fork();
+        
+        if(pid == 0) {
+            pause();
+            _exit(0);
+        }
+        
+        if(pid < 0) {
+            fprintf(stderr, "kill_bench: error starting process %ld: %s\n", sleeper_count + 1, strerror(errno));
+            
+            stop_sleepers();
+            return 5;
+        }
+        
+        sleepers[sleeper_count] = pid;
+    }
+    
+    struct ptag_batch_entry* entries = bench_alloc(count*sizeof(struct ptag_batch_entry));
+    
+    long i;
+    for(i = 0; i < count; i++) {
+        entries[i].tag  = "kill_bench";
+        entries[i].pid  = sleepers[i];
+        entries[i].mode = 'a';
+    }
+    
+    for(i = 0; i < count; i += PTAG_BATCH_MAX) {
+        long n = (count - i < PTAG_BATCH_MAX) ? count - i : PTAG_BATCH_MAX;
+        
+        if(syscall(SYS_PTAG_BATCH, entries + i, n) != 0) {
+            fprintf(stderr, "kill_bench: error tagging the processes, is this the patched kernel?\n");
+            
+            stop_sleepers();
+            return 5;
+        }
+    }
+    
+    free(entries);
+    
+    qsort(sleepers, count, sizeof(pid_t), compare_pids);
+    
+    // tagkill gets the given options followed by the tag
+    char** tagkill_argv = bench_alloc((argc - argi + 2)*sizeof(char*));
+    int tagkill_argc = 0;
+    
+    while(argi < argc) {
+        tagkill_argv[tagkill_argc++] = argv[argi++];
+    }
+    
+    tagkill_argv[tagkill_argc++] = "kill_bench";
+    tagkill_argv[tagkill_argc] = NULL;
+    
+    uint64_t start = now();
+    
+    pid_t tagkill = fork();
+    if(tagkill == 0) {
+        execv(tagkill_argv[0], tagkill_argv);
+        
+        fprintf(stderr, "kill_bench: error running %s: %s\n", tagkill_argv[0], strerror(errno));
+        _exit(127);
+    }
+    
+    if(tagkill < 0) {
+        fprintf(stderr, "kill_bench: error running %s: %s\n", tagkill_argv[0], strerror(errno));
+        
+        stop_sleepers();
+        return 5;
+    }
+    
+    // The sleepers are reaped while tagkill runs as well
+    long reaped_count = 0;
+    int tagkill_status = 0;
+    int tagkill_done = 0;
+    uint64_t tagkill_ns = 0;
+    uint64_t deadline = 0;
+    
+    while(reaped_count < count || !tagkill_done) {
+        int status;
+        pid_t pid = waitpid(-1, &status, (tagkill_done) ? WNOHANG : 0);
+        
+        if(pid == tagkill) {
+            tagkill_done   = 1;
+            tagkill_status = status;
+            tagkill_ns     = now() - start;
+            deadline       = now() + (uint64_t)REAP_TIMEOUT*1000000000;
+        } else if(pid > 0) {
+            reaped_count += mark_reaped(pid);
+        } else if(pid == 0) {
+            if(now() > deadline) {
+                break;
+            }
+            
+            usleep(1000);
+        } else if(errno != EINTR) {
+            break;
+        }
+    }
+    
+    uint64_t total_ns = now() - start;
+    long survivors = count - reaped_count;
+    
+    stop_sleepers();
+    
+    int tagkill_failed = !WIFEXITED(tagkill_status) || WEXITSTATUS(tagkill_status) != 0;
+    
+    printf("%ld processes\n", count);
+    printf("tagkill ran:       %10.1f ms\n", tagkill_ns/1e6);
+    printf("all reaped after:  %10.1f ms\n", total_ns/1e6);
+    
+    if(survivors > 0 || tagkill_failed) {
+        printf("processes left alive: %ld, tagkill exit status: %d\n", survivors,
+               WIFEXITED(tagkill_status) ? WEXITSTATUS(tagkill_status) : -1);
+    }
+    
+    free(tagkill_argv);
+    free(sleepers);
+    free(reaped);
+    
+    return (survivors > 0 || tagkill_failed) ? 4 : 0;
+}
@@ -0,0 +1,44 @@
+#!/bin/bash
+#
+# output_bench - output throughput of tagstat
+# ---------------------------------------------------------------------------------------------------
+#
+# Writes a synthetic snapshot of 250000 processes with 4 tags each (see gen_ptags.c) and has every
+# given tagstat print all of its 1M lines into a pipe that is drained to /dev/null, the way a log
+# shipper would read them. Prints the best of three runs and the lines written per second for each
+# binary. To see what a change gained, give a tagstat built before the change as well.
+#
+# USAGE
+#   output_bench.sh <tagstat> [<tagstat> ...]
+#
+
+if [ $# -lt 1 ]; then
+    echo "Usage: output_bench.sh <tagstat> [<tagstat> ...]" >&2
+    exit 1
+fi
+
+dir=$(cd "$(dirname "$0")" && pwd)
+
+make -s -C "$dir" gen_ptags fake_ptags.so || exit 5
+
+file=$(mktemp) || exit 5
+trap 'rm -f "$file"' EXIT
+
+"$dir/gen_ptags" 250000 4 > "$file" || exit 5
+
+printf "%10s %12s  %s\n" seconds lines/s tagstat
+
+for tagstat in "$@"; do
+    best=
+    for run in 1 2 3; do
+        start=$(date +%s%N)
+        LD_PRELOAD="$dir/fake_ptags.so" PTAGS_FILE="$file" "$tagstat" all | cat > /dev/null
+        end=$(date +%s%N)
+
+        if [ -z "$best" ] || [ $((end - start)) -lt $best ]; then
+            best=$((end - start))
+        fi
+    done
+
+    awk -v b=$best -v t="$tagstat" 'BEGIN { printf "%10.3f %12.0f  %s\n", b/1e9, 1000000/(b/1e9), t }'
+done
@@ -0,0 +1,56 @@
+#!/bin/bash
+#
+# parse_bench - parse time of tagstat for long expressions
+# ---------------------------------------------------------------------------------------------------
+#
+# Generates expressions of 10, 100, 1000, 10000 and 100000 characters in every shape gen_expr knows
+# (see gen_expr.c) and has every given tagstat match them against a small synthetic snapshot. Prints
+# the time, the exit status and a checksum of the output of every run, so that binaries that parse
+# an expression differently show different checksums and invalid expressions show exit status 2.
+# Runs taking longer than 60 seconds are stopped and shown as a timeout, runs that ran out of memory
+# show exit status 3. To compare parsers, give a tagstat built before the change as well, e.g. one
+# with the CYK parser, whose tables grow with the square of the length of the expression.
+#
+# USAGE
+#   parse_bench.sh <tagstat> [<tagstat> ...]
+#
+
+if [ $# -lt 1 ]; then
+    echo "Usage: parse_bench.sh <tagstat> [<tagstat> ...]" >&2
+    exit 1
+fi
+
+dir=$(cd "$(dirname "$0")" && pwd)
+
+make -s -C "$dir" gen_ptags gen_expr fake_ptags.so || exit 5
+
+file=$(mktemp) || exit 5
+out=$(mktemp) || exit 5
+trap 'rm -f "$file" "$out"' EXIT
+
+# Under a page, older tagstats read no more than that of /proc/ptags
+"$dir/gen_ptags" 32 4 16 > "$file" || exit 5
+
+printf "%8s %-10s %10s %7s %10s  %s\n" chars shape seconds status checksum tagstat
+
+for chars in 10 100 1000 10000 100000; do
+    for shape in flat nested left groups escaped unbalanced; do
+        expr=$("$dir/gen_expr" $shape $chars) || exit 5
+
+        for tagstat in "$@"; do
+            start=$(date +%s%N)
+            LD_PRELOAD="$dir/fake_ptags.so" PTAGS_FILE="$file" timeout 60 "$tagstat" "$expr" > "$out" 2> /dev/null
+            status=$?
+            end=$(date +%s%N)
+
+            sum=$(cksum < "$out")
+
+            if [ $status -eq 124 ]; then
+                status=timeout
+            fi
+
+            awk -v c=${#expr} -v s=$shape -v t=$((end - start)) -v r=$status -v k="${sum%% *}" -v b="$tagstat" \
+                'BEGIN { printf "%8d %-10s %10.3f %7s %10s  %s\n", c, s, t/1e9, r, k, b }'
+        done
+    done
+done
@@ -0,0 +1,371 @@
+//
+// ptag_stress - fork latency during concurrent tagging and /proc/ptags reads
+// ---------------------------------------------------------------------------------------------------
+//
+// ptag_stress.c
+//
+// Description:
+// ---------------------------------------------------------------------------------------------------
+//
+// Runs three kinds of threads at once for 10 seconds (or the given number). Forkers are tagged and
+// fork children that exit right away, timing every fork until the child was reaped. Taggers keep
+// adding and removing tags of the forkers with sys_ptag, so their tag sets change while they fork.
+// Readers read all of /proc/ptags over and over. At the end the number of forks, the 50th and 99th
+// percentile and the longest time of a fork, and the tag changes and reads per second are printed.
+//
+// When readers held the lock of the tag list for a whole read, forks of tagged processes waited for
+// them, which shows in the 99th percentile. Running it with --readers 0 --taggers 0 gives the times
+// of the forks alone, and running it on kernels before and after a change shows what the change did.
+//
+// USAGE
+//   ptag_stress [--seconds <n>] [--forkers <n>] [--taggers <n>] [--readers <n>]
+//
+//   By default 4 threads of every kind run for 10 seconds.
+//
+// COMPILE WITH
+//   make
+//
+// EXIT CODES
+//   0 - Exit success:              the numbers were printed
+//
+//   1 - Incorrect usage:           unknown option
+//
+//   3 - Out of memory:             malloc failed
+//
+//   5 - IO error:                  threads could not be started or tagged
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+// System call number of sys_ptag in the patched kernel
+#if defined(__x86_64__)
+#define SYS_PTAG 299
+#else
+#define SYS_PTAG 337
+#endif
+
+#define MAX_THREADS 256     // Most threads of one kind
+#define STRESS_TAGS 16      // Tags the taggers pick from
+
+
+/*
+ * State of a forker thread
+ */
+struct forker {
+    pthread_t thread;
+    
+    pid_t     tid;          // Thread id the taggers tag, 0 until it's known
+    
+    uint64_t* times;        // Time of every fork in ns
+    long      count;        // Number of forks timed
+    long      size;         // Size of the times array
+    
+    int       failed;       // Set if fork or tagging failed
+};
+
+
+/*
+ * State of a tagger or reader thread
+ */
+struct worker {
+    pthread_t thread;
+    
+    long      ops;          // Tag changes or reads done
+    long      errors;       // Tag changes or reads that failed
+    uint32_t  seed;         // State of the pseudo-random sequence
+};
+
+
+static struct forker forkers[MAX_THREADS];
+static struct worker taggers[MAX_THREADS];
+static struct worker readers[MAX_THREADS];
+
+static int forker_count = 4;
+static int tagger_count = 4;
+static int reader_count = 4;
+
+static volatile int stop;   // Set when the threads have to stop
+
+
+static const char* const usage_str = "Usage:\n"
+                                     "\tptag_stress [--seconds <n>] [--forkers <n>] [--taggers <n>] [--readers <n>]\n\n"
+
+                                     "\tBy default 4 threads of every kind run for 10 seconds.\n";
+
+
+static void out_of_memory() {
+    fprintf(stderr, "ptag_stress: out of memory. qutting...\n");
+    exit(3);
+}
+
+
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+static uint32_t next_random(uint32_t* seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    
+    return *seed;
+}
+
+
+/*
+ * Tags its own thread, then times forks of children that exit right away
+ * until it has to stop
+ */
+static void* run_forker(void* arg) {
+    struct forker* self = arg;
+    pid_t tid = syscall(SYS_gettid);
+    
+    if(syscall(SYS_PTAG, tid, "ptag_stress", 'a') != 0) {
+        self->failed = 1;
+        return NULL;
+    }
+    
+    __sync_synchronize();
+    self->tid = tid;
+    
+    while(!stop) {
+        if(self->count == self->size) {
+            self->size = self->size*2 + 4096;
+            
+            self->times = realloc(self->times, self->size*sizeof(uint64_t));
+            if(self->times == NULL) {
+                out_of_memory();
+            }
+        }
+        
+        uint64_t start = now();
+        
+        pid_t pid = fork();
+        if(pid == 0) {
+            _exit(0);
+        }
+        
+        if(pid < 0) {
+            self->failed = 1;
+            break;
+        }
+        
+        waitpid(pid, NULL, 0);
+        
+        self->times[self->count++] = now() - start;
+    }
+    
+    return NULL;
+}
+
+
+/*
+ * Adds and removes tags of random forkers until it has to stop
+ */
+static void* run_tagger(void* arg) {
+    struct worker* self = arg;
+    char tag[32];
+    
+    while(!stop) {
+        uint32_t r = next_random(&self->seed);
+        pid_t tid = forkers[r % forker_count].tid;
+        
+        if(tid == 0) {
+            continue;
+        }
+        
+        snprintf(tag, sizeof(tag), "stress%u", (r >> 8) % STRESS_TAGS);
+        
+        // Tags of forkers that already stopped can't be changed, that's fine
+        long ret = syscall(SYS_PTAG, tid, tag, (r & 0x80) ? 'a' : 'r');
+        
+        self->errors += (ret != 0 && ret != 3);
+        self->ops++;
+    }
+    
+    return NULL;
+}
+
+
+/*
+ * Reads all of /proc/ptags over and over until it has to stop
+ */
+static void* run_reader(void* arg) {
+    struct worker* self = arg;
+    
+    char* buf = malloc(65536);
+    if(buf == NULL) {
+        out_of_memory();
+    }
+    
+    while(!stop) {
+        int fd = open("/proc/ptags", O_RDONLY);
+        if(fd < 0) {
+            self->errors++;
+            break;
+        }
+        
+        ssize_t bytes;
+        do {
+            bytes = read(fd, buf, 65536);
+        } while(bytes > 0 || (bytes < 0 && errno == EINTR));
+        
+        close(fd);
+        
+        self->errors += (bytes < 0);
+        self->ops++;
+    }
+    
+    free(buf);
+    return NULL;
+}
+
+
+static int compare_times(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Reads the number after an option, exits with code 1 if it isn't valid
+ */
+static long read_count(const char* arg, long max) {
+    char* end;
+    long n = strtol(arg, &end, 10);
+    
+    if(end == arg || *end != '\0' || n < 0 || n > max) {
+        fprintf(stderr, "ptag_stress: Incorrect usage.\n");
+        fprintf(stderr, usage_str);
+        
+        exit(1);
+    }
+    
+    return n;
+}
+
+
+int main(int argc, const char* argv[]) {
+    long seconds = 10;
+    
+    int argi;
+    for(argi = 1; argi < argc; argi++) {
+        if(strncmp(argv[argi], "--seconds", sizeof("--seconds")) == 0 && argi+1 < argc) {
+            seconds = read_count(argv[++argi], 1000000);
+        } else if(strncmp(argv[argi], "--forkers", sizeof("--forkers")) == 0 && argi+1 < argc) {
+            forker_count = read_count(argv[++argi], MAX_THREADS);
+        } else if(strncmp(argv[argi], "--taggers", sizeof("--taggers")) == 0 && argi+1 < argc) {
+            tagger_count = read_count(argv[++argi], MAX_THREADS);
+        } else if(strncmp(argv[argi], "--readers", sizeof("--readers")) == 0 && argi+1 < argc) {
+            reader_count = read_count(argv[++argi], MAX_THREADS);
+        } else {
+            seconds = 0;
+            break;
+        }
+    }
+    
+    if(seconds <= 0 || forker_count == 0) {
+        fprintf(stderr, "ptag_stress: Incorrect usage.\n");
+        fprintf(stderr, usage_str);
+        
+        return 1;
+    }
+    
+    int failed = 0;
+    int i;
+    
+    for(i = 0; i < forker_count; i++) {
+        failed |= pthread_create(&forkers[i].thread, NULL, run_forker, &forkers[i]);
+    }
+    
+    for(i = 0; i < tagger_count; i++) {
+        taggers[i].seed = 2463534242u + i;
+        failed |= pthread_create(&taggers[i].thread, NULL, run_tagger, &taggers[i]);
+    }
+    
+    for(i = 0; i < reader_count; i++) {
+        failed |= pthread_create(&readers[i].thread, NULL, run_reader, &readers[i]);
+    }
+    
+    if(failed) {
+        fprintf(stderr, "ptag_stress: error starting the threads\n");
+        return 5;
+    }
+    
+    sleep(seconds);
+    stop = 1;
+    
+    long forks = 0;
+    long tag_ops = 0, tag_errors = 0;
+    long reads = 0, read_errors = 0;
+    
+    for(i = 0; i < forker_count; i++) {
+        pthread_join(forkers[i].thread, NULL);
+        
+        forks += forkers[i].count;
+        failed |= forkers[i].failed;
+    }
+    
+    for(i = 0; i < tagger_count; i++) {
+        pthread_join(taggers[i].thread, NULL);
+        
+        tag_ops += taggers[i].ops;
+        tag_errors += taggers[i].errors;
+    }
+    
+    for(i = 0; i < reader_count; i++) {
+        pthread_join(readers[i].thread, NULL);
+        
+        reads += readers[i].ops;
+        read_errors += readers[i].errors;
+    }
+    
+    if(failed || forks == 0) {
+        fprintf(stderr, "ptag_stress: error forking or tagging, is this the patched kernel?\n");
+        return 5;
+    }
+    
+    uint64_t* times = malloc(forks*sizeof(uint64_t));
+    if(times == NULL) {
+        out_of_memory();
+    }
+    
+    long at = 0;
+    for(i = 0; i < forker_count; i++) {
+        memcpy(times + at, forkers[i].times, forkers[i].count*sizeof(uint64_t));
+        at += forkers[i].count;
+        
+        free(forkers[i].times);
+    }
+    
+    qsort(times, forks, sizeof(uint64_t), compare_times);
+    
+    printf("%d forkers, %d taggers, %d readers, %ld s\n", forker_count, tagger_count, reader_count, seconds);
+    printf("forks:       %ld (%.0f/s)\n", forks, (double)forks/seconds);
+    printf("fork p50:    %.1f us\n", times[forks/2]/1e3);
+    printf("fork p99:    %.1f us\n", times[forks*99/100]/1e3);
+    printf("fork max:    %.1f us\n", times[forks-1]/1e3);
+    printf("tag changes: %.0f/s, %ld failed\n", (double)tag_ops/seconds, tag_errors);
+    printf("reads:       %.0f/s, %ld failed\n", (double)reads/seconds, read_errors);
+    
+    free(times);
+    
+    return 0;
+}
@@ -0,0 +1,46 @@
+#!/bin/bash
+#
+# scan_bench - /proc/ptags parsing throughput of tagstat
+# ---------------------------------------------------------------------------------------------------
+#
+# Writes a synthetic snapshot of about 100 MB (see gen_ptags.c) and has every given tagstat match it
+# against a tag no process has, so nothing is printed and the time is spent reading and splitting the
+# lines. Prints the best of three runs and the throughput in MB/s for each binary. To see what a
+# change gained, give a tagstat built before the change as well.
+#
+# USAGE
+#   scan_bench.sh <tagstat> [<tagstat> ...]
+#
+
+if [ $# -lt 1 ]; then
+    echo "Usage: scan_bench.sh <tagstat> [<tagstat> ...]" >&2
+    exit 1
+fi
+
+dir=$(cd "$(dirname "$0")" && pwd)
+
+make -s -C "$dir" gen_ptags fake_ptags.so || exit 5
+
+file=$(mktemp) || exit 5
+trap 'rm -f "$file"' EXIT
+
+"$dir/gen_ptags" 800000 4 > "$file" || exit 5
+
+bytes=$(stat -c %s "$file")
+echo "$bytes bytes"
+printf "%10s %8s  %s\n" seconds MB/s tagstat
+
+for tagstat in "$@"; do
+    best=
+    for run in 1 2 3; do
+        start=$(date +%s%N)
+        LD_PRELOAD="$dir/fake_ptags.so" PTAGS_FILE="$file" "$tagstat" nosuchtag > /dev/null
+        end=$(date +%s%N)
+
+        if [ -z "$best" ] || [ $((end - start)) -lt $best ]; then
+            best=$((end - start))
+        fi
+    done
+
+    awk -v b=$best -v n=$bytes -v t="$tagstat" 'BEGIN { printf "%10.3f %8.0f  %s\n", b/1e9, n/1e6/(b/1e9), t }'
+done
@@ -0,0 +1,346 @@
+//
+// tagd_load - load generator for tagd
+// ---------------------------------------------------------------------------------------------------
+//
+// tagd_load.c
+//
+// Description:
+// ---------------------------------------------------------------------------------------------------
+//
+// Opens a number of connections to a running tagd and has each of them send the same single tag
+// query over and over, the next one as soon as the previous reply arrived, like health checks of many
+// services would. After the given time the queries answered per second and the 50th and 99th
+// percentile of the time from sending a query to having read the whole reply are printed.
+//
+// Every connection is driven by its own thread so the latencies include the time a query waits while
+// tagd serves the other clients from its poll() loop.
+//
+// USAGE
+//   tagd_load [--clients <n>] [--seconds <n>] [--socket <path>] <tag>
+//
+//   --clients <n> opens <n> connections, 100 by default.
+//
+//   --seconds <n> sends queries for <n> seconds, 5 by default.
+//
+//   --socket <path> connects to <path> instead of the socket tagd
+//   listens on by default.
+//
+// COMPILE WITH
+//   make
+//
+// EXIT CODES
+//   0 - Exit success:              the numbers were printed
+//
+//   1 - Incorrect usage:           unknown option
+//
+//   3 - Out of memory:             malloc failed
+//
+//   5 - IO error:                  tagd couldn't be reached or stopped answering
+//
+
+#include "libptag.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Protocol spoken over the socket, has to match tagd/tagd.c
+ */
+#define TAGD_MAGIC 0x44474154   // "TAGD"
+
+struct tagd_request {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t size;
+};
+
+struct tagd_reply {
+    uint32_t magic;
+    int32_t  status;
+    uint32_t count;
+    uint32_t size;
+};
+
+/*
+ * One connection and the latencies of the queries it sent
+ */
+struct client {
+    pthread_t thread;
+    int       fd;
+    
+    uint64_t* latencies;    // Nanoseconds from sending each query to having read its reply
+    size_t    count;        // Number of answered queries
+    size_t    size;         // Number of latencies there's room for
+    int       failed;       // Non-zero if tagd stopped answering
+};
+
+
+static struct sockaddr_un addr;     // Where tagd listens
+
+static char*    sel;                // The query every client sends
+static size_t   sel_size;           // Size of sel in bytes
+static uint64_t stop_at;            // When the clients stop sending, in CLOCK_MONOTONIC nanoseconds
+
+
+static const char* const usage_str = "Usage:\n"
+                                     "\ttagd_load [--clients <n>] [--seconds <n>] [--socket <path>] <tag>\n\n"
+
+                                     "\t--clients <n> opens <n> connections, 100 by default.\n\n"
+
+                                     "\t--seconds <n> sends queries for <n> seconds, 5 by default.\n\n"
+
+                                     "\t--socket <path> connects to <path> instead of the socket tagd\n"
+                                     "\tlistens on by default.\n";
+
+
+static void out_of_memory() {
+    fprintf(stderr, "tagd_load: out of memory. qutting...\n");
+    exit(3);
+}
+
+
+static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+/*
+ * Sends or receives exactly 'len' bytes over a socket
+ *
+ *  RETURN VALUE
+ *      0 on success, -1 if the socket failed or was closed
+ */
+static int transfer(int fd, void* buf, size_t len, int sending) {
+    while(len > 0) {
+        ssize_t bytes = sending ? send(fd, buf, len, MSG_NOSIGNAL) : recv(fd, buf, len, 0);
+        if(bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        
+        if(bytes <= 0) {
+            return -1;
+        }
+        
+        buf  = (char*)buf + bytes;
+        len -= bytes;
+    }
+    
+    return 0;
+}
+
+
+/*
+ * Builds a selector matching the processes that have the tag
+ */
+static void build_selector(const char* tag) {
+    uint32_t len = strlen(tag);
+    
+    sel_size = sizeof(struct ptag_sel_header) + sizeof(uint32_t) + ((len + 3) & ~3) + sizeof(uint32_t);
+    
+    sel = calloc(1, sel_size);
+    if(sel == NULL) {
+        out_of_memory();
+    }
+    
+    struct ptag_sel_header hdr = { PTAG_SEL_MAGIC, 1, 1 };
+    uint32_t insn = PTAG_SEL_TAG;
+    
+    memcpy(sel, &hdr, sizeof(hdr));
+    memcpy(sel + sizeof(hdr), &len, sizeof(len));
+    memcpy(sel + sizeof(hdr) + sizeof(len), tag, len);
+    memcpy(sel + sel_size - sizeof(insn), &insn, sizeof(insn));
+}
+
+
+/*
+ * Sends queries until stop_at, every one after the reply to the last
+ *
+ *  PARAMETERS
+ *      arg - the struct client
+ */
+static void* run_client(void* arg) {
+    struct client* c = arg;
+    
+    struct tagd_request req = { TAGD_MAGIC, 0, sel_size };
+    char* data = NULL;
+    size_t data_size = 0;
+    
+    while(now() < stop_at) {
+        uint64_t start = now();
+        
+        struct tagd_reply reply;
+        if(transfer(c->fd, &req, sizeof(req), 1) != 0 || transfer(c->fd, sel, sel_size, 1) != 0 ||
+           transfer(c->fd, &reply, sizeof(reply), 0) != 0 || reply.magic != TAGD_MAGIC) {
+            c->failed = 1;
+            break;
+        }
+        
+        if(reply.size > data_size) {
+            free(data);
+            
+            data_size = reply.size;
+            data = malloc(data_size);
+            if(data == NULL) {
+                out_of_memory();
+            }
+        }
+        
+        if(transfer(c->fd, data, reply.size, 0) != 0) {
+            c->failed = 1;
+            break;
+        }
+        
+        if(c->count == c->size) {
+            c->size = c->size ? c->size*2 : 4096;
+            c->latencies = realloc(c->latencies, c->size*sizeof(uint64_t));
+            if(c->latencies == NULL) {
+                out_of_memory();
+            }
+        }
+        
+        c->latencies[c->count++] = now() - start;
+    }
+    
+    free(data);
+    
+    return NULL;
+}
+
+
+static int compare_latencies(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    
+    return (x > y) - (x < y);
+}
+
+
+int main(int argc, const char* argv[]) {
+    long client_count = 100;
+    long seconds = 5;
+    const char* path = NULL;
+    const char* tag = NULL;
+    
+    int argi;
+    for(argi = 1; argi < argc; argi++) {
+        if(strncmp(argv[argi], "--clients", sizeof("--clients")) == 0 && argi+1 < argc) {
+            client_count = strtol(argv[++argi], NULL, 10);
+        } else if(strncmp(argv[argi], "--seconds", sizeof("--seconds")) == 0 && argi+1 < argc) {
+            seconds = strtol(argv[++argi], NULL, 10);
+        } else if(strncmp(argv[argi], "--socket", sizeof("--socket")) == 0 && argi+1 < argc) {
+            path = argv[++argi];
+        } else if(tag == NULL && argv[argi][0] != '-') {
+            tag = argv[argi];
+        } else {
+            tag = NULL;
+            break;
+        }
+    }
+    
+    if(tag == NULL || *tag == '\0' || client_count <= 0 || seconds <= 0) {
+        fprintf(stderr, "tagd_load: Incorrect usage.\n");
+        fprintf(stderr, usage_str);
+        
+        return 1;
+    }
+    
+    addr.sun_family = AF_UNIX;
+    
+    // The same places tagd picks from
+    const char* dir = getenv("XDG_RUNTIME_DIR");
+    if(path == NULL) {
+        path = getenv("TAGD_SOCKET");
+    }
+    
+    if(path != NULL && *path != '\0') {
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    } else if(dir != NULL && *dir != '\0') {
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/tagd.sock", dir);
+    } else {
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/tagd-%u.sock", (unsigned)getuid());
+    }
+    
+    build_selector(tag);
+    
+    struct client* clients = calloc(client_count, sizeof(struct client));
+    if(clients == NULL) {
+        out_of_memory();
+    }
+    
+    // Connect everyone first so the threads start sending at about the same time
+    long i;
+    for(i = 0; i < client_count; i++) {
+        clients[i].fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        
+        if(clients[i].fd < 0 || connect(clients[i].fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            fprintf(stderr, "tagd_load: error connecting to %s: %s\n", addr.sun_path, strerror(errno));
+            return 5;
+        }
+    }
+    
+    uint64_t start = now();
+    stop_at = start + (uint64_t)seconds*1000000000;
+    
+    for(i = 0; i < client_count; i++) {
+        if(pthread_create(&clients[i].thread, NULL, run_client, &clients[i]) != 0) {
+            fprintf(stderr, "tagd_load: error starting client %ld: %s\n", i, strerror(errno));
+            return 5;
+        }
+    }
+    
+    size_t total = 0;
+    int failed = 0;
+    
+    for(i = 0; i < client_count; i++) {
+        pthread_join(clients[i].thread, NULL);
+        close(clients[i].fd);
+        
+        total  += clients[i].count;
+        failed |= clients[i].failed;
+    }
+    
+    double elapsed = (now() - start)/1e9;
+    
+    if(failed || total == 0) {
+        fprintf(stderr, "tagd_load: tagd stopped answering\n");
+        return 5;
+    }
+    
+    uint64_t* all = malloc(total*sizeof(uint64_t));
+    if(all == NULL) {
+        out_of_memory();
+    }
+    
+    size_t off = 0;
+    for(i = 0; i < client_count; i++) {
+        memcpy(all + off, clients[i].latencies, clients[i].count*sizeof(uint64_t));
+        off += clients[i].count;
+        
+        free(clients[i].latencies);
+    }
+    
+    qsort(all, total, sizeof(uint64_t), compare_latencies);
+    
+    printf("clients  %ld\n", client_count);
+    printf("queries  %zu\n", total);
+    printf("qps      %.0f\n", total/elapsed);
+    printf("p50      %.1f us\n", all[total/2]/1e3);
+    printf("p99      %.1f us\n", all[total*99/100]/1e3);
+    
+    free(all);
+    free(clients);
+    free(sel);
+    
+    return 0;
+}
@@ -0,0 +1,52 @@
+#!/bin/bash
+#
+# thread_bench - scaling of tagstat --threads
+# ---------------------------------------------------------------------------------------------------
+#
+# Matches one synthetic snapshot (see gen_ptags.c) with 1, 2, 4, 8, 16, 32 and 64 threads and prints
+# the best of three runs for each along with the speedup over one thread. The snapshot is 500000
+# processes with 4 tags each, about 60 MB, unless <processes> is given. The output of tagstat goes to
+# /dev/null so mostly the scan and the matching are measured.
+#
+# USAGE
+#   thread_bench.sh <tagstat> [<expr>] [<processes>]
+#
+#   <expr> defaults to 'tag1 && !tag2 || tag3 ^^ tag4'.
+#
+
+if [ $# -lt 1 ] || [ $# -gt 3 ]; then
+    echo "Usage: thread_bench.sh <tagstat> [<expr>] [<processes>]" >&2
+    exit 1
+fi
+
+dir=$(cd "$(dirname "$0")" && pwd)
+tagstat=$1
+expr=${2:-'tag1 && !tag2 || tag3 ^^ tag4'}
+procs=${3:-500000}
+
+make -s -C "$dir" gen_ptags fake_ptags.so || exit 5
+
+file=$(mktemp) || exit 5
+trap 'rm -f "$file"' EXIT
+
+"$dir/gen_ptags" "$procs" 4 > "$file" || exit 5
+
+echo "$(stat -c %s "$file") bytes, $procs processes"
+printf "%8s %10s %8s\n" threads seconds speedup
+
+base=
+for threads in 1 2 4 8 16 32 64; do
+    best=
+    for run in 1 2 3; do
+        start=$(date +%s%N)
+        LD_PRELOAD="$dir/fake_ptags.so" PTAGS_FILE="$file" "$tagstat" --threads $threads "$expr" > /dev/null
+        end=$(date +%s%N)
+
+        if [ -z "$best" ] || [ $((end - start)) -lt $best ]; then
+            best=$((end - start))
+        fi
+    done
+
+    base=${base:-$best}
+    awk -v t=$threads -v b=$best -v s=$base 'BEGIN { printf "%8d %10.3f %7.2fx\n", t, b/1e9, s/b }'
+done
@@ -0,0 +1,125 @@
+//
+// libptag - reader for the binary ptag interface
+// ---------------------------------------------------------------------------------------------------
+//
+// libptag.c
+//
+// Description:
+// ---------------------------------------------------------------------------------------------------
+//
+// Implementation of the functions declared in libptag.h
+//
+
+#include "libptag.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+
+int ptag_snapshot_read(struct ptag_snapshot* snap) {
+    int ptags_pfd = open("/proc/ptags_bin", O_RDONLY);
+    if(ptags_pfd < 0) {
+        return -1;
+    }
+    
+    snap->len = 0;
+    
+    while(1) {
+        if(snap->len == snap->size) {
+            // Grow the buffer, starting big enough for most systems
+            size_t size = (snap->size == 0) ? 64*1024 : snap->size*2;
+            
+            char* bigger = realloc(snap->buf, size);
+            if(bigger == NULL) {
+                close(ptags_pfd);
+                
+                errno = ENOMEM;
+                return -1;
+            }
+            
+            snap->buf  = bigger;
+            snap->size = size;
+        }
+        
+        ssize_t bytes = read(ptags_pfd, snap->buf + snap->len, snap->size - snap->len);
+        if(bytes < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            
+            int err = errno;
+            close(ptags_pfd);
+            
+            errno = err;
+            return -1;
+        }
+        
+        if(bytes == 0) {    // End of file
+            break;
+        }
+        
+        snap->len += bytes;
+    }
+    
+    close(ptags_pfd);
+    
+    const struct ptag_bin_header* hdr = (const struct ptag_bin_header*)snap->buf;
+    if(snap->len < sizeof(struct ptag_bin_header) || hdr->magic != PTAG_BIN_MAGIC || hdr->version != PTAG_BIN_VERSION) {
+        snap->len = 0;
+        
+        errno = EPROTO;
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+void ptag_snapshot_free(struct ptag_snapshot* snap) {
+    free(snap->buf);
+    
+    snap->buf  = NULL;
+    snap->len  = 0;
+    snap->size = 0;
+}
+
+
+/*
+ * Returns the record at 'offset' bytes into the snapshot or NULL
+ * if there isn't a complete record there
+ */
+static const struct ptag_bin_record* record_at(const struct ptag_snapshot* snap, size_t offset) {
+    if(snap->len < offset || snap->len - offset < sizeof(struct ptag_bin_record)) {
+        return NULL;
+    }
+    
+    const struct ptag_bin_record* rec = (const struct ptag_bin_record*)(snap->buf + offset);
+    if(rec->size < sizeof(struct ptag_bin_record) || rec->size > snap->len - offset) {
+        return NULL;
+    }
+    
+    return rec;
+}
+
+
+const struct ptag_bin_record* ptag_first_record(const struct ptag_snapshot* snap) {
+    return record_at(snap, sizeof(struct ptag_bin_header));
+}
+
+
+const struct ptag_bin_record* ptag_next_record(const struct ptag_snapshot* snap, const struct ptag_bin_record* rec) {
+    return record_at(snap, ((const char*)rec - snap->buf) + rec->size);
+}
+
+
+const struct ptag_bin_tag* ptag_first_tag(const struct ptag_bin_record* rec) {
+    return (const struct ptag_bin_tag*)(rec + 1);
+}
+
+
+const struct ptag_bin_tag* ptag_next_tag(const struct ptag_bin_tag* tag) {
+    // Tag strings are padded to a multiple of 4 bytes
+    return (const struct ptag_bin_tag*)(tag->tag + ((tag->len + 3) & ~(uint32_t)3));
+}
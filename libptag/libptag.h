@@ -0,0 +1,282 @@
+//
+// libptag - reader for the binary ptag interface
+// ---------------------------------------------------------------------------------------------------
+//
+// libptag.h
+//
+// Description:
+// ---------------------------------------------------------------------------------------------------
+//
+// Small library for programs that poll the tags of processes often. Instead of formatting and then
+// parsing text from /proc/ptags, the kernel writes packed records to /proc/ptags_bin which are walked
+// in place, no tag is ever copied. A snapshot can be read again and again, the buffer it holds is
+// reused between reads.
+//
+// Programs that need to know which processes carry a tag at all times can keep a ptag_index instead,
+// which is built from one snapshot and then kept up to date from the records of /proc/ptags_events,
+// so the work done is proportional to the number of changes rather than to the number of tags.
+//
+// EXAMPLE
+//   struct ptag_snapshot snap = PTAG_SNAPSHOT_INIT;
+//
+//   if(ptag_snapshot_read(&snap) == 0) {
+//       const struct ptag_bin_record* rec;
+//
+//       for(rec = ptag_first_record(&snap); rec != NULL; rec = ptag_next_record(&snap, rec)) {
+//           const struct ptag_bin_tag* tag = ptag_first_tag(rec);
+//
+//           uint32_t i;
+//           for(i = 0; i < rec->tag_count; i++, tag = ptag_next_tag(tag)) {
+//               printf("%d : %.*s : %c\n", rec->pid, (int)tag->len, tag->tag, rec->state);
+//           }
+//       }
+//   }
+//
+//   ptag_snapshot_free(&snap);
+//
+//   struct ptag_index* idx = ptag_index_open();
+//   struct pollfd pfd = { ptag_index_fd(idx), POLLIN, 0 };
+//
+//   while(poll(&pfd, 1, -1) > 0 && ptag_index_update(idx) >= 0) {
+//       printf("%lu processes tagged web\n", (unsigned long)ptag_index_pids(idx, "web", 3, NULL, 0));
+//   }
+//
+//   ptag_index_close(idx);
+//
+// COMPILE WITH
+//   make, then link against libptag.a
+//
+
+#ifndef LIBPTAG_H
+#define LIBPTAG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Binary format of /proc/ptags_bin, these have to match the definitions
+ * in include/ptag/ptag.h of the kernel patch. The file starts with a
+ * ptag_bin_header followed by one ptag_bin_record for each tagged process.
+ * Each record is followed by 'tag_count' tags, a ptag_bin_tag holding the
+ * length of the tag followed by the tag string (not null terminated) padded
+ * with zeros to a multiple of 4 bytes. 'size' is the size of the whole
+ * record including its tags. All fields are in native byte order.
+ */
+#define PTAG_BIN_MAGIC   0x47415450     // "PTAG"
+#define PTAG_BIN_VERSION 1
+
+struct ptag_bin_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct ptag_bin_record {
+    int32_t  pid;
+    uint32_t size;
+    uint32_t tag_count;
+    char     state;         // first letter of the process state, e.g. 'R' or 'S'
+    char     pad[3];
+};
+
+struct ptag_bin_tag {
+    uint32_t len;
+    char     tag[];
+};
+
+
+/*
+ * Contents of /proc/ptags_bin as of the last call to ptag_snapshot_read()
+ */
+struct ptag_snapshot {
+    char*  buf;     // Contents of the proc entry
+    size_t len;     // Number of bytes read into buf
+    size_t size;    // Number of bytes allocated for buf
+};
+
+#define PTAG_SNAPSHOT_INIT { NULL, 0, 0 }
+
+
+/*
+ * Reads the whole of /proc/ptags_bin into a snapshot, reusing
+ * the memory the snapshot already holds when possible.
+ *
+ *  RETURN VALUE
+ *      0 on success, -1 on failure with errno set. errno is EPROTO
+ *      if the file doesn't start with a header this library knows.
+ */
+int ptag_snapshot_read(struct ptag_snapshot* snap);
+
+/*
+ * Free's the memory held by a snapshot, it can be read into again afterwards
+ */
+void ptag_snapshot_free(struct ptag_snapshot* snap);
+
+/*
+ * Iterate the records of a snapshot, records are in ascending pid order.
+ * Both return NULL when there are no more records or if the next record
+ * does not fit in the snapshot.
+ */
+const struct ptag_bin_record* ptag_first_record(const struct ptag_snapshot* snap);
+const struct ptag_bin_record* ptag_next_record(const struct ptag_snapshot* snap, const struct ptag_bin_record* rec);
+
+/*
+ * Iterate the tags of a record, there are exactly rec->tag_count of them.
+ * The tag strings point into the snapshot and are not null terminated.
+ */
+const struct ptag_bin_tag* ptag_first_tag(const struct ptag_bin_record* rec);
+const struct ptag_bin_tag* ptag_next_tag(const struct ptag_bin_tag* tag);
+
+/*
+ * Records of /proc/ptags_events, these have to match the definitions in
+ * include/ptag/ptag.h of the kernel patch. A read returns whole records
+ * and needs a buffer of at least PTAG_EVENT_MAX bytes. The tag string
+ * (not null terminated) follows the record padded with zeros to a
+ * multiple of 4 bytes, 'size' is the size of the whole record.
+ */
+#define PTAG_EVENT_ADD   1      // 'tag' was added to process 'pid'
+#define PTAG_EVENT_DEL   2      // 'tag' was removed from process 'pid'
+#define PTAG_EVENT_CLEAR 3      // process 'pid' lost all of its tags
+#define PTAG_EVENT_FORK  4      // process 'pid' was forked by 'ppid' and has the same tags
+#define PTAG_EVENT_EXIT  5      // process 'pid' had tags and was released
+#define PTAG_EVENT_LOST  6      // records were lost, start over from /proc/ptags_bin
+
+#define PTAG_EVENT_MAX 16384
+
+struct ptag_event {
+    uint32_t size;
+    uint16_t op;
+    uint16_t pad;
+    int32_t  pid;
+    int32_t  ppid;
+    uint32_t uid;
+    uint32_t tag_len;
+    char     tag[];
+};
+
+
+/*
+ * Compiled tag selector, the format sys_ptag_kill() takes. These have to
+ * match the definitions in include/ptag/ptag.h of the kernel patch. A
+ * ptag_sel_header is followed by 'tag_count' tags laid out like the tags
+ * of /proc/ptags_bin and then by 'insn_count' uint32_t instructions of a
+ * postfix program, opcode in the low 8 bits and tag number in the upper 24.
+ */
+#define PTAG_SEL_MAGIC    0x4c455350    // "PSEL"
+#define PTAG_SEL_MAX_SIZE (1 << 20)
+
+#define PTAG_SEL_TAG 0      // Pushes 1 if the process has tag number 'arg', otherwise 0
+#define PTAG_SEL_NOT 1      // Negates the value on top of the stack
+#define PTAG_SEL_AND 2      // Pops two values and pushes their AND
+#define PTAG_SEL_OR  3      // Pops two values and pushes their OR
+#define PTAG_SEL_XOR 4      // Pops two values and pushes their XOR
+
+struct ptag_sel_header {
+    uint32_t magic;
+    uint32_t tag_count;
+    uint32_t insn_count;
+};
+
+
+/*
+ * One operation of a sys_ptag_batch() call, these have to match the
+ * definitions in include/ptag/ptag.h of the kernel patch. 'mode' is the
+ * mode sys_ptag() takes and 'status' is filled in by the kernel with the
+ * value sys_ptag() would have returned for the operation.
+ */
+#define PTAG_BATCH_MAX 65536    // Most operations sys_ptag_batch() accepts in one call
+
+struct ptag_batch_entry {
+    const char* tag;
+    int32_t     pid;
+    int32_t     mode;
+    int32_t     status;
+    uint32_t    pad;
+};
+
+
+/*
+ * Index from every tag to the processes carrying it, see ptag_index.c
+ */
+struct ptag_index;
+
+/*
+ * Opens /proc/ptags_events and builds an index from a snapshot of
+ * /proc/ptags_bin, changes made while the snapshot is read are picked
+ * up by the first ptag_index_update().
+ *
+ *  RETURN VALUE
+ *      the index or NULL on failure with errno set
+ */
+struct ptag_index* ptag_index_open(void);
+
+/*
+ * Returns the file descriptor of /proc/ptags_events, it is readable
+ * (POLLIN) whenever ptag_index_update() has changes to apply
+ */
+int ptag_index_fd(const struct ptag_index* idx);
+
+/*
+ * Applies all changes that are waiting without blocking. If the kernel
+ * dropped changes because they weren't read fast enough the index is
+ * built again from a new snapshot.
+ *
+ *  RETURN VALUE
+ *      the number of records applied, -1 on failure with errno set
+ */
+int ptag_index_update(struct ptag_index* idx);
+
+/*
+ * Looks up the processes carrying a tag, the same way sys_ptag_query()
+ * does. The tag doesn't have to be null terminated.
+ *
+ *  PARAMETERS
+ *      tag  - the tag
+ *      len  - the length of the tag
+ *      pids - where to store the process IDs, in no particular order
+ *      max  - the number of process IDs pids has room for
+ *
+ *  RETURN VALUE
+ *      the number of processes carrying the tag, which may be more than max
+ */
+size_t ptag_index_pids(const struct ptag_index* idx, const char* tag, size_t len, pid_t* pids, size_t max);
+
+/*
+ * Looks up the tags of a process, in the order they were added. The tag
+ * strings point into the index and are not null terminated, they stay
+ * valid until the next call to ptag_index_update().
+ *
+ *  PARAMETERS
+ *      pid  - the process
+ *      tags - where to store the tags
+ *      lens - where to store the length of each tag
+ *      max  - the number of tags tags and lens have room for
+ *
+ *  RETURN VALUE
+ *      the number of tags of the process, which may be more than max
+ */
+size_t ptag_index_tags(const struct ptag_index* idx, pid_t pid, const char** tags, uint32_t* lens, size_t max);
+
+/*
+ * Finds the tagged processes matching a selector, the same way
+ * sys_ptag_kill() with signal 0 does. Processes without tags never match.
+ *
+ *  PARAMETERS
+ *      sel  - the selector, see struct ptag_sel_header
+ *      size - the size of the selector in bytes
+ *      pids - where to store the process IDs, in no particular order
+ *      max  - the number of process IDs pids has room for
+ *
+ *  RETURN VALUE
+ *      the number of matching processes, which may be more than max, or
+ *      -1 on failure with errno set. errno is EINVAL if the selector is
+ *      malformed.
+ */
+long ptag_index_select(struct ptag_index* idx, const void* sel, size_t size, pid_t* pids, size_t max);
+
+/*
+ * Closes /proc/ptags_events and free's the index
+ */
+void ptag_index_close(struct ptag_index* idx);
+
+#endif
@@ -0,0 +1,1019 @@
+//
+// libptag - reader for the binary ptag interface
+// ---------------------------------------------------------------------------------------------------
+//
+// ptag_index.c
+//
+// Description:
+// ---------------------------------------------------------------------------------------------------
+//
+// Live index from tags to the processes carrying them, declared in libptag.h. The index is built from
+// a snapshot of /proc/ptags_bin and then kept up to date with the records of /proc/ptags_events.
+//
+// Tags are kept in an open addressing hash table, each tag with an open addressing hash set of the
+// pids carrying it. Processes are kept in a second table, each with the list of its tags, so that
+// clearing, forking or releasing a process only touches the tags of that process. All tables are
+// kept at most half full and use backward shift deletion, so nothing is ever rehashed on removal.
+//
+// Selectors are run against the tags of each process like sys_ptag_kill() runs them, except that a
+// selector that can't match a process without any of its tags only looks at the processes in the pid
+// sets of its tags. Each selector stamps the tags it names, so checking a tag of a process is a
+// comparison of the stamp instead of a lookup.
+//
+// The events read right after a snapshot may be older than the snapshot. Adding, removing and
+// clearing tags can be applied again without harm, a fork is only applied to a process that isn't
+// in the snapshot since the snapshot of a process is always taken after it was forked. A process
+// forked while the snapshot is read from a parent whose tags changed in the meantime can still
+// end up with the parent's newer tags until its own tags change.
+//
+
+#include "libptag.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define TABLE_MIN_SIZE 16   // Smallest number of slots of any table, a power of 2
+
+
+/*
+ * Open addressing hash set of process IDs, 0 marks an empty slot
+ * since no tagged process has pid 0
+ */
+struct pid_set {
+    pid_t* slots;
+    size_t size;        // Number of slots, a power of 2 or 0
+    size_t count;       // Number of pids in the set
+};
+
+struct index_tag {
+    struct pid_set pids;    // Processes carrying the tag
+    uint32_t hash;
+    uint32_t len;
+    uint32_t stamp;         // Stamp of the last selector that names the tag
+    uint32_t bit;           // Bit of the tag in that selector's tag bits
+    char     tag[];         // Not null terminated
+};
+
+struct index_proc {
+    pid_t              pid;
+    int                from_snapshot;   // Non-zero if the process was read from the last snapshot
+    uint32_t           stamp;           // Stamp of the last selector that checked the process
+    size_t             count;           // Number of tags in 'tags'
+    size_t             size;            // Number of tags 'tags' has room for
+    struct index_tag** tags;
+};
+
+/*
+ * Open addressing hash table of tags or processes, NULL marks an empty slot
+ */
+struct ptr_table {
+    void** slots;
+    size_t size;        // Number of slots, a power of 2 or 0
+    size_t count;       // Number of entries in the table
+};
+
+struct ptag_index {
+    int                  events_fd;     // /proc/ptags_events
+    struct ptr_table     tags;          // struct index_tag* hashed by tag string
+    struct ptr_table     procs;         // struct index_proc* hashed by pid
+    struct ptag_snapshot snap;          // Reused for every snapshot that has to be read
+    int                  initial;       // Non-zero until the events after a snapshot were applied
+    uint32_t             stamp;         // Stamp of the last selector that was run, see ptag_index_select()
+    char*                buf;           // PTAG_EVENT_MAX bytes that records are read into
+};
+
+
+/*
+ * Hash functions, FNV-1a for tags and a multiplicative hash for pids
+ */
+static uint32_t hash_tag(const char* tag, size_t len) {
+    uint32_t h = 2166136261u;
+    
+    size_t i;
+    for(i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)tag[i]) * 16777619u;
+    }
+    
+    return h;
+}
+
+
+static uint32_t hash_pid(pid_t pid) {
+    return (uint32_t)pid * 0x9E3779B1u;
+}
+
+
+static uint32_t tag_entry_hash(const void* entry) {
+    return ((const struct index_tag*)entry)->hash;
+}
+
+
+static uint32_t proc_entry_hash(const void* entry) {
+    return hash_pid(((const struct index_proc*)entry)->pid);
+}
+
+
+/*
+ * Returns the slot of 'pid' in the set or the empty slot where it
+ * would go, the set must have at least one slot
+ */
+static size_t pid_set_slot(const struct pid_set* set, pid_t pid) {
+    size_t i = hash_pid(pid) & (set->size-1);
+    
+    while(set->slots[i] != 0 && set->slots[i] != pid) {
+        i = (i+1) & (set->size-1);
+    }
+    
+    return i;
+}
+
+
+/*
+ * Adds a pid to the set
+ *
+ *  RETURN VALUE
+ *      1 if it was added, 0 if it was already there, -1 if memory could
+ *      not be allocated
+ */
+static int pid_set_add(struct pid_set* set, pid_t pid) {
+    if( (set->count+1)*2 > set->size ) {
+        struct pid_set bigger;
+        
+        bigger.size  = (set->size > 0) ? set->size*2 : TABLE_MIN_SIZE;
+        bigger.count = set->count;
+        bigger.slots = calloc(bigger.size, sizeof(pid_t));
+        if(bigger.slots == NULL) {
+            return -1;
+        }
+        
+        size_t i;
+        for(i = 0; i < set->size; i++) {
+            if(set->slots[i] != 0) {
+                bigger.slots[pid_set_slot(&bigger, set->slots[i])] = set->slots[i];
+            }
+        }
+        
+        free(set->slots);
+        *set = bigger;
+    }
+    
+    size_t i = pid_set_slot(set, pid);
+    if(set->slots[i] == pid) {
+        return 0;
+    }
+    
+    set->slots[i] = pid;
+    set->count++;
+    
+    return 1;
+}
+
+
+/*
+ * Removes a pid from the set, returns non-zero if it was there
+ */
+static int pid_set_del(struct pid_set* set, pid_t pid) {
+    if(set->count == 0) {
+        return 0;
+    }
+    
+    size_t i = pid_set_slot(set, pid);
+    if(set->slots[i] != pid) {
+        return 0;
+    }
+    
+    // Backward shift deletion, move later pids of the probe run into the hole
+    size_t j = i;
+    while(1) {
+        j = (j+1) & (set->size-1);
+        if(set->slots[j] == 0) {
+            break;
+        }
+        
+        size_t home = hash_pid(set->slots[j]) & (set->size-1);
+        if( ((j - home) & (set->size-1)) >= ((j - i) & (set->size-1)) ) {
+            set->slots[i] = set->slots[j];
+            i = j;
+        }
+    }
+    
+    set->slots[i] = 0;
+    set->count--;
+    
+    return 1;
+}
+
+
+/*
+ * Makes room for one more entry in a table
+ *
+ *  RETURN VALUE
+ *      0 on success, -1 if memory could not be allocated
+ */
+static int table_reserve(struct ptr_table* table, uint32_t (*entry_hash)(const void*)) {
+    if( (table->count+1)*2 <= table->size ) {
+        return 0;
+    }
+    
+    size_t size  = (table->size > 0) ? table->size*2 : TABLE_MIN_SIZE;
+    void** slots = calloc(size, sizeof(void*));
+    if(slots == NULL) {
+        return -1;
+    }
+    
+    size_t i;
+    for(i = 0; i < table->size; i++) {
+        if(table->slots[i] != NULL) {
+            size_t j = entry_hash(table->slots[i]) & (size-1);
+            
+            while(slots[j] != NULL) {
+                j = (j+1) & (size-1);
+            }
+            
+            slots[j] = table->slots[i];
+        }
+    }
+    
+    free(table->slots);
+    
+    table->slots = slots;
+    table->size  = size;
+    
+    return 0;
+}
+
+
+/*
+ * Empties slot 'i' of a table with backward shift deletion
+ */
+static void table_del(struct ptr_table* table, size_t i, uint32_t (*entry_hash)(const void*)) {
+    size_t j = i;
+    
+    while(1) {
+        j = (j+1) & (table->size-1);
+        if(table->slots[j] == NULL) {
+            break;
+        }
+        
+        size_t home = entry_hash(table->slots[j]) & (table->size-1);
+        if( ((j - home) & (table->size-1)) >= ((j - i) & (table->size-1)) ) {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
+    }
+    
+    table->slots[i] = NULL;
+    table->count--;
+}
+
+
+/*
+ * Returns the slot of a tag in the tag table or the empty slot
+ * where it would go, the table must have at least one slot
+ */
+static size_t tag_slot(const struct ptag_index* idx, const char* tag, size_t len, uint32_t hash) {
+    size_t i = hash & (idx->tags.size-1);
+    
+    while(idx->tags.slots[i] != NULL) {
+        const struct index_tag* entry = idx->tags.slots[i];
+        
+        if(entry->hash == hash && entry->len == len && memcmp(entry->tag, tag, len) == 0) {
+            break;
+        }
+        
+        i = (i+1) & (idx->tags.size-1);
+    }
+    
+    return i;
+}
+
+
+/*
+ * Returns the slot of a process in the process table or the empty
+ * slot where it would go, the table must have at least one slot
+ */
+static size_t proc_slot(const struct ptag_index* idx, pid_t pid) {
+    size_t i = hash_pid(pid) & (idx->procs.size-1);
+    
+    while(idx->procs.slots[i] != NULL && ((const struct index_proc*)idx->procs.slots[i])->pid != pid) {
+        i = (i+1) & (idx->procs.size-1);
+    }
+    
+    return i;
+}
+
+
+/*
+ * Returns the process with the given pid or NULL if it has no tags
+ */
+static struct index_proc* find_proc(const struct ptag_index* idx, pid_t pid) {
+    if(idx->procs.count == 0) {
+        return NULL;
+    }
+    
+    return idx->procs.slots[proc_slot(idx, pid)];
+}
+
+
+/*
+ * Undoes a failed index_add(), a tag no process carries and a process
+ * without tags are taken out of the index again. Either may be NULL.
+ */
+static void index_add_failed(struct ptag_index* idx, struct index_tag* entry, struct index_proc* proc) {
+    if(entry != NULL && entry->pids.count == 0) {
+        table_del(&idx->tags, tag_slot(idx, entry->tag, entry->len, entry->hash), tag_entry_hash);
+        
+        free(entry->pids.slots);
+        free(entry);
+    }
+    
+    if(proc != NULL && proc->count == 0) {
+        table_del(&idx->procs, proc_slot(idx, proc->pid), proc_entry_hash);
+        
+        free(proc->tags);
+        free(proc);
+    }
+}
+
+
+/*
+ * Gives process 'pid' the tag, creating the tag and the process as
+ * needed. Nothing is left behind if memory could not be allocated.
+ *
+ *  RETURN VALUE
+ *      0 on success, -1 if memory could not be allocated
+ */
+static int index_add(struct ptag_index* idx, pid_t pid, const char* tag, size_t len) {
+    if(table_reserve(&idx->tags, tag_entry_hash) != 0 || table_reserve(&idx->procs, proc_entry_hash) != 0) {
+        return -1;
+    }
+    
+    uint32_t hash = hash_tag(tag, len);
+    size_t   i    = tag_slot(idx, tag, len, hash);
+    
+    struct index_tag* entry = idx->tags.slots[i];
+    if(entry == NULL) {
+        entry = calloc(1, sizeof(struct index_tag) + len);
+        if(entry == NULL) {
+            return -1;
+        }
+        
+        entry->hash = hash;
+        entry->len  = len;
+        memcpy(entry->tag, tag, len);
+        
+        idx->tags.slots[i] = entry;
+        idx->tags.count++;
+    }
+    
+    size_t j = proc_slot(idx, pid);
+    
+    struct index_proc* proc = idx->procs.slots[j];
+    if(proc == NULL) {
+        proc = calloc(1, sizeof(struct index_proc));
+        if(proc == NULL) {
+            index_add_failed(idx, entry, NULL);
+            return -1;
+        }
+        
+        proc->pid = pid;
+        
+        idx->procs.slots[j] = proc;
+        idx->procs.count++;
+    }
+    
+    if(proc->count == proc->size) {
+        size_t size = (proc->size > 0) ? proc->size*2 : 4;
+        
+        struct index_tag** bigger = realloc(proc->tags, size*sizeof(struct index_tag*));
+        if(bigger == NULL) {
+            index_add_failed(idx, entry, proc);
+            return -1;
+        }
+        
+        proc->tags = bigger;
+        proc->size = size;
+    }
+    
+    int added = pid_set_add(&entry->pids, pid);
+    if(added < 0) {
+        index_add_failed(idx, entry, proc);
+        return -1;
+    }
+    
+    if(added) {
+        proc->tags[proc->count++] = entry;
+    }
+    
+    return 0;
+}
+
+
+/*
+ * Takes process 'pid' out of the pid set of a tag, the tag is free'd
+ * once no process carries it anymore
+ */
+static void index_drop_pid(struct ptag_index* idx, struct index_tag* entry, pid_t pid) {
+    pid_set_del(&entry->pids, pid);
+    
+    if(entry->pids.count == 0) {
+        table_del(&idx->tags, tag_slot(idx, entry->tag, entry->len, entry->hash), tag_entry_hash);
+        
+        free(entry->pids.slots);
+        free(entry);
+    }
+}
+
+
+/*
+ * Removes one tag from process 'pid' if it has it
+ */
+static void index_del(struct ptag_index* idx, pid_t pid, const char* tag, size_t len) {
+    struct index_proc* proc = find_proc(idx, pid);
+    if(proc == NULL) {
+        return;
+    }
+    
+    size_t i;
+    for(i = 0; i < proc->count; i++) {
+        struct index_tag* entry = proc->tags[i];
+        
+        if(entry->len == len && memcmp(entry->tag, tag, len) == 0) {
+            // Keep the remaining tags in the order they were added, like the kernel does
+            memmove(proc->tags + i, proc->tags + i+1, (--proc->count - i)*sizeof(struct index_tag*));
+            index_drop_pid(idx, entry, pid);
+            break;
+        }
+    }
+    
+    if(proc->count == 0) {
+        table_del(&idx->procs, proc_slot(idx, pid), proc_entry_hash);
+        
+        free(proc->tags);
+        free(proc);
+    }
+}
+
+
+/*
+ * Removes all tags of process 'pid'
+ */
+static void index_clear(struct ptag_index* idx, pid_t pid) {
+    struct index_proc* proc = find_proc(idx, pid);
+    if(proc == NULL) {
+        return;
+    }
+    
+    size_t i;
+    for(i = 0; i < proc->count; i++) {
+        index_drop_pid(idx, proc->tags[i], pid);
+    }
+    
+    table_del(&idx->procs, proc_slot(idx, pid), proc_entry_hash);
+    
+    free(proc->tags);
+    free(proc);
+}
+
+
+/*
+ * Gives process 'pid' the tags of process 'ppid'
+ *
+ *  RETURN VALUE
+ *      0 on success, -1 if memory could not be allocated
+ */
+static int index_fork(struct ptag_index* idx, pid_t pid, pid_t ppid) {
+    struct index_proc* proc = find_proc(idx, pid);
+    
+    // The snapshot of a process is newer than its fork, see the top of this file
+    if(idx->initial && proc != NULL && proc->from_snapshot) {
+        return 0;
+    }
+    
+    index_clear(idx, pid);
+    
+    struct index_proc* parent = find_proc(idx, ppid);
+    if(parent == NULL) {
+        return 0;
+    }
+    
+    size_t i;
+    for(i = 0; i < parent->count; i++) {
+        // Growing the tables moves slots but never the parent itself
+        if(index_add(idx, pid, parent->tags[i]->tag, parent->tags[i]->len) != 0) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+
+/*
+ * Removes every tag and process from the index
+ */
+static void index_empty(struct ptag_index* idx) {
+    size_t i;
+    
+    for(i = 0; i < idx->tags.size; i++) {
+        struct index_tag* entry = idx->tags.slots[i];
+        
+        if(entry != NULL) {
+            free(entry->pids.slots);
+            free(entry);
+            
+            idx->tags.slots[i] = NULL;
+        }
+    }
+    
+    for(i = 0; i < idx->procs.size; i++) {
+        struct index_proc* proc = idx->procs.slots[i];
+        
+        if(proc != NULL) {
+            free(proc->tags);
+            free(proc);
+            
+            idx->procs.slots[i] = NULL;
+        }
+    }
+    
+    idx->tags.count  = 0;
+    idx->procs.count = 0;
+}
+
+
+/*
+ * Builds the index again from a new snapshot of /proc/ptags_bin
+ *
+ *  RETURN VALUE
+ *      0 on success, -1 on failure with errno set
+ */
+static int index_load(struct ptag_index* idx) {
+    index_empty(idx);
+    
+    if(ptag_snapshot_read(&idx->snap) != 0) {
+        return -1;
+    }
+    
+    const struct ptag_bin_record* rec;
+    for(rec = ptag_first_record(&idx->snap); rec != NULL; rec = ptag_next_record(&idx->snap, rec)) {
+        const struct ptag_bin_tag* tag = ptag_first_tag(rec);
+        
+        uint32_t i;
+        for(i = 0; i < rec->tag_count; i++, tag = ptag_next_tag(tag)) {
+            if(index_add(idx, rec->pid, tag->tag, tag->len) != 0) {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+        
+        struct index_proc* proc = find_proc(idx, rec->pid);
+        if(proc != NULL) {
+            proc->from_snapshot = 1;
+        }
+    }
+    
+    idx->initial = 1;
+    
+    return 0;
+}
+
+
+struct ptag_index* ptag_index_open(void) {
+    struct ptag_index* idx = calloc(1, sizeof(struct ptag_index));
+    if(idx == NULL) {
+        return NULL;
+    }
+    
+    idx->buf = malloc(PTAG_EVENT_MAX);
+    if(idx->buf == NULL) {
+        free(idx);
+        
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    // Opened before the snapshot is read so that no change can be missed
+    idx->events_fd = open("/proc/ptags_events", O_RDONLY | O_NONBLOCK);
+    if(idx->events_fd < 0 || index_load(idx) != 0) {
+        int err = errno;
+        ptag_index_close(idx);
+        
+        errno = err;
+        return NULL;
+    }
+    
+    return idx;
+}
+
+
+int ptag_index_fd(const struct ptag_index* idx) {
+    return idx->events_fd;
+}
+
+
+int ptag_index_update(struct ptag_index* idx) {
+    int applied = 0;
+    
+    while(1) {
+        ssize_t bytes = read(idx->events_fd, idx->buf, PTAG_EVENT_MAX);
+        if(bytes < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            
+            if(errno == EAGAIN) {
+                break;
+            }
+            
+            return -1;
+        }
+
+        if(bytes == 0) {    // Nothing left to read
+            break;
+        }
+
+        size_t off = 0;
+        while(off + sizeof(struct ptag_event) <= (size_t)bytes) {
+            const struct ptag_event* ev = (const struct ptag_event*)(idx->buf + off);
+            if(ev->size < sizeof(struct ptag_event) || ev->size > (size_t)bytes - off) {
+                errno = EPROTO;
+                return -1;
+            }
+            
+            int err = 0;
+            switch(ev->op) {
+                case PTAG_EVENT_ADD:
+                    err = index_add(idx, ev->pid, ev->tag, ev->tag_len);
+                    break;
+                
+                case PTAG_EVENT_DEL:
+                    index_del(idx, ev->pid, ev->tag, ev->tag_len);
+                    break;
+                
+                case PTAG_EVENT_CLEAR:
+                case PTAG_EVENT_EXIT:
+                    index_clear(idx, ev->pid);
+                    break;
+                
+                case PTAG_EVENT_FORK:
+                    err = index_fork(idx, ev->pid, ev->ppid);
+                    break;
+                
+                case PTAG_EVENT_LOST:
+                    // Anything read before this is stale too, start over
+                    if(index_load(idx) != 0) {
+                        return -1;
+                    }
+                    break;
+            }
+            
+            if(err != 0) {
+                errno = ENOMEM;
+                return -1;
+            }
+            
+            applied++;
+            off += ev->size;
+        }
+    }
+    
+    idx->initial = 0;
+    
+    return applied;
+}
+
+
+size_t ptag_index_pids(const struct ptag_index* idx, const char* tag, size_t len, pid_t* pids, size_t max) {
+    if(idx->tags.count == 0) {
+        return 0;
+    }
+    
+    const struct index_tag* entry = idx->tags.slots[tag_slot(idx, tag, len, hash_tag(tag, len))];
+    if(entry == NULL) {
+        return 0;
+    }
+    
+    size_t count = 0;
+    
+    size_t i;
+    for(i = 0; i < entry->pids.size && count < max; i++) {
+        if(entry->pids.slots[i] != 0) {
+            pids[count++] = entry->pids.slots[i];
+        }
+    }
+    
+    return entry->pids.count;
+}
+
+
+size_t ptag_index_tags(const struct ptag_index* idx, pid_t pid, const char** tags, uint32_t* lens, size_t max) {
+    const struct index_proc* proc = find_proc(idx, pid);
+    if(proc == NULL) {
+        return 0;
+    }
+    
+    size_t i;
+    for(i = 0; i < proc->count && i < max; i++) {
+        tags[i] = proc->tags[i]->tag;
+        lens[i] = proc->tags[i]->len;
+    }
+    
+    return proc->count;
+}
+
+
+/*
+ * A selector once it has been checked by load_selector()
+ */
+struct selector {
+    const uint32_t*    insns;
+    uint32_t           insn_count;
+    uint32_t           tag_count;
+    struct index_tag** tags;        // tags[i] is tag number i in the index, NULL if no process has it
+    uint64_t*          bits;        // Bit tags[i]->bit is set if the process being checked has tag number i
+    size_t             words;       // Number of 64 bit words in bits
+    uint8_t*           stack;       // Value stack used to run the program
+};
+
+
+static void free_selector(struct selector* sel) {
+    free(sel->tags);
+    free(sel->bits);
+    free(sel->stack);
+}
+
+
+/*
+ * Gives the index a stamp no tag or process carries yet
+ */
+static void next_stamp(struct ptag_index* idx) {
+    if(++idx->stamp != 0) {
+        return;
+    }
+    
+    // The stamp wrapped around, old stamps could be taken for new ones
+    size_t i;
+    for(i = 0; i < idx->tags.size; i++) {
+        if(idx->tags.slots[i] != NULL) {
+            ((struct index_tag*)idx->tags.slots[i])->stamp = 0;
+        }
+    }
+    
+    for(i = 0; i < idx->procs.size; i++) {
+        if(idx->procs.slots[i] != NULL) {
+            ((struct index_proc*)idx->procs.slots[i])->stamp = 0;
+        }
+    }
+    
+    idx->stamp = 1;
+}
+
+
+/*
+ * Checks that a selector is well formed the same way sys_ptag_kill() does,
+ * that is every tag and instruction lies within 'size' bytes, every
+ * instruction is valid and the program never pops from an empty stack and
+ * ends with exactly one value on it. The selector's tags are looked up in
+ * the index and stamped with a new stamp.
+ *
+ *  RETURN VALUE
+ *      0 on success, -1 with errno set to EINVAL if the selector is
+ *      malformed or to ENOMEM. On error nothing has to be free'd.
+ */
+static int load_selector(struct ptag_index* idx, const char* buf, size_t size, struct selector* sel) {
+    memset(sel, 0, sizeof(struct selector));
+    
+    // Every tag and instruction takes at least 4 bytes, which keeps the counts below from overflowing
+    const struct ptag_sel_header* hdr = (const struct ptag_sel_header*)buf;
+    if(size < sizeof(struct ptag_sel_header) || size > PTAG_SEL_MAX_SIZE || hdr->magic != PTAG_SEL_MAGIC ||
+       hdr->tag_count > size/4 || hdr->insn_count > size/4) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    sel->tag_count  = hdr->tag_count;
+    sel->insn_count = hdr->insn_count;
+    sel->words      = (sel->tag_count + 63)/64 + 1;
+    
+    sel->tags = calloc(sel->tag_count + 1, sizeof(struct index_tag*));
+    sel->bits = calloc(sel->words, sizeof(uint64_t));
+    if(sel->tags == NULL || sel->bits == NULL) {
+        free_selector(sel);
+        
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    next_stamp(idx);
+    
+    size_t   off = sizeof(struct ptag_sel_header);
+    uint32_t i;
+    
+    for(i = 0; i < sel->tag_count; i++) {
+        if(size - off < sizeof(uint32_t)) {
+            break;
+        }
+        
+        uint32_t len = *(const uint32_t*)(buf + off);
+        off += sizeof(uint32_t);
+        
+        if(len > size - off || ((len + 3) & ~3u) > size - off) {
+            break;
+        }
+        
+        if(idx->tags.count > 0) {
+            struct index_tag* entry = idx->tags.slots[tag_slot(idx, buf + off, len, hash_tag(buf + off, len))];
+            
+            // A tag given twice keeps the bit it got the first time
+            if(entry != NULL && entry->stamp != idx->stamp) {
+                entry->stamp = idx->stamp;
+                entry->bit   = i;
+            }
+            
+            sel->tags[i] = entry;
+        }
+        
+        off += (len + 3) & ~3u;
+    }
+    
+    if(i < sel->tag_count || size - off != (size_t)sel->insn_count*sizeof(uint32_t)) {
+        free_selector(sel);
+        
+        errno = EINVAL;
+        return -1;
+    }
+    
+    sel->insns = (const uint32_t*)(buf + off);
+    
+    // Run the program on the stack depth alone to find out how deep it gets
+    uint32_t depth      = 0;
+    uint32_t stack_size = 0;
+    
+    for(i = 0; i < sel->insn_count; i++) {
+        uint32_t op  = sel->insns[i] & 0xff;
+        uint32_t arg = sel->insns[i] >> 8;
+        
+        if(op == PTAG_SEL_TAG && arg < sel->tag_count) {
+            depth++;
+            if(depth > stack_size) {
+                stack_size = depth;
+            }
+        } else if(op == PTAG_SEL_NOT && depth >= 1) {
+            continue;
+        } else if((op == PTAG_SEL_AND || op == PTAG_SEL_OR || op == PTAG_SEL_XOR) && depth >= 2) {
+            depth--;
+        } else {
+            break;
+        }
+    }
+    
+    if(i < sel->insn_count || depth != 1) {
+        free_selector(sel);
+        
+        errno = EINVAL;
+        return -1;
+    }
+    
+    sel->stack = malloc(stack_size);
+    if(sel->stack == NULL) {
+        free_selector(sel);
+        
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+/*
+ * Runs a selector on the tag bits it holds, returns 1 if they match
+ * and 0 if they don't
+ */
+static int run_selector(struct selector* sel) {
+    uint8_t* sp = sel->stack;
+    
+    uint32_t i;
+    for(i = 0; i < sel->insn_count; i++) {
+        const struct index_tag* t;
+        
+        switch(sel->insns[i] & 0xff) {
+            case PTAG_SEL_TAG:
+                t = sel->tags[sel->insns[i] >> 8];
+                *(sp++) = (t != NULL) && ((sel->bits[t->bit >> 6] >> (t->bit & 63)) & 1);
+                break;
+            
+            case PTAG_SEL_NOT:
+                sp[-1] = !sp[-1];
+                break;
+            
+            case PTAG_SEL_AND:
+                sp--;
+                sp[-1] = sp[-1] & sp[0];
+                break;
+            
+            case PTAG_SEL_OR:
+                sp--;
+                sp[-1] = sp[-1] | sp[0];
+                break;
+            
+            default:    // PTAG_SEL_XOR
+                sp--;
+                sp[-1] = sp[-1] ^ sp[0];
+        }
+    }
+    
+    return sel->stack[0];
+}
+
+
+/*
+ * Runs a selector on the tags of a process and stores its pid if they match
+ *
+ *  PARAMETERS
+ *      count - the number of matching processes so far, incremented on a match
+ */
+static void select_proc(const struct ptag_index* idx, struct selector* sel, const struct index_proc* proc,
+                        pid_t* pids, size_t max, long* count) {
+    memset(sel->bits, 0, sel->words*sizeof(uint64_t));
+    
+    size_t i;
+    for(i = 0; i < proc->count; i++) {
+        const struct index_tag* t = proc->tags[i];
+        
+        if(t->stamp == idx->stamp) {
+            sel->bits[t->bit >> 6] |= (uint64_t)1 << (t->bit & 63);
+        }
+    }
+    
+    if(run_selector(sel)) {
+        if((size_t)*count < max) {
+            pids[*count] = proc->pid;
+        }
+        
+        (*count)++;
+    }
+}
+
+
+long ptag_index_select(struct ptag_index* idx, const void* sel_buf, size_t size, pid_t* pids, size_t max) {
+    struct selector sel;
+    if(load_selector(idx, sel_buf, size, &sel) != 0) {
+        return -1;
+    }
+    
+    long count = 0;
+    
+    size_t i, j;
+    if(!run_selector(&sel)) {
+        // A process without any of the selector's tags can't match, only look at the ones that have one
+        for(i = 0; i < sel.tag_count; i++) {
+            const struct index_tag* t = sel.tags[i];
+            if(t == NULL || t->bit != i) {
+                continue;
+            }
+            
+            for(j = 0; j < t->pids.size; j++) {
+                if(t->pids.slots[j] == 0) {
+                    continue;
+                }
+                
+                struct index_proc* proc = find_proc(idx, t->pids.slots[j]);
+                if(proc->stamp != idx->stamp) {
+                    proc->stamp = idx->stamp;
+                    
+                    select_proc(idx, &sel, proc, pids, max, &count);
+                }
+            }
+        }
+    } else {
+        for(i = 0; i < idx->procs.size; i++) {
+            if(idx->procs.slots[i] != NULL) {
+                select_proc(idx, &sel, idx->procs.slots[i], pids, max, &count);
+            }
+        }
+    }
+    
+    free_selector(&sel);
+    
+    return count;
+}
+
+
+void ptag_index_close(struct ptag_index* idx) {
+    if(idx->events_fd >= 0) {
+        close(idx->events_fd);
+    }
+    
+    index_empty(idx);
+    ptag_snapshot_free(&idx->snap);
+    
+    free(idx->tags.slots);
+    free(idx->procs.slots);
+    free(idx->buf);
+    free(idx);
+}
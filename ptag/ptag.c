@@ -14,15 +14,21 @@
 // User level program to add and remove tags to any given process owned by the calling user. Interacts
 // with PTAG system call.
 //
-// Usage:   ptag <pid> -a <tag> [tag2 ...]
+// Usage:   ptag <pid> [pid2 ...] -a <tag> [tag2 ...]
 //          OR
-//          ptag <pid> -r [tag1 ...]
+//          ptag <pid> [pid2 ...] -r [tag1 ...]
 //
 //          Using -r with no tags removes all
-//          tags from the specified process.
+//          tags from the specified processes.
+//
+// All the tags of all the processes are given to the kernel in one sys_ptag_batch call, which applies
+// the tags of each process under a single lookup and lock acquisition. If the kernel does not have
+// sys_ptag_batch the PTAG system call is made once for every tag of every process instead. Either
+// way the error reported is the one of the first failed tag in the order the arguments were given,
+// the tags of the other processes are still applied.
 //
 // COMPILATION
-//  gcc -Wall ptag.c -o ptag
+//  gcc -Wall -I../libptag ptag.c -o ptag
 //
 // NOTE
 //  The empty string is considered a valid tag, i.e. a string consisting of a single '\0' character.
@@ -37,60 +43,155 @@
 //      http://linux.die.net/man/3/strtoul
 //
 
+#include "libptag.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// System call numbers of sys_ptag and sys_ptag_batch in the patched kernel
+#if defined(__x86_64__)
+#define SYS_PTAG       299
+#define SYS_PTAG_BATCH 301
+#else
+#define SYS_PTAG       337
+#define SYS_PTAG_BATCH 339
+#endif
 
-static const char* const usage_str = "Usage:\tptag <pid> -a <tag> [tag2 ...]\n"
+static const char* const usage_str = "Usage:\tptag <pid> [pid2 ...] -a <tag> [tag2 ...]\n"
                                      "\tOR\n"
-                                     "\tptag <pid> -r [tag1 ...]\n\n"
+                                     "\tptag <pid> [pid2 ...] -r [tag1 ...]\n\n"
 
                                      "\tUsing -r with no tags removes all\n"
-                                     "\ttags from the specified process.\n";
+                                     "\ttags from the specified processes.\n";
 
-int main(int argc, const char* argv[]) {
-    if(argc < 4) {
-        if(argc == 1) {     // No arguments will be interpreted as the user asking for usage
-            printf(usage_str);
-            
-            return 0;
-        } else if(argc == 3 && strncmp(argv[2], "-r", sizeof("-r")) == 0) {
-            // ptag <pid> -r    * Remove all tags associated with process *
-        } else {            // Anything else is incorrect usage
-            fprintf(stderr, "ptag: Incorrect usage.\n");
-            fprintf(stderr, usage_str);
-            
-            return 1;
-        }
-    }
-    
+
+/*
+ * Parses a process ID argument
+ *
+ *  RETURN VALUE
+ *      0 on success otherwise -1
+ */
+static int parse_pid(const char* pid_str, pid_t* pid) {
+    char* tmp;
     
     errno = 0;
-    const char* pid_str = argv[1];
-    char* tmp;
     unsigned long int pid_tmp = strtoul(pid_str, &tmp, 10);
     if(tmp == pid_str || *tmp != '\0' || (pid_tmp == LONG_MAX && errno == ERANGE)) {
-        fprintf(stderr, "ptag: Invalid PID argument '%s'.\n", pid_str);
+        return -1;
+    }
+    
+    *pid = (pid_t)pid_tmp;
+    return 0;
+}
+
+
+/*
+ * Carries out the operations with sys_ptag_batch, falling back to one
+ * PTAG system call per operation if the kernel doesn't have it. The
+ * status of every entry is filled in.
+ */
+static void run_batch(struct ptag_batch_entry* entries, long count) {
+    long i;
+    
+    for(i = 0; i < count; i += PTAG_BATCH_MAX) {
+        long n = (count - i < PTAG_BATCH_MAX) ? count - i : PTAG_BATCH_MAX;
+        
+        // Trap to kernel and execute the batch system call
+        if(syscall(SYS_PTAG_BATCH, entries + i, n) >= 0) {
+            continue;
+        }
+        
+        long j;
+        for(j = i; j < i + n; j++) {
+            entries[j].status = syscall(SYS_PTAG, entries[j].pid, entries[j].tag, (char)entries[j].mode);
+        }
+    }
+}
+
+
+/*
+ * Prints the error message for a status returned by the PTAG system call
+ *
+ *  RETURN VALUE
+ *      the exit code for the status, 0 if it is not an error
+ */
+static int report_status(long retval, pid_t pid) {
+    switch (retval) {
+        case 0:         // Process was tagged sucessfully
+            return 0;
+        
+        case 1:         // Invalid mode argument but this should be handled above
+            fprintf(stderr, "ptag: An unexpected error occured\n");
+            return 5;
+        
+        case 2:         // Tag was NULL, someone was being crafty with argv
+            fprintf(stderr, "ptag: Tag name was invalid\n");
+            return 1;
+        
+        case 3:         // PID did not match any running processes
+            fprintf(stderr, "ptag: No process existed with matching PID %d\n", pid);
+            return 2;
+        
+        case 4:         // Calling user is not the owner of the specified process
+            fprintf(stderr, "ptag: You do not own process %d\n", pid);
+            return 3;
+        
+        case 5:         // Kernel memory allocation failed
+            fprintf(stderr, "ptag: Memory allocation error\n");
+            return 4;
+        
+        default:        // Unknown error
+            fprintf(stderr, "ptag: Unknown error occured\n");
+            return 5;
+    }
+}
+
+
+int main(int argc, const char* argv[]) {
+    if(argc == 1) {         // No arguments will be interpreted as the user asking for usage
+        printf(usage_str);
+        
+        return 0;
+    }
+    
+    pid_t pid;
+    if(parse_pid(argv[1], &pid) != 0) {
+        fprintf(stderr, "ptag: Invalid PID argument '%s'.\n", argv[1]);
         fprintf(stderr, usage_str);
         
         return 2;
     }
-    pid_t pid = (pid_t)pid_tmp;
     
+    // Every argument up to the -a or -r option is a PID
+    int opt = 2;
+    while(opt < argc && parse_pid(argv[opt], &pid) == 0) {
+        opt++;
+    }
+    
+    if(opt == argc) {       // Anything else is incorrect usage
+        fprintf(stderr, "ptag: Incorrect usage.\n");
+        fprintf(stderr, usage_str);
+        
+        return 1;
+    }
     
     
-    char mode = argv[2][1];
-    if(strncmp(argv[2], "-a", sizeof("-a")) != 0 && strncmp(argv[2], "-r", sizeof("-r"))) {
-        if(argv[2][0] == '-') {
+    
+    char mode = argv[opt][1];
+    if(strncmp(argv[opt], "-a", sizeof("-a")) != 0 && strncmp(argv[opt], "-r", sizeof("-r"))) {
+        if(argv[opt][0] == '-') {
             // Argument was an option but not -a or -r
-            fprintf(stderr, "ptag: Unrecognized option '%s'. Use either -a or -r.\n", argv[2]);
+            fprintf(stderr, "ptag: Unrecognized option '%s'. Use either -a or -r.\n", argv[opt]);
             fprintf(stderr, usage_str);
         } else {
             // Argument was not an option
-            fprintf(stderr, "ptag: Unexpected argument '%s'. Expecting either -a or -r.\n", argv[2]);
+            fprintf(stderr, "ptag: Unexpected argument '%s'. Expecting either -a or -r.\n", argv[opt]);
             fprintf(stderr, usage_str);
         }
         
@@ -98,77 +199,48 @@ int main(int argc, const char* argv[]) {
         return 1;
     }
     
+    // ptag <pid> -a    * Adding requires at least one tag *
+    if(mode == 'a' && opt == argc-1) {
+        fprintf(stderr, "ptag: Incorrect usage.\n");
+        fprintf(stderr, usage_str);
+        
+        return 1;
+    }
+    
     /*
-     * Loop through all remaining arguments treating them as tags
-     * and add or remove them to the specified process
+     * Treat all remaining arguments as tags to add or remove to each
+     * of the processes, ptag <pid> -r with no tags removes all tags
+     * associated with the processes
      */
-    int i;
-    for(i=3; i < argc; i++) {
-        const char* tag = argv[i];
-        
-        // Trap to kernel and execute PTAG system call
-        long retval = syscall(337, pid, tag, mode);
-        
-        switch (retval) {
-            case 0:         // Process was tagged sucessfully
-                break;
-                
-            case 1:         // Invalid mode argument but this should be handled above
-                fprintf(stderr, "ptag: An unexpected error occured\n");
-                return 5;
-                
-            case 2:         // Tag was NULL, someone was being crafty with argv
-                fprintf(stderr, "ptag: Tag name was invalid\n");
-                return 1;
-                
-            case 3:         // PID did not match any running processes
-                fprintf(stderr, "ptag: No process existed with matching PID %d\n", pid);
-                return 2;
-                
-            case 4:         // Calling user is not the owner of the specified process
-                fprintf(stderr, "ptag: You do not own process %d\n", pid);
-                return 3;
-                
-            case 5:         // Kernel memory allocation failed
-                fprintf(stderr, "ptag: Memory allocation error\n");
-                return 4;
-                
-            default:        // Unknown error
-                fprintf(stderr, "ptag: Unknown error occured\n");
-                return 5;
-        }
+    long pid_count = opt - 1;
+    long tag_count = argc - opt - 1;
+    long count     = pid_count * ((tag_count > 0) ? tag_count : 1);
+    
+    struct ptag_batch_entry* entries = calloc(count, sizeof(struct ptag_batch_entry));
+    if(entries == NULL) {
+        fprintf(stderr, "ptag: out of memory. qutting...\n");
+        return 4;
     }
     
-    // ptag <pid> -r  * Remove all tags associated with process *
-    if(mode == 'r' && i == 3) {
-        // Trap to kernel and execute PTAG system call
-        long retval = syscall(337, pid, NULL, 'c');
-        
-        switch (retval) {
-            case 0:         // Process was tagged sucessfully
-                break;
-                
-            case 1:         // Invalid mode argument but this should be handled above
-                fprintf(stderr, "ptag: An unexpected error occured\n");
-                return 5;
-                
-            case 3:         // PID did not match any running processes
-                fprintf(stderr, "ptag: No process existed with matching PID %d\n", pid);
-                return 2;
-                
-            case 4:         // Calling user is not the owner of the specified process
-                fprintf(stderr, "ptag: You do not own process %d\n", pid);
-                return 3;
-                
-            case 5:         // Kernel memory allocation failed
-                fprintf(stderr, "ptag: Memory allocation error\n");
-                return 4;
-                
-            default:        // Unknown error
-                fprintf(stderr, "ptag: Unknown error occured\n");
-                return 5;
-        }
+    long i;
+    for(i = 0; i < count; i++) {
+        long p = (tag_count > 0) ? i / tag_count : i;
+        
+        parse_pid(argv[1 + p], &pid);
+        
+        entries[i].pid  = pid;
+        entries[i].mode = (tag_count > 0) ? mode : 'c';
+        entries[i].tag  = (tag_count > 0) ? argv[opt + 1 + i % tag_count] : NULL;
     }
     
-    return 0;
+    run_batch(entries, count);
+    
+    int exit_code = 0;
+    for(i = 0; i < count && exit_code == 0; i++) {
+        exit_code = report_status(entries[i].status, entries[i].pid);
+    }
+    
+    free(entries);
+    
+    return exit_code;
 }
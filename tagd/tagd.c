@@ -0,0 +1,689 @@
+//
+// tagd - ptag query daemon
+// ---------------------------------------------------------------------------------------------------
+//
+// tagd.c
+//
+// Description:
+// ---------------------------------------------------------------------------------------------------
+//
+// Daemon that keeps the tags of the user's processes in memory and answers tag selector queries from
+// tagstat --daemon and tagkill --daemon over a Unix domain socket. Without it every invocation of
+// tagstat or tagkill reads and parses all of /proc/ptags again, which adds up when health checks run
+// hundreds of queries per second.
+//
+// The tags are kept in a ptag_index from libptag, which is built from /proc/ptags_bin once and then
+// updated from /proc/ptags_events, so the work done between queries is proportional to the number of
+// tag changes. Queries are selectors in the format of sys_ptag_kill() and are answered with the
+// matching pids in ascending order, or with records in the format of /proc/ptags_bin (without its
+// header) if the client asks for the tags as well. The process state in those records is read from
+// /proc/<pid>/stat when the query is answered, processes that exited in the meantime are left out.
+//
+// All clients are served by a single thread from one poll() loop. Pending changes are applied right
+// before every query so an answer is never older than the changes the kernel had recorded when the
+// query was read.
+//
+// USAGE
+//   tagd [--socket <path>]
+//
+//   --socket <path> listens on <path> instead of $TAGD_SOCKET or, if
+//   that isn't set, $XDG_RUNTIME_DIR/tagd.sock or /tmp/tagd-<uid>.sock
+//   if there's no $XDG_RUNTIME_DIR. The socket can only be connected
+//   to by the user running tagd, which is also the only user whose
+//   processes tagd can see unless it runs as root.
+//
+//   tagd runs in the foreground until it gets SIGINT or SIGTERM.
+//
+// COMPILE WITH
+//   make, which builds libptag first
+//
+// EXIT CODES
+//   0 - Exit success:              stopped by SIGINT or SIGTERM
+//
+//   1 - Incorrect usage:           unknown option, or tagd is already running
+//
+//   3 - Out of memory:             malloc failed
+//
+//   5 - IO error:                  /proc/ptags_events or the socket could not be used
+//
+
+#include "libptag.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Protocol spoken over the socket, tagstat/tagstat.c and tagkill/tagkill.c
+ * have to be kept in sync with these. A client sends a tagd_request followed
+ * by 'size' bytes of selector and gets a tagd_reply followed by 'size' bytes
+ * of data, either 'count' int32_t pids or 'count' ptag_bin_record's with
+ * their tags if TAGD_TAGS was given. Any number of queries can be sent over
+ * one connection, replies come in the order the queries were sent.
+ */
+#define TAGD_MAGIC 0x44474154   // "TAGD"
+#define TAGD_TAGS  1            // Reply with the tags and state of every process, not just its pid
+
+/*
+ * A client that sends queries without reading the replies would make tagd
+ * queue replies without end. Once this many bytes of replies are waiting
+ * for a client, its queries are left unread until it has taken them, and
+ * no more is read than the largest query needs.
+ */
+#define TAGD_OUT_MAX (1 << 20)
+#define TAGD_IN_MAX  (sizeof(struct tagd_request) + PTAG_SEL_MAX_SIZE)
+
+struct tagd_request {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t size;      // Size of the selector following the request
+};
+
+struct tagd_reply {
+    uint32_t magic;
+    int32_t  status;    // 0 or the errno the query failed with, EINVAL for a malformed selector
+    uint32_t count;     // Number of matching processes
+    uint32_t size;      // Size of the data following the reply
+};
+
+/*
+ * Connection to a client, queries are read into 'in' until a whole one
+ * has arrived and replies are queued in 'out' until the socket takes them,
+ * see TAGD_OUT_MAX
+ */
+struct client {
+    int    fd;
+    
+    char*  in;
+    size_t in_len;      // Number of bytes read into in
+    size_t in_size;     // Number of bytes in has room for
+    
+    char*  out;
+    size_t out_off;     // Number of bytes of out that were sent
+    size_t out_len;     // Number of bytes queued in out
+    size_t out_size;    // Number of bytes out has room for
+};
+
+static const char* socket_path;             // Path the socket is bound to
+static char default_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+static struct ptag_index* idx;              // The tags of all visible processes
+
+static struct client* clients;              // Connected clients
+static size_t client_count;                 // Number of clients connected
+static size_t client_size;                  // Number of clients clients has room for
+static struct pollfd* pfds;                 // Listening socket, index and one per client
+
+static pid_t* matches;                      // Matching pids of the query being answered
+static size_t match_size;                   // Number of pids matches has room for
+static const char** tags;                   // Tags of the process being answered
+static size_t tag_size;                     // Number of tags tags has room for
+static uint32_t* tag_lens;                  // Lengths of the tags in tags
+static size_t tag_len_size;                 // Number of lengths tag_lens has room for
+
+static volatile sig_atomic_t quit;          // Set by SIGINT and SIGTERM
+
+
+static const char* const usage_str = "Usage:\n"
+                                     "\ttagd [--socket <path>]\n\n"
+
+                                     "\t--socket <path> listens on <path> instead of $TAGD_SOCKET or, if\n"
+                                     "\tthat isn't set, $XDG_RUNTIME_DIR/tagd.sock or /tmp/tagd-<uid>.sock\n"
+                                     "\tif there's no $XDG_RUNTIME_DIR. The socket can only be connected\n"
+                                     "\tto by the user running tagd, which is also the only user whose\n"
+                                     "\tprocesses tagd can see unless it runs as root.\n\n"
+
+                                     "\ttagd runs in the foreground until it gets SIGINT or SIGTERM.\n";
+
+
+static void out_of_memory() {
+    fprintf(stderr, "tagd: out of memory. qutting...\n");
+    
+    unlink(socket_path);
+    exit(3);
+}
+
+
+static void handle_quit(int sig) {
+    (void)sig;
+    
+    quit = 1;
+}
+
+
+/*
+ * Grows a buffer to hold at least 'need' elements, exits with code 3
+ * if memory could not be allocated
+ *
+ *  PARAMETERS
+ *      buf  - the buffer, updated
+ *      size - the number of elements buf has room for, updated
+ *      need - the number of elements buf needs room for
+ *      elem - the size of one element
+ */
+static void grow(void* buf, size_t* size, size_t need, size_t elem) {
+    if(need <= *size) {
+        return;
+    }
+    
+    size_t bigger_size = (*size > 0) ? *size : 16;
+    while(bigger_size < need) {
+        bigger_size *= 2;
+    }
+    
+    void* bigger = realloc(*(void**)buf, bigger_size*elem);
+    if(bigger == NULL) {
+        out_of_memory();
+    }
+    
+    *(void**)buf = bigger;
+    *size        = bigger_size;
+}
+
+
+/*
+ * Applies the changes the kernel has recorded since the last update,
+ * exits if /proc/ptags_events can't be read anymore
+ */
+static void update_index() {
+    if(ptag_index_update(idx) >= 0) {
+        return;
+    }
+    
+    if(errno == ENOMEM) {
+        out_of_memory();
+    }
+    
+    fprintf(stderr, "tagd: error reading /proc/ptags_events: %s\n", strerror(errno));
+    
+    unlink(socket_path);
+    exit(5);
+}
+
+
+/*
+ * Reads the state of a process from /proc/<pid>/stat
+ *
+ *  RETURN VALUE
+ *      The first letter of the state, e.g. 'R' or 'S', or 0 if the
+ *      process doesn't exist anymore
+ */
+static char process_state(pid_t pid) {
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return 0;
+    }
+    
+    // The command name is at most 16 characters, the state follows it
+    char buf[128];
+    ssize_t len = read(fd, buf, sizeof(buf));
+    close(fd);
+    
+    // The state comes after the last ')', the command name could contain one too
+    ssize_t i;
+    for(i = len-1; i > 0; i--) {
+        if(buf[i] == ')') {
+            return (i+2 < len) ? buf[i+2] : 0;
+        }
+    }
+    
+    return 0;
+}
+
+
+static int compare_pids(const void* a, const void* b) {
+    pid_t x = *(const pid_t*)a;
+    pid_t y = *(const pid_t*)b;
+    
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Appends data to the replies queued for a client
+ */
+static void queue_reply(struct client* c, const void* data, size_t len) {
+    grow(&c->out, &c->out_size, c->out_len + len, 1);
+    
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+
+/*
+ * Answers one query and queues the reply
+ *
+ *  PARAMETERS
+ *      c     - the client that sent the query
+ *      req   - the query
+ *      sel   - the selector following the query
+ */
+static void answer_query(struct client* c, const struct tagd_request* req, const char* sel) {
+    update_index();
+    
+    struct tagd_reply reply = { TAGD_MAGIC, 0, 0, 0 };
+    
+    long count;
+    while(1) {
+        count = ptag_index_select(idx, sel, req->size, matches, match_size);
+        if(count < 0 || (size_t)count <= match_size) {
+            break;
+        }
+        
+        // More processes matched than there was room for, try again with enough room
+        grow(&matches, &match_size, count, sizeof(pid_t));
+    }
+    
+    if(count < 0) {
+        if(errno == ENOMEM) {
+            out_of_memory();
+        }
+        
+        reply.status = errno;
+        queue_reply(c, &reply, sizeof(reply));
+        
+        return;
+    }
+    
+    qsort(matches, count, sizeof(pid_t), compare_pids);
+    
+    // The reply is filled in once the data is queued behind it
+    size_t reply_off = c->out_len;
+    queue_reply(c, &reply, sizeof(reply));
+    
+    long i;
+    for(i = 0; i < count; i++) {
+        if(!(req->flags & TAGD_TAGS)) {
+            int32_t pid = matches[i];
+            queue_reply(c, &pid, sizeof(pid));
+            
+            reply.count++;
+            continue;
+        }
+        
+        char state = process_state(matches[i]);
+        if(state == 0) {
+            continue;
+        }
+        
+        size_t tag_count;
+        while((tag_count = ptag_index_tags(idx, matches[i], tags, tag_lens, tag_size)) > tag_size) {
+            grow(&tags, &tag_size, tag_count, sizeof(const char*));
+            grow(&tag_lens, &tag_len_size, tag_count, sizeof(uint32_t));
+        }
+        
+        struct ptag_bin_record rec;
+        memset(&rec, 0, sizeof(rec));
+        
+        rec.pid       = matches[i];
+        rec.size      = sizeof(rec);
+        rec.tag_count = tag_count;
+        rec.state     = state;
+        
+        size_t t;
+        for(t = 0; t < tag_count; t++) {
+            rec.size += sizeof(struct ptag_bin_tag) + ((tag_lens[t] + 3) & ~3u);
+        }
+        
+        queue_reply(c, &rec, sizeof(rec));
+        
+        for(t = 0; t < tag_count; t++) {
+            static const char zeros[4];
+            
+            queue_reply(c, &tag_lens[t], sizeof(uint32_t));
+            queue_reply(c, tags[t], tag_lens[t]);
+            queue_reply(c, zeros, ((tag_lens[t] + 3) & ~3u) - tag_lens[t]);
+        }
+        
+        reply.count++;
+    }
+    
+    reply.size = c->out_len - reply_off - sizeof(reply);
+    memcpy(c->out + reply_off, &reply, sizeof(reply));
+}
+
+
+/*
+ * Sends as much of the queued replies as the socket takes without blocking
+ *
+ *  RETURN VALUE
+ *      0 on success, -1 if the client has to be disconnected
+ */
+static int send_replies(struct client* c) {
+    while(c->out_off < c->out_len) {
+        ssize_t bytes = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if(bytes < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        
+        c->out_off += bytes;
+    }
+    
+    c->out_off = 0;
+    c->out_len = 0;
+    
+    return 0;
+}
+
+
+/*
+ * Answers the whole queries a client has sent until TAGD_OUT_MAX bytes of
+ * replies are queued, the rest are answered once the client took those
+ *
+ *  RETURN VALUE
+ *      0 on success, -1 if the client has to be disconnected because it
+ *      failed or sent something that isn't a query
+ */
+static int answer_queries(struct client* c) {
+    size_t off = 0;
+    while(c->out_len < TAGD_OUT_MAX && c->in_len - off >= sizeof(struct tagd_request)) {
+        struct tagd_request req;
+        memcpy(&req, c->in + off, sizeof(req));
+        
+        if(req.magic != TAGD_MAGIC || req.size > PTAG_SEL_MAX_SIZE) {
+            return -1;
+        }
+        
+        if(c->in_len - off - sizeof(req) < req.size) {
+            break;
+        }
+        
+        answer_query(c, &req, c->in + off + sizeof(req));
+        off += sizeof(req) + req.size;
+    }
+    
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    
+    return send_replies(c);
+}
+
+
+/*
+ * Reads what a client sent and answers every whole query that arrived
+ *
+ *  RETURN VALUE
+ *      0 on success, -1 if the client has to be disconnected because it
+ *      hung up, failed or sent something that isn't a query
+ */
+static int read_queries(struct client* c) {
+    while(c->in_len < TAGD_IN_MAX) {
+        grow(&c->in, &c->in_size, c->in_len + 4096, 1);
+        
+        ssize_t bytes = read(c->fd, c->in + c->in_len, c->in_size - c->in_len);
+        if(bytes < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            
+            return -1;
+        }
+        
+        if(bytes == 0) {    // Client hung up
+            return -1;
+        }
+        
+        c->in_len += bytes;
+    }
+    
+    return answer_queries(c);
+}
+
+
+static void disconnect(size_t i) {
+    close(clients[i].fd);
+    
+    free(clients[i].in);
+    free(clients[i].out);
+    
+    clients[i] = clients[--client_count];
+}
+
+
+/*
+ * Accepts every client waiting to connect
+ */
+static void accept_clients(int listen_fd) {
+    while(1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            
+            // Running out of file descriptors only turns away the clients that didn't fit
+            break;
+        }
+        
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        
+        grow(&clients, &client_size, client_count + 1, sizeof(struct client));
+        
+        memset(&clients[client_count], 0, sizeof(struct client));
+        clients[client_count++].fd = fd;
+    }
+}
+
+
+/*
+ * Creates the socket and starts listening on it. Exits with code 1 if
+ * another tagd is already listening on the path or with code 5 if the
+ * socket can't be created.
+ *
+ *  RETURN VALUE
+ *      The listening socket
+ */
+static int open_socket() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        fprintf(stderr, "tagd: error creating socket: %s\n", strerror(errno));
+        exit(5);
+    }
+    
+    // A socket nobody is listening on is left over from a tagd that didn't exit cleanly
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "tagd: already running on %s\n", socket_path);
+        exit(1);
+    }
+    
+    // Anything else at the path, or someone else's socket, makes bind() fail below
+    struct stat st;
+    if(errno == ECONNREFUSED && lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode) && st.st_uid == getuid()) {
+        unlink(socket_path);
+    }
+    
+    close(fd);
+    
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    // Only the user running tagd may connect
+    mode_t mask = umask(077);
+    
+    if(fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "tagd: error listening on %s: %s\n", socket_path, strerror(errno));
+        exit(5);
+    }
+    
+    umask(mask);
+    
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    
+    return fd;
+}
+
+
+int main(int argc, const char* argv[]) {
+    int argi;
+    for(argi = 1; argi < argc; argi++) {
+        if(strncmp(argv[argi], "--socket", sizeof("--socket")) == 0 && argi+1 < argc) {
+            socket_path = argv[++argi];
+        } else {
+            fprintf(stderr, "tagd: Incorrect usage.\n");
+            fprintf(stderr, usage_str);
+            
+            return 1;
+        }
+    }
+    
+    if(socket_path == NULL) {
+        socket_path = getenv("TAGD_SOCKET");
+    }
+    
+    if(socket_path == NULL || *socket_path == '\0') {
+        const char* dir = getenv("XDG_RUNTIME_DIR");
+        
+        // Unlike /tmp, $XDG_RUNTIME_DIR can't be written to by other users
+        if(dir != NULL && *dir != '\0') {
+            if(strlen(dir) + sizeof("/tagd.sock") > sizeof(default_path)) {
+                fprintf(stderr, "tagd: socket path '%s/tagd.sock' is too long\n", dir);
+                return 1;
+            }
+            
+            snprintf(default_path, sizeof(default_path), "%s/tagd.sock", dir);
+        } else {
+            snprintf(default_path, sizeof(default_path), "/tmp/tagd-%u.sock", (unsigned)getuid());
+        }
+        
+        socket_path = default_path;
+    }
+    
+    if(strlen(socket_path) >= sizeof(default_path)) {
+        fprintf(stderr, "tagd: socket path '%s' is too long\n", socket_path);
+        return 1;
+    }
+    
+    idx = ptag_index_open();
+    if(idx == NULL) {
+        if(errno == ENOMEM) {
+            fprintf(stderr, "tagd: out of memory. qutting...\n");
+            return 3;
+        }
+        
+        fprintf(stderr, "tagd: error reading the tags of processes: %s\n", strerror(errno));
+        return 5;
+    }
+    
+    int listen_fd = open_socket();
+    
+    // Without SA_RESTART poll() returns as soon as one of these arrives
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    
+    sa.sa_handler = handle_quit;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    size_t pfd_size  = 0;
+    int    exit_code = 0;
+    
+    while(!quit) {
+        grow(&pfds, &pfd_size, client_count + 2, sizeof(struct pollfd));
+        
+        pfds[0].fd     = listen_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd     = ptag_index_fd(idx);
+        pfds[1].events = POLLIN;
+        
+        size_t i;
+        for(i = 0; i < client_count; i++) {
+            pfds[2+i].fd     = clients[i].fd;
+            pfds[2+i].events = ((clients[i].out_len < TAGD_OUT_MAX) ? POLLIN : 0) |
+                               ((clients[i].out_len > 0) ? POLLOUT : 0);
+        }
+        
+        size_t polled = client_count;
+        
+        if(poll(pfds, polled + 2, -1) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            
+            fprintf(stderr, "tagd: poll failed: %s\n", strerror(errno));
+            
+            exit_code = 5;
+            break;
+        }
+        
+        if(pfds[1].revents != 0) {
+            update_index();
+        }
+        
+        // Backwards so the client moved into the place of a disconnected one was already served
+        for(i = polled; i-- > 0; ) {
+            short revents = pfds[2+i].revents;
+            if(revents == 0) {
+                continue;
+            }
+            
+            int err = 0;
+            if(revents & POLLOUT) {
+                err = send_replies(&clients[i]);
+                
+                // Queries left unread while the replies piled up
+                if(err == 0 && clients[i].in_len > 0) {
+                    err = answer_queries(&clients[i]);
+                }
+            }
+            
+            if(err == 0 && (revents & (POLLIN | POLLHUP | POLLERR))) {
+                err = read_queries(&clients[i]);
+            }
+            
+            if(err != 0) {
+                disconnect(i);
+            }
+        }
+        
+        if(pfds[0].revents & POLLIN) {
+            accept_clients(listen_fd);
+        }
+    }
+    
+    while(client_count > 0) {
+        disconnect(client_count - 1);
+    }
+    
+    close(listen_fd);
+    unlink(socket_path);
+    
+    ptag_index_close(idx);
+    
+    free(clients);
+    free(pfds);
+    free(matches);
+    free(tags);
+    free(tag_lens);
+    
+    return exit_code;
+}
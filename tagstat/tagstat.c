@@ -31,7 +31,45 @@
 //   the --help argument.
 //
 // USAGE
-//   tagstat <tag> OR tagstat '<expr>'
+//   tagstat [options] <tag> OR tagstat [options] '<expr>' ['<expr>' ...]
+//
+//   Given more than one expression every line is printed once for each
+//   expression its process matches, prefixed with the expression and a
+//   tab. All expressions are matched in a single scan of /proc/ptags.
+//   --batch, --threads, --watch, --daemon, --explain and --stats take
+//   a single expression.
+//
+//   --rules <file> reads more expressions from a file, one per line,
+//   each optionally preceded by a label of letters, digits and '_' and
+//   ' = ' which is printed in place of the expression. Blank lines
+//   and lines starting with '#' are skipped.
+//
+//   --stats prints the number of syntax tree nodes, of spans the
+//   parser remembered and the size of the table keeping them,
+//   and the peak memory used to parse the expression to stderr, and
+//   once the processes are matched how many distinct tag sets were
+//   seen, with --watch after every scan.
+//
+//   --batch matches all processes at once using one bitmap per tag,
+//   with AVX2 or SSE2 instructions if the CPU has them. This is faster
+//   when there are a lot of tagged processes.
+//
+//   --threads <n> matches large snapshots of /proc/ptags with n threads
+//   (1 to 64) instead of one thread for every CPU. The result is the
+//   same with any number of threads.
+//
+//   --watch keeps running and prints the lines that were added (+),
+//   removed (-) or whose process state changed (~) whenever the tags
+//   of any process change, or at least once a second.
+//
+//   --daemon asks tagd for the matching processes instead of reading
+//   /proc/ptags, see tagd/tagd.c. /proc/ptags is used if tagd isn't
+//   running or if its socket belongs to another user.
+//
+//   --explain prints the expression to stderr the way it is matched,
+//   after it was simplified and the operands of every AND and OR were
+//   ordered by how often their tags occur, with the estimated chance
+//   of every part being true and the instructions it takes to find out.
 //
 //   passing --help will print this usage information, thus if
 //   you wish to use --help as tag it must be encased in either
@@ -68,10 +106,11 @@
 //   e.g. %(tagwith || and !!)
 //
 //   Tags cannot contain percent signs or parenthesis unless
-//   escaped.
+//   escaped. If you wish to use an option as a tag it
+//   must be encased in parenthesis or escaped.
 //
 // COMPILE WITH
-//   gcc -Wall -O2 tagstat.c -o tagstat
+//   gcc -Wall -O2 -pthread tagstat.c -o tagstat
 //
 //  The -O2 is for tail call optimization
 //
@@ -86,63 +125,107 @@
 //
 //   4 - Assertion error:           grammar parsing did something unexpected
 //
-//   5 - IO error:                  IO operations with /proc/ptags failed
+//   5 - IO error:                  IO operations with /proc/ptags or stdout failed
 //
 // Citations:
 // ---------------------------------------------------------------------------------------------------
-//   -  The following source was used to aid in the implementation of a CYK parser
-//
-//      https://en.wikipedia.org/wiki/CYK_algorithm
-//
 //   -  Linux man pages
 //
 //      http://man7.org/linux/man-pages/
 //
 //
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Selector format of sys_ptag_kill and tagd, has to be kept in sync with
+ * include/ptag/ptag.h of the patch. A header is followed by the tags (a
+ * 32 bit length and the tag padded to a multiple of 4 bytes) and then the
+ * instructions of a postfix program, opcode in the low 8 bits and the tag
+ * number in the upper 24 bits.
+ */
+#define PTAG_SEL_MAGIC 0x4c455350   // "PSEL"
+
+#define PTAG_SEL_TAG 0      // Pushes 1 if the process has tag number 'arg', otherwise 0
+#define PTAG_SEL_NOT 1      // Negates the value on top of the stack
+#define PTAG_SEL_AND 2      // Pops two values and pushes their AND
+#define PTAG_SEL_OR  3      // Pops two values and pushes their OR
+#define PTAG_SEL_XOR 4      // Pops two values and pushes their XOR
 
-#define GRAMMAR_NUM_NT 31                               // Number of nonterminals in the grammar
-
-#define index_of(i, j, k, n) ((k)*n*n + (j)*n + i)      // Macro to get element from parse table given
-                                                        // sequence length, starting index, nonterminal #
-                                                        // and number of characters in the expression
-
-
-// This macro generates all ASCII characters that are not control characters/whitespace
-#define ASCII_NO_WHITESPACE 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, \
-47, 48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, \
-61, 62, 63, 64, 65, 66, 67, 68, 69, 70, 71, 72, 73, 74, \
-75, 76, 77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 88, \
-89, 90, 91, 92, 93, 94, 95, 96, 97, 98, 99, 100, 101, 102, \
-103, 104, 105, 106, 107, 108, 109, 110, 111, 112, 113, 114, \
-115, 116, 117, 118, 119, 120, 121, 122, 123, 124, 125, 126, \
-127, 128, 129, 130, 131, 132, 133, 134, 135, 136, 137, 138, \
-139, 140, 141, 142, 143, 144, 145, 146, 147, 148, 149, 150, \
-151, 152, 153, 154, 155, 156, 157, 158, 159, 160, 161, 162, \
-163, 164, 165, 166, 167, 168, 169, 170, 171, 172, 173, 174, \
-175, 176, 177, 178, 179, 180, 181, 182, 183, 184, 185, 186, \
-187, 188, 189, 190, 191, 192, 193, 194, 195, 196, 197, 198, \
-199, 200, 201, 202, 203, 204, 205, 206, 207, 208, 209, 210, \
-211, 212, 213, 214, 215, 216, 217, 218, 219, 220, 221, 222, \
-223, 224, 225, 226, 227, 228, 229, 230, 231, 232, 233, 234, \
-235, 236, 237, 238, 239, 240, 241, 242, 243, 244, 245, 246, \
-247, 248, 249, 250, 251, 252, 253, 254, 255
-
-// This macro is for all ASCII characters excluding '\0'
-#define ASCII_ALL 1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31,32,ASCII_NO_WHITESPACE
-
-
-/*
- * Given below is a chomsky normal form context-free grammar for the expression parsing.
- * The spaces in the rules are not actually part of the grammar they have been added
- * for clarity, any spaces that are meant to be in the grammar are represented with
+struct ptag_sel_header {
+    uint32_t magic;
+    uint32_t tag_count;
+    uint32_t insn_count;
+};
+
+/*
+ * Protocol of tagd, has to be kept in sync with tagd/tagd.c. A query is
+ * a tagd_request followed by a selector, with TAGD_TAGS the reply is a
+ * tagd_reply followed by a record for every matching process in ascending
+ * pid order, laid out like the records of /proc/ptags_bin: a
+ * ptag_bin_record followed by 'tag_count' ptag_bin_tag's, each tag padded
+ * with zeros to a multiple of 4 bytes.
+ */
+#define TAGD_MAGIC 0x44474154   // "TAGD"
+#define TAGD_TAGS  1            // Reply with the tags and state of every process, not just its pid
+
+struct tagd_request {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t size;      // Size of the selector following the request
+};
+
+struct tagd_reply {
+    uint32_t magic;
+    int32_t  status;    // 0 or the errno the query failed with
+    uint32_t count;     // Number of matching processes
+    uint32_t size;      // Size of the data following the reply
+};
+
+struct ptag_bin_record {
+    int32_t  pid;
+    uint32_t size;      // Size of the record including its tags
+    uint32_t tag_count;
+    char     state;     // First letter of the process state, e.g. 'R' or 'S'
+    char     pad[3];
+};
+
+struct ptag_bin_tag {
+    uint32_t len;
+    char     tag[];
+};
+
+#define EXPR_TAG 0      // Tag literal, escaped or unescaped
+#define EXPR_NOT 1      // NOT operator, the operand is stored in 'left'
+#define EXPR_AND 2      // AND operator
+#define EXPR_OR  3      // OR operator
+#define EXPR_XOR 4      // XOR operator
+#define EXPR_FALSE 5    // Constant, only ever made by the optimizer
+#define EXPR_TRUE  6    // Constant, only ever made by the optimizer
+
+
+/*
+ * Given below is the context-free grammar accepted for expressions. The spaces
+ * in the rules are not actually part of the grammar they have been added for
+ * clarity, any spaces that are meant to be in the grammar are represented with
  * the nonterminal V_sp.
  *
  *  E0   --> EL | V_( E1 | V_! E | V_n E2 | V_% E3 | T1 T1 | all ascii > 33         // Start rule
@@ -177,533 +260,3943 @@
  *  V_t  --> t
  *  V_sp --> space
  *
- * Note that in the encoded form of the grammar given below, nonterminals that
- * have single unit productions of the form V_* --> * where * is not an
- * alphanumeric character have their representing symbol name subsititued for
- * the first two letters of that symbols name as naming instead. So for example
- * V_! gets renamed to V_em and V_( to V_lb etc.
- *
- * The grammar is encoded as follows, each nonterminal is encoded as an array of
- * 2-byte unsigned integers. Since rules are either of the form P -> QR or P -> a
- * each byte in the 2-byte entry can be used to store an index into an array holding
- * all the nonterminal symbols. If the most significant byte (MSB) is zero then
- * the rule represents a unit production rule of the form P -> a (since in chomsky
- * the start symbol can never be producded by any rule) where the value of the
- * least significant byte (LSB) represents a char value of the terminal production.
- * If the MSB is non-zero then the rule represents a production of the form P -> QR,
- * and by extracting the MSB and LSB as seperate bytes the indicies of the nonterminals
- * P and Q can be computed. The 'rules' array further down stores the address for each
- * nonterminal and can be used to get the production rules of any nonterminal given its
- * index.
- */
-static const uint16_t E0[]    = {(1 << 8) | 2, (16 << 8) | 5, (18 << 8) | 1, (27 << 8) | 6, (19 << 8) | 7, (14 << 8) | 14, ASCII_NO_WHITESPACE};
-static const uint16_t E[]     = {(1 << 8) | 2, (16 << 8) | 5, (18 << 8) | 1, (27 << 8) | 6, (19 << 8) | 7, (14 << 8) | 14, ASCII_NO_WHITESPACE};
-static const uint16_t L[]     = {(30 << 8) | 3};
-static const uint16_t L1[]    = {(11 << 8) | 4};
-static const uint16_t L2[]    = {(30 << 8) | 1};
-static const uint16_t E1[]    = {(1 << 8) | 17};
-static const uint16_t E2[]    = {(24 << 8) | 8};
-static const uint16_t E3[]    = {(16 << 8) | 10};
-static const uint16_t N[]     = {(29 << 8) | 9};
-static const uint16_t N1[]    = {(30 << 8) | 1};
-static const uint16_t X[]     = {(15 << 8) | 17};
-static const uint16_t O[]     = {(23 << 8) | 12, (22 << 8) | 22, (24 << 8) | 25, (20 << 8) | 20, (26 << 8) | 13, (21 << 8) | 21};
-static const uint16_t O1[]    = {(24 << 8) | 25};
-static const uint16_t O2[]    = {(27 << 8) | 28};
-static const uint16_t T1[]    = {(14 << 8) | 14, ASCII_NO_WHITESPACE};
-static const uint16_t T2[]    = {(15 << 8) | 15, ASCII_ALL};
-static const uint16_t V_lb[]  = {'('};
-static const uint16_t V_rb[]  = {')'};
-static const uint16_t V_em[]  = {'!'};
-static const uint16_t V_pe[]  = {'%'};
-static const uint16_t V_pi[]  = {'|'};
-static const uint16_t V_am[]  = {'&'};
-static const uint16_t V_ca[]  = {'^'};
-static const uint16_t V_x[]   = {'x'};
-static const uint16_t V_o[]   = {'o'};
-static const uint16_t V_r[]   = {'r'};
-static const uint16_t V_a[]   = {'a'};
-static const uint16_t V_n[]   = {'n'};
-static const uint16_t V_d[]   = {'d'};
-static const uint16_t V_t[]   = {'t'};
-static const uint16_t V_sp[]  = {' '};
-
-/*
- * Store pointers to all rules in the grammar as well as the production count,
- * note that the rule count does not include unit productions for E0,E,T1,T2
- * this is because the main purpose of these lengths is to make cycling through
- * productions of the form P -> QR easier.
- */
-static const uint16_t* const rules[] = {E0,  E,   L, L1, L2, E1, E2, E3, N, N1, X, O, O1, O2, T1,   T2,   V_lb, V_rb, V_em, V_pe, V_pi, V_am, V_ca, V_x, V_o, V_r, V_a, V_n, V_d, V_t, V_sp};
-static const int rule_lens[]         = {6,   6,   1, 1,  1,  1,  1,  1,  1, 1,  1, 6, 1,  1,  1,    1,    1,    1,    1,    1,    1,    1,    1,    1,   1,   1,   1,   1,   1,   1,   1};
-
-
-/*
- * This struct holds all the information nessecary to descend a parse tree
- * from any given node. i.e. rules of the form P -> QR
- */
-struct parse_node {
-    int nt1;        // nt1 is the index in the 'rules' array of the left nonterminal
-    int nt2;        // nt2 is the index in the 'rules' array of the right nonterminal
-    
-    int start1;     // start1 is the index in the expression string where the left nonterminal starts
-    int start2;     // start2 is the index in the expression string where the right nonterminal starts
-    
-    int len1;       // len1 is the number of terminals in the expression string that nt1 covers
-    int len2;       // len1 is the number of terminals in the expression string that nt2 covers
+ * Unescaped tags (T1) cannot contain whitespace, control characters, '%', '!',
+ * '(' or ')'.
+ *
+ * The grammar is ambiguous, an expression like 'a && b || c' can be derived with
+ * either operator at the root. Ambiguity is always resolved the same way, if
+ * the expression can be split as E L then the split with the longest left hand
+ * side is used (so operators are evaluated leftmost first and NOT binds tighter
+ * than any binary operator), otherwise the first character decides which one of
+ * the remaining rules applies.
+ *
+ * This makes it possible to parse the expression top down from right to left.
+ * The root of any span of the expression is the rightmost operator surrounded
+ * by spaces whose right hand side is a single operand and whose left hand side
+ * is itself a valid expression. The right hand side can never contain another
+ * operator at the top level and for the same reason a NOT operator only ever
+ * applies to a single operand.
+ *
+ * Without escaped tags every parenthesis is part of the structure, so only an
+ * operator outside of all parenthesis of the span can be its root, and only the
+ * rightmost of those that has a right hand side at all. If that one doesn't
+ * work out the span is not an expression. Depths of parenthesis and the
+ * operators at each depth are looked up in tables built once for the whole
+ * expression, so a span whose parenthesis don't match is rejected right away,
+ * no operator is tried twice and the parse runs in linear time.
+ *
+ * Escaped tags are the only operands that can contain parenthesis and text that
+ * looks like an operator, so for spans containing them every operator is tried
+ * from the rightmost one to the leftmost one. The operators are only checked,
+ * the syntax tree of a span is built once its root is known, and whether a span
+ * is an expression is remembered in a table of about 2n slots. That way escaped
+ * tags full of parenthesis and operators rarely make the parser go over the
+ * same span twice, no tree is ever built just to be thrown away and the table
+ * never grows past O(n).
+ */
+
+
+/*
+ * Node of the abstract syntax tree built by the parser. Tags are not copied,
+ * 'start' and 'len' index directly into the expression string.
+ */
+struct expr_node {
+    int type;                   // One of the EXPR_* constants above
+    
+    int start;                  // start is the index in the expression string where the tag starts
+    int len;                    // len is the number of characters in the tag
+    
+    struct expr_node* left;     // Left operand, or the only operand of a NOT
+    struct expr_node* right;    // Right operand
+    
+    double p;                   // Chance that the subtree is true, see estimate()
+    double cost;                // Expected instructions run for it, 0 until estimated
 };
 
 
-static struct parse_node* parse_table;  // Pointer to root of entire parse tree/table of given expression
-static char* expr;                      // The expression that was parsed (equivalent to argv[1])
+static struct expr_node* expr_root;     // Root of the syntax tree of the given expression
+static char* expr;                      // The expression that was parsed (equivalent to argv[1]) or the selectors
 static size_t n;                        // The number of characters in the expression
 
+/*
+ * Lookup tables used while parsing, each holds n+1 entries and
+ * is free'd as soon as the syntax tree has been built
+ */
+static int* prev_op;    // prev_op[i] is the position of the closest operator before i or -1
+static int* tag_start;  // tag_start[i] is the start of the unescaped tag that ends at i
+static int* tag_end;    // tag_end[i] is the end of the unescaped tag that starts at i
+static int* depth;          // depth[i] is the number of '(' minus the number of ')' before i
+static int* next_lower;     // next_lower[i] is the first j > i with depth[j] < depth[i] or n+1
+static int* prev_top_op;    // prev_top_op[i] is the closest operator before i at depth[i] with nothing lower in between or -1
+static int* next_escape;    // next_escape[i] is the position of the first '%' at or after i or n
 
 /*
- * Free's memory used by the parse table, to be used
- * as an exit handler.
+ * Spans containing escaped tags that are known to be expressions or not,
+ * stored in a direct mapped table. A span replaces whatever span was
+ * stored in its slot before, so the table keeps the size it was given
+ * for the expression. Each span is encoded as start << 32 | end with
+ * SPAN_VALID set if it is an expression, which is never 0 since end > start,
+ * so 0 marks an empty slot.
  */
-static void free_parse_table() {
-    free(parse_table);
-}
+#define SPAN_VALID (1ULL << 63)
+
+static uint64_t* spans;
+static size_t span_slots;       // Number of slots, always a power of 2
+static size_t span_used;        // Number of slots holding a span
+static size_t span_count;       // Number of spans stored, including the ones replaced since
 
+/*
+ * Returned in place of a syntax tree when a span is only checked,
+ * see parse_expr()
+ */
+static struct expr_node span_ok;
+
+
+/*
+ * Syntax tree nodes are carved out of large chunks of memory (an arena)
+ * rather than being malloc'd one at a time. The first chunk is sized
+ * from the length of the expression and every chunk after it is twice
+ * as big as the one before, so the arena never holds much more than the
+ * tree needs. Subtrees the parser ends up discarding are released by
+ * rolling the arena back to where it was before they were built.
+ */
+struct arena_chunk {
+    struct arena_chunk* prev;   // The chunk allocated before this one or NULL
+    size_t size;                // Number of nodes the chunk can hold
+    size_t used;                // Number of nodes handed out from the chunk
+    struct expr_node nodes[];
+};
+
+struct arena_mark {
+    struct arena_chunk* chunk;  // The chunk in use when the mark was taken
+    size_t used;                // Number of nodes it had handed out
+};
+
+static struct arena_chunk* arena;   // The chunk nodes are currently allocated from
+static size_t node_count;           // Number of nodes currently allocated from the arena
+
+/*
+ * Every allocation made by the parser is accounted for
+ * so that it can be reported with --stats
+ */
+static size_t parser_mem;           // Bytes currently allocated by the parser
+static size_t parser_peak;          // Largest value parser_mem has ever had
+static int    show_stats;           // Non-zero if --stats was given
+static int    watch_mode;           // Non-zero if --watch was given
+
+
+/*
+ * Allocates memory for the parser and keeps track of the
+ * peak memory usage, exits with code 3 if memory could
+ * not be allocated.
+ */
+static void* parser_alloc(size_t size) {
+    void* ptr = malloc(size);
+    if(ptr == NULL) {
+        fprintf(stderr, "tagstat: out of memory. qutting...\n");
+        exit(3);
+    }
+    
+    parser_mem += size;
+    if(parser_mem > parser_peak) {
+        parser_peak = parser_mem;
+    }
+    
+    return ptr;
+}
 
 
 /*
- * Recursively descends a parse tree starting with a specified root
- * node and determines whether or not the expression specified by
- * the parse tree evaluates to true or false given a set of tags
+ * Free's memory allocated with parser_alloc
  *
  *  PARAMETERS
- *      root - a pointer to the start node in the parse table
- *      tags - a set of tag strings to be matched by the expression
- *
- *  RETURN VALUE
- *      1 if the provided set of tags matched the parse table of the
- *      expression otherwise 0
- *
- *  NOTE
- *      Although this function is recursive the approximate with tail
- *      call optimization the memory used each function call can be
- *      0 for most calls with the exception of operator parsing where
- *      approximately 112 bytes of stack space will be used. This is
- *      not a serious limit since with a default 8MB stack roughly
- *      74,000 operators can be parsed before stack overflow.
- */
-static int evaluate(struct parse_node* root, char** tags) {
-    if(root->nt1 == 14 && root->nt2 == 14) {
-        // Expression is tag
-        char* tag;
-        while( (tag = *(tags++)) != NULL ) {
-            // Iterate all tags if there are any matches return true
-            if(strlen(tag) == root->len1 + root->len2 && strncmp(tag, expr + root->start1 - 1, root->len1 + root->len2) == 0) {
-                return 1;
-            }
-        }
+ *      ptr  - the memory to free
+ *      size - the size that was passed to parser_alloc
+ */
+static void parser_free(void* ptr, size_t size) {
+    free(ptr);
+    parser_mem -= size;
+}
+
+
+/*
+ * Returns the number of bytes used by an arena chunk that can hold 'size' nodes
+ */
+static size_t chunk_bytes(size_t size) {
+    return sizeof(struct arena_chunk) + size*sizeof(struct expr_node);
+}
+
+
+/*
+ * Returns the current position of the arena so that
+ * it can later be rolled back with arena_release
+ */
+static struct arena_mark arena_get_mark() {
+    struct arena_mark mark;
+    
+    mark.chunk = arena;
+    mark.used  = (arena != NULL) ? arena->used : 0;
+    
+    return mark;
+}
+
+
+/*
+ * Rolls the arena back to a mark, releasing every node
+ * that was allocated after the mark was taken
+ */
+static void arena_release(struct arena_mark mark) {
+    while(arena != mark.chunk) {
+        struct arena_chunk* prev = arena->prev;
         
-        return 0;
-    } else if( (root->nt1 == 18 && root->nt2 == 1) || (root->nt1 == 27 && root->nt2 == 6) ) {
-        // Expression is negated
-        return !evaluate(&parse_table[index_of(root->len2, root->start2, root->nt2, n)], tags);
-    } else if(root->nt1 == 15) {
-        // Expression is escaped tag
-        char* tag;
-        while( (tag = *(tags++)) != NULL ) {
-            // Iterate all tags if there are any matches return true
-            if(strlen(tag) == root->len1 && strncmp(tag, expr + root->start1 - 1, root->len1) == 0) {
-                return 1;
-            }
-        }
+        node_count -= arena->used;
+        parser_free(arena, chunk_bytes(arena->size));
         
-        return 0;
-    } else if(root->nt1 == 1 && root->nt2 == 2) {
+        arena = prev;
+    }
+    
+    if(arena != NULL) {
+        node_count -= arena->used - mark.used;
+        arena->used  = mark.used;
+    }
+}
+
+
+/*
+ * Free's every chunk of the arena, to be used as an exit handler.
+ */
+static void free_arena() {
+    struct arena_mark empty = { NULL, 0 };
+    arena_release(empty);
+}
+
+
+/*
+ * Allocates and initializes a new syntax tree node from the arena,
+ * exits with code 3 if memory could not be allocated.
+ */
+static struct expr_node* new_expr(int type, int start, int len, struct expr_node* left, struct expr_node* right) {
+    if(arena == NULL || arena->used == arena->size) {
         /*
-         * Expression has operator, follow the chain of nonterminals down
-         * until both expressions are found as well as the operator
+         * Even the shortest operators need a few characters around
+         * them so most expressions need well under n/8 nodes
          */
-        struct parse_node* L_node  = &parse_table[index_of(root->len2, root->start2, root->nt2, n)];
-        struct parse_node* L1_node = &parse_table[index_of(L_node->len2, L_node->start2, L_node->nt2, n)];
-        struct parse_node* L2_node = &parse_table[index_of(L1_node->len2, L1_node->start2, L1_node->nt2, n)];
-        struct parse_node* O_node  = &parse_table[index_of(L1_node->len1, L1_node->start1, L1_node->nt1, n)];
-        
-        struct parse_node* E_node_1  = &parse_table[index_of(root->len1, root->start1, root->nt1, n)];
-        struct parse_node* E_node_2  = &parse_table[index_of(L2_node->len2, L2_node->start2, L2_node->nt2, n)];
-        
-        if( (O_node->nt1 == 23 && O_node->nt2 == 12) || (O_node->nt1 == 22 && O_node->nt2 == 22) ) {
-            // XOR
-            return ( evaluate(E_node_1, tags) != evaluate(E_node_2, tags) );
-        } else if( (O_node->nt1 == 24 && O_node->nt2 == 25) || (O_node->nt1 == 20 && O_node->nt2 == 20) ) {
-            // OR
-            return ( evaluate(E_node_1, tags) || evaluate(E_node_2, tags) );
-        } else {
-            // AND
-            return ( evaluate(E_node_1, tags) && evaluate(E_node_2, tags) );
-        }
-    } else if(root->nt1 == -1) {
-        // Expression was tag but single character
-        char* tag;
-        while( (tag = *(tags++)) != NULL ) {
-            // Iterate all tags if there are any matches return true
-            if(tag[1] == '\0' && tag[0] == expr[root->start1-1]) {
-                return 1;
-            }
-        }
+        size_t size = (arena == NULL) ? n/8 + 16 : arena->size*2;
         
-        return 0;
+        struct arena_chunk* chunk = parser_alloc(chunk_bytes(size));
+        chunk->prev = arena;
+        chunk->size = size;
+        chunk->used = 0;
+        
+        arena = chunk;
     }
     
-    /*
-     * Some intermediate stage in the tree, keep following
-     * nonterminals with rules of the form P -> QR until
-     * an expression is encountered. This can be tail
-     * optimizied.
-     */
-    if(root->nt1 < 16) {
-        return evaluate(&parse_table[index_of(root->len1, root->start1, root->nt1, n)], tags);
-    } else if(root->nt2 < 16) {
-        return evaluate(&parse_table[index_of(root->len2, root->start2, root->nt2, n)], tags);
-    } else {
-        // This shouldn't happen
-        fprintf(stderr, "tagstat: assertion error: two child unit productions encountered %d %d. quitting...\n", root->nt1, root->nt2);
-        exit(4);
-    }
+    struct expr_node* node = &arena->nodes[arena->used++];
+    node_count++;
+    
+    node->type  = type;
+    node->start = start;
+    node->len   = len;
+    node->left  = left;
+    node->right = right;
+    node->cost  = 0;
+    
+    return node;
 }
 
 
 /*
- * Builds a parse tree for the given expression using the
- * bottom-up CYK context-free grammar parsing algorithm
- * with dynamic programming.
- *
- *  LINK TO ALGORITHM
- *      https://en.wikipedia.org/wiki/CYK_algorithm
+ * Returns the slot of the span table a span encoded as 'key' is stored in
+ */
+static size_t span_slot(uint64_t key) {
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (span_slots-1);
+}
+
+
+/*
+ * Looks up the span [start,end) in the span table
  *
- *  PARAMETERS
- *      arg - the expression string to be parsed
+ *  RETURN VALUE
+ *      1 if the span is known to be an expression, 0 if it is known
+ *      not to be one and -1 if it isn't in the table
  */
-static void build_parse_table(char* arg) {
-    expr = arg;
-    n   = strlen(expr);
+static int known_span(int start, int end) {
+    uint64_t key  = ((uint64_t)start << 32) | (uint32_t)end;
+    uint64_t slot = spans[span_slot(key)];
     
-    /*
-     * Allocate space for the parse table, n+1 is used since the CYK algorithm I
-     * used from wikipedia started indices at 1 instead of 0 and I was too lazy
-     * to change it.
-     */
-    parse_table = calloc((n+1)*(n+1)*GRAMMAR_NUM_NT, sizeof(struct parse_node));
-    if(parse_table == NULL) {
-        fprintf(stderr, "tagstat: out of memory. qutting...\n");
-        exit(3);
+    if((slot & ~SPAN_VALID) != key) {
+        return -1;
     }
     
-    /*
-     * Install this exit handler so I can be lazy and not be
-     * constantly writing free(parse_table) for every error
-     */
-    atexit(free_parse_table);
+    return (slot & SPAN_VALID) != 0;
+}
+
+
+/*
+ * Remembers whether the span [start,end) is an expression
+ */
+static void set_span(int start, int end, int valid) {
+    uint64_t key = ((uint64_t)start << 32) | (uint32_t)end;
+    size_t i = span_slot(key);
     
+    span_used += (spans[i] == 0);
+    spans[i] = key | (valid ? SPAN_VALID : 0);
+    span_count++;
+}
+
+
+/*
+ * Returns non-zero if the character c can be part of an unescaped
+ * tag (T1 in the grammar)
+ */
+static int is_tag_char(char c) {
+    return c >= 33 && c != '%' && c != '!' && c != '(' && c != ')';
+}
+
+
+/*
+ * Checks for an operator surrounded by spaces (L in the grammar)
+ * starting at index i of the expression.
+ *
+ *  RETURN VALUE
+ *      The length of the operator excluding the spaces or 0 if
+ *      there is no operator at index i
+ */
+static int operator_at(size_t i) {
+    const char* s = expr + i;
     
-    /*
-     * The rest of the code in this function implements the CYK
-     * bottom-up context-free grammar parsing algorithm. The
-     * implementation is my own based on psuedocode from
-     *
-     * https://en.wikipedia.org/wiki/CYK_algorithm
-     */
+    // The expression is null terminated so reading past its end is never an issue
+    if(s[0] != ' ') {
+        return 0;
+    }
     
-    int i;
-    for(i = 1; i <= n ; i++) {
-        /*
-         * This loop determines which unit productions, that
-         * is rules of the form A -> a could have produced
-         * the terminals in the expression string
-         */
-        struct parse_node node;
-        node.nt1 = -1;
-        node.nt2 = -1;
-        node.start1 = i;
-        node.len1 = 1;
+    if( (s[1] == '&' && s[2] == '&') || (s[1] == '|' && s[2] == '|') ||
+        (s[1] == '^' && s[2] == '^') || (s[1] == 'o' && s[2] == 'r') ) {
+        return (s[3] == ' ') ? 2 : 0;
+    }
+    
+    if( (s[1] == 'a' && s[2] == 'n' && s[3] == 'd') || (s[1] == 'x' && s[2] == 'o' && s[3] == 'r') ) {
+        return (s[4] == ' ') ? 3 : 0;
+    }
+    
+    return 0;
+}
+
+
+/*
+ * Returns the EXPR_* type of the operator starting at index i of the expression
+ */
+static int operator_type(int i) {
+    switch(expr[i+1]) {
+        case 'x':
+        case '^':
+            return EXPR_XOR;
         
-        // Scans all nonterminals that represent a single terminal symbol
-        int r;
-        for(r = 16; r < GRAMMAR_NUM_NT ; r++) {
-            if(*rules[r] == expr[i-1]) {
-                memcpy(&parse_table[index_of(1, i, r, n)], &node, sizeof(struct parse_node));
-            }
-        }
+        case 'o':
+        case '|':
+            return EXPR_OR;
         
-        /*
-         * If the character is not whitespace, a percent sign, an
-         * exclamation mark, or parenthesis then it could either
-         * be a single symbol tag generated by either E0 or E or
-         * it could be a multi symbol tag generated by T1
-         */
-        if(expr[i-1] >= 33 && expr[i-1] != '%' && expr[i-1] != '!' && expr[i-1] != '(' && expr[i-1] != ')') {
-            memcpy(&parse_table[index_of(1, i, 0, n)], &node, sizeof(struct parse_node));
-            memcpy(&parse_table[index_of(1, i, 1, n)], &node, sizeof(struct parse_node));
-            memcpy(&parse_table[index_of(1, i, 14, n)], &node, sizeof(struct parse_node));
+        default:
+            return EXPR_AND;
+    }
+}
+
+
+/*
+ * Cheap test that rejects most spans that can't be an expression
+ * without parsing them. An expression has to start with an operand
+ * that is followed by a space or the end of the span, and has to end
+ * with an operand that is preceded by a space, a '!' or the start of
+ * the span. Only unescaped tags can be checked this way, operands
+ * starting or ending with a parenthesis always pass.
+ *
+ *  RETURN VALUE
+ *      0 if [start,end) is definitely not an expression, otherwise 1
+ */
+static int could_be_expr(int start, int end) {
+    int i = start;
+    
+    while(i < end && expr[i] == '!') {
+        i++;
+    }
+    
+    if(i == end) {
+        return 0;
+    }
+    
+    if(is_tag_char(expr[i])) {
+        if(tag_end[i] < end && expr[tag_end[i]] != ' ') {
+            return 0;
         }
-        
-        // T2 can be produce any nonterminal so this is always set
-        memcpy(&parse_table[index_of(1, i, 15, n)], &node, sizeof(struct parse_node));
+    } else if(expr[i] != '(' && expr[i] != '%') {
+        return 0;
     }
     
-    /*
-     * This quintuple for loop searches through possible subsequences
-     * and paritions them in to two halves. Then determining if any
-     * rules of the form P -> QR such that Q matches the left half
-     * of the subsequence and R matches the right half of the
-     * subsequence. In order to make this process efficient dynamic
-     * programming is used so that stored entries for P -> QR can
-     * be used to determine the applicability of other rules.
-     */
-    for(i = 2; i <= n ; i++) {
-        int j;
-        for(j = 1; j <= n-i+1; j++) {
-            int k;
-            for(k = 1; k <= i-1; k++) {
-                
-                int r;
-                for(r = 0; r < 16; r++) {
-                    int p;
-                    for(p = 0; p < rule_lens[r]; p++) {
-                        int b = (rules[r][p] >> 8) & 255;
-                        int c =  rules[r][p]       & 255;
-                        
-                        if(parse_table[index_of(k, j, b, n)].len1 != 0 && parse_table[index_of(i-k, j+k, c, n)].len1 != 0) {
-                            // Store information pertaining to this nonterminals children
-                            struct parse_node node;
-                            node.nt1 = b;
-                            node.nt2 = c;
-                            node.start1 = j;
-                            node.len1 = k;
-                            node.start2 = j+k;
-                            node.len2 = i-k;
-                            
-                            memcpy(&parse_table[index_of(i, j, r, n)], &node, sizeof(struct parse_node));
-                        }
-                    }
-                }
-                
-            }
+    if(is_tag_char(expr[end-1])) {
+        i = tag_start[end-1];
+        
+        if(i > start && expr[i-1] != ' ' && expr[i-1] != '!') {
+            return 0;
         }
+    } else if(expr[end-1] != ')') {
+        return 0;
     }
     
+    return 1;
 }
 
 
+static struct expr_node* parse_expr(int start, int end, int build);
+
+
 /*
- * Proc parsing helper function, counts the number of ptags and number
- * of bytes required to store the tags, from a buffered proc read for
- * a process specified by 'cur_pid'
+ * Parses a span of the expression that does not have a binary operator
+ * at its root, i.e. a parenthesized expression, an escaped tag or an
+ * unescaped tag with any number of NOT operators in front of it.
  *
  *  PARAMETERS
- *      line       - A pointer to the start of the first line of the
- *                   in the proc entry buffer
- *
- *      end        - A pointer to the end of the proc entry buffer
- *
- *      tag_count  - pointer to a location holding a long to store
- *                   the number of tags for the given process
- *
- *      tags_bytes - pointer to a location holding a long to store
- *                   the number of bytes required to store the
- *                   specified processes tags
- *
- *      cur_pid    - the pid of the process to count the tags of
+ *      start - index of the first character of the span
+ *      end   - index one past the last character of the span
+ *      build - zero to only check the span, see parse_expr()
  *
  *  RETURN VALUE
- *      A pointer to the line that would've been counted next had
- *      cur_pid matched the pid value in the next line or NULL
- *      if the end of the proc entry buffer was reached
+ *      The syntax tree of the span or NULL if the span is not valid
  */
-static char* count_ptags(char* line, char* end, long* tag_count, long* tags_bytes, pid_t cur_pid) {
-    line -= 1;
+static struct expr_node* parse_operand(int start, int end, int build) {
+    struct expr_node* node;
+    int nots = 0;
     
-    *tag_count  = 0;
-    *tags_bytes = 0;
-    
-    do {
-        // Move to start of line
-        line += 1;
-        
-        // This condition is basically an EOF
-        if(line >= end) {
-            return NULL;
+    // Strip NOT operators (V_! E and V_n E2)
+    while(1) {
+        if(start < end && expr[start] == '!') {
+            start += 1;
+        } else if(end - start > 4 && strncmp(expr + start, "not ", 4) == 0) {
+            start += 4;
+        } else {
+            break;
         }
         
-        pid_t pid = (pid_t)strtoul(line, NULL, 10);
-        if(pid != cur_pid) {
-            /*
-             * This tag is not part of the process
-             * currently being scanned, this means
-             * that the end of the current tag set
-             * has been reached.
-             */
-            
-            break;
+        nots++;
+    }
+    
+    if(end - start < 1) {
+        return NULL;
+    }
+    
+    if(expr[start] == '(') {
+        // V_( E1
+        if(expr[end-1] != ')') {
+            return NULL;
         }
         
-        // Find colon seperating pid and tag
-        char* sep1 = strchr(line, ':');
-        if(sep1 == NULL) {
-            // Formatting error, shouldn't happen, ignore tag
-            continue;
+        node = parse_expr(start+1, end-1, build);
+    } else if(expr[start] == '%') {
+        // V_% E3
+        if(end - start < 4 || expr[start+1] != '(' || expr[end-1] != ')') {
+            return NULL;
         }
         
-        // Find colon seperating tag and state
-        char* sep2 = strrchr(line, ':');
-        if(sep2 == NULL) {
-            // Formatting error, shouldn't happen, ignore tag
-            continue;
+        node = (build) ? new_expr(EXPR_TAG, start+2, end-start-3, NULL, NULL) : &span_ok;
+    } else {
+        // T1 T1 or a single character tag
+        if(tag_end[start] < end) {
+            return NULL;
         }
         
-        (*tag_count)++;
-        (*tags_bytes) += (sep2 - sep1) - 2;
-    } while( (line = strchr(line, '\0')) != NULL);
+        node = (build) ? new_expr(EXPR_TAG, start, end-start, NULL, NULL) : &span_ok;
+    }
+    
+    while(build && node != NULL && nots-- > 0) {
+        node = new_expr(EXPR_NOT, 0, 0, node, NULL);
+    }
     
-    return line;
+    return node;
 }
 
 
 /*
- * Proc parsing helper function, copies the ptags from a buffered
- * proc read for a process specified by 'cur_pid'
+ * Parses a span of the expression that has no escaped tags in it. Only
+ * the rightmost operator at the top level of the span that has a right
+ * hand side can be its root, so the span isn't an expression if either
+ * side of that operator isn't valid and no other operator is ever tried.
  *
  *  PARAMETERS
- *      line     - A pointer to the start of the first line of the
- *                 in the proc entry buffer
- *
- *      end      - A pointer to the end of the proc entry buffer
- *
- *      tags     - A pointer to memory to hold pointers to the copied tags
- *
- *      tag_pool - A pointer to an area in memory big enough to store all tags
- *
- *      cur_pid  - the pid of the process to copy the tags of
+ *      start - index of the first character of the span
+ *      end   - index one past the last character of the span
+ *      build - zero to only check the span, see parse_expr()
  *
  *  RETURN VALUE
- *      A pointer to the line that would've been copied next had
- *      cur_pid matched the pid value in the next line or NULL
- *      if the end of the proc entry buffer was reached
+ *      The syntax tree of the span or NULL if the span is not valid
  */
-static char* copy_ptags(char* line, char* end, char** tags, char* tag_pool, pid_t cur_pid) {
-    line -= 1;
+static struct expr_node* parse_unescaped(int start, int end, int build) {
+    // Parenthesis have to match, the span has to end at the depth it starts at and never go below it
+    if(depth[end] != depth[start] || next_lower[start] <= end) {
+        return NULL;
+    }
     
-    do {
-        // Move to start of line
-        line += 1;
+    struct arena_mark mark = arena_get_mark();
+    struct expr_node* root = NULL;
+    struct expr_node** left = &root;    // Where the tree of the rest of the span goes
+    
+    /*
+     * The operator found is the root of the span and the next one is the root
+     * of its left hand side, so the tree is built from the root down its left
+     */
+    int i;
+    for(i = prev_top_op[end]; i > start; i = prev_top_op[i]) {
+        int rhs = i + operator_at(i) + 2;
         
-        // This condition is basically an EOF
-        if(line >= end) {
+        // An operator running into the end of the span doesn't have a right hand side
+        if(rhs >= end) {
+            continue;
+        }
+        
+        struct expr_node* right = parse_operand(rhs, end, build);
+        if(right == NULL) {
+            arena_release(mark);
             return NULL;
         }
         
-        pid_t pid = (pid_t)strtoul(line, NULL, 10);
-        if(pid != cur_pid) {
-            /*
-             * This tag is not part of the process
-             * currently being scanned, this means
-             * that the end of the current tag set
-             * has been reached.
+        if(build) {
+            *left = new_expr(operator_type(i), 0, 0, NULL, right);
+            left  = &(*left)->left;
+        }
+        
+        end = i;
+    }
+    
+    // Only checking the span leaves root at &span_ok
+    *left = parse_operand(start, end, build);
+    if(*left == NULL) {
+        arena_release(mark);
+        return NULL;
+    }
+    
+    return root;
+}
+
+
+/*
+ * Parses a span of the expression. Spans without escaped tags are left
+ * to parse_unescaped(), in all others operators are tried from right to
+ * left, see the comment above the grammar for details.
+ *
+ * Operators are tried by only checking both of their sides, which builds
+ * no syntax tree and returns &span_ok rather than a tree if the side is
+ * valid. The tree is built once the root of the span is known, so no tree
+ * is ever built and then thrown away.
+ *
+ *  PARAMETERS
+ *      start - index of the first character of the span
+ *      end   - index one past the last character of the span
+ *      build - non-zero to build the syntax tree, zero to only check the span
+ *
+ *  RETURN VALUE
+ *      The syntax tree of the span, &span_ok if the span is valid and
+ *      build is zero, or NULL if the span is not valid
+ */
+static struct expr_node* parse_expr(int start, int end, int build) {
+    if(end - start < 1) {
+        return NULL;
+    }
+    
+    int unescaped = (next_escape[start] >= end);
+    
+    /*
+     * Spans without escaped tags are parsed in linear time, they are
+     * only remembered when checked from a span with escaped tags
+     */
+    if(unescaped && build) {
+        return parse_unescaped(start, end, 1);
+    }
+    
+    if(!unescaped && !could_be_expr(start, end)) {
+        return NULL;
+    }
+    
+    int known = known_span(start, end);
+    if(known == 0) {
+        return NULL;
+    }
+    
+    if(known == 1 && !build) {
+        return &span_ok;
+    }
+    
+    if(unescaped) {
+        struct expr_node* node = parse_unescaped(start, end, 0);
+        set_span(start, end, node != NULL);
+        
+        return node;
+    }
+    
+    /*
+     * Unless the span ends with a parenthesis the right hand side can only
+     * be an unescaped tag with NOT operators in front of it, so there is no
+     * point in trying operators further left than that
+     */
+    int min_rhs = start;
+    if(expr[end-1] != ')') {
+        min_rhs = tag_start[end-1];
+        
+        while(1) {
+            if(min_rhs > start && expr[min_rhs-1] == '!') {
+                min_rhs -= 1;
+            } else if(min_rhs - start >= 4 && strncmp(expr + min_rhs - 4, "not ", 4) == 0) {
+                min_rhs -= 4;
+            } else {
+                break;
+            }
+        }
+    }
+    
+    int i;
+    for(i = prev_op[end]; i > start; i = prev_op[i]) {
+        int op  = operator_at(i);
+        int rhs = i + op + 2;
+        
+        if(rhs < min_rhs) {
+            break;
+        }
+        
+        if(parse_operand(rhs, end, 0) == NULL || parse_expr(start, i, 0) == NULL) {
+            continue;
+        }
+        
+        if(known < 0) {
+            set_span(start, end, 1);
+        }
+        
+        if(!build) {
+            return &span_ok;
+        }
+        
+        struct expr_node* right = parse_operand(rhs, end, 1);
+        struct expr_node* left  = parse_expr(start, i, 1);
+        
+        return new_expr(operator_type(i), 0, 0, left, right);
+    }
+    
+    struct expr_node* node = parse_operand(start, end, build);
+    if(known < 0) {
+        set_span(start, end, node != NULL);
+    }
+    
+    return node;
+}
+
+
+/*
+ * Builds the lookup tables the parser needs for a buffer of expressions,
+ * any span of the buffer can be parsed with parse_expr() afterwards.
+ * Expressions in the buffer have to be separated by null terminators so
+ * that no operator or tag runs from one into the next.
+ *
+ *  PARAMETERS
+ *      buf - the expressions to be parsed
+ *      len - the number of characters in buf, not counting the last null terminator
+ */
+static void begin_parse(char* buf, size_t len) {
+    expr = buf;
+    n    = len;
+    
+    span_slots = 64;
+    span_used  = 0;
+    span_count = 0;
+    
+    // Only spans containing escaped tags are ever stored
+    if(memchr(expr, '%', n) != NULL) {
+        while(span_slots < 2*(n+1)) {
+            span_slots *= 2;
+        }
+    }
+    
+    prev_op     = parser_alloc((n+1)*sizeof(int));
+    tag_start   = parser_alloc((n+1)*sizeof(int));
+    tag_end     = parser_alloc((n+1)*sizeof(int));
+    depth       = parser_alloc((n+1)*sizeof(int));
+    next_lower  = parser_alloc((n+1)*sizeof(int));
+    prev_top_op = parser_alloc((n+1)*sizeof(int));
+    next_escape = parser_alloc((n+1)*sizeof(int));
+    spans       = parser_alloc(span_slots*sizeof(uint64_t));
+    memset(spans, 0, span_slots*sizeof(uint64_t));
+    
+    int i;
+    
+    // Find all operators surrounded by spaces
+    prev_op[0] = -1;
+    for(i = 1; i <= n; i++) {
+        prev_op[i] = operator_at(i-1) ? i-1 : prev_op[i-1];
+    }
+    
+    // Find where the unescaped tag each character could belong to starts and ends
+    for(i = 0; i < n; i++) {
+        tag_start[i] = (i > 0 && is_tag_char(expr[i-1])) ? tag_start[i-1] : i;
+    }
+    
+    tag_end[n] = n;
+    for(i = n-1; i >= 0; i--) {
+        tag_end[i] = is_tag_char(expr[i]) ? tag_end[i+1] : i;
+    }
+    
+    next_escape[n] = n;
+    for(i = n-1; i >= 0; i--) {
+        next_escape[i] = (expr[i] == '%') ? i : next_escape[i+1];
+    }
+    
+    depth[0] = 0;
+    for(i = 1; i <= n; i++) {
+        depth[i] = depth[i-1] + (expr[i-1] == '(') - (expr[i-1] == ')');
+    }
+    
+    /*
+     * Depths are between -n and n and change by one at most from one
+     * character to the next, so the first position after i below depth[i]
+     * is the first one at depth[i]-1. at_depth[d] holds the last position
+     * seen at depth d, going right to left for next_lower and left to
+     * right for the operators.
+     */
+    int* at_depth = (int*)parser_alloc((2*n+3)*sizeof(int)) + n+1;
+    
+    for(i = -(int)n-1; i <= (int)n+1; i++) {
+        at_depth[i] = n+1;
+    }
+    
+    for(i = n; i >= 0; i--) {
+        next_lower[i] = at_depth[depth[i]-1];
+        at_depth[depth[i]] = i;
+    }
+    
+    for(i = -(int)n-1; i <= (int)n+1; i++) {
+        at_depth[i] = -1;
+    }
+    
+    for(i = 0; i <= n; i++) {
+        prev_top_op[i] = at_depth[depth[i]];
+        
+        if(operator_at(i)) {
+            at_depth[depth[i]] = i;
+        } else if(expr[i] == '(') {
+            // Operators before it aren't at the top level of anything inside of it
+            at_depth[depth[i]+1] = -1;
+        }
+    }
+    
+    parser_free(at_depth - (n+1), (2*n+3)*sizeof(int));
+    
+    /*
+     * Install this exit handler so I can be lazy and not be
+     * constantly freeing the syntax tree for every error
+     */
+    atexit(free_arena);
+}
+
+
+/*
+ * Free's the lookup tables built by begin_parse(), the syntax
+ * trees that were parsed are kept
+ */
+static void end_parse() {
+    parser_free(prev_op, (n+1)*sizeof(int));
+    parser_free(tag_start, (n+1)*sizeof(int));
+    parser_free(tag_end, (n+1)*sizeof(int));
+    parser_free(depth, (n+1)*sizeof(int));
+    parser_free(next_lower, (n+1)*sizeof(int));
+    parser_free(prev_top_op, (n+1)*sizeof(int));
+    parser_free(next_escape, (n+1)*sizeof(int));
+    parser_free(spans, span_slots*sizeof(uint64_t));
+}
+
+
+/*
+ * Builds the syntax tree of the given expression and stores
+ * it in expr_root. expr_root is NULL if the expression is
+ * invalid.
+ *
+ *  PARAMETERS
+ *      arg - the expression string to be parsed
+ */
+static void parse_expression(char* arg) {
+    begin_parse(arg, strlen(arg));
+    
+    expr_root = parse_expr(0, n, 1);
+    
+    end_parse();
+}
+
+
+/*
+ * The syntax tree is lowered once into a flat program for a small stack
+ * machine so that matching a process doesn't have to chase pointers all
+ * over the arena. Instructions are laid out in postfix order, AND and OR
+ * become conditional jumps over their right hand side so they still
+ * short circuit.
+ */
+#define OP_TAG 0    // Pushes 1 if the process has the tag with ID 'arg', otherwise 0
+#define OP_NOT 1    // Negates the value on top of the stack
+#define OP_XOR 2    // Pops two values and pushes 1 if they differ, otherwise 0
+#define OP_JZ  3    // AND, jumps to 'arg' if the top of the stack is 0, otherwise pops it
+#define OP_JNZ 4    // OR, jumps to 'arg' if the top of the stack is 1, otherwise pops it
+#define OP_CONST 5  // Pushes 'arg'
+
+struct instr {
+    int op;     // One of the OP_* constants above
+    int arg;    // ID of the tag or the jump target
+};
+
+static struct expr_node* plan_root;     // Syntax tree of the expression after optimizing it
+static struct instr* program;   // The compiled expression
+static int program_len;         // Number of instructions in the program
+static __thread int* stack;     // Value stack used to run the program, one for each thread
+static int stack_size;          // Most values the program ever has on the stack
+static int stack_depth;         // Values on the stack at the point being compiled
+
+/*
+ * Every distinct tag in the expression is interned to a small integer ID
+ * when the expression is compiled. Tags read from /proc/ptags are looked
+ * up once per line and recorded as a bit in a bitset, so the program only
+ * ever has to test bits. Tags that aren't part of the expression have no
+ * ID and are skipped.
+ */
+struct tag_entry {
+    int start;                      // Index of the tag in the expression string
+    int len;                        // Number of characters in the tag
+};
+
+static struct tag_entry* tag_entries;   // tag_entries[id] is the tag with that ID
+static int tag_ids;                     // Number of IDs handed out
+static int* id_table;                   // Open addressing hash table of ID+1, 0 marks an empty slot
+static size_t id_table_size;            // Number of slots, always a power of 2
+static __thread uint64_t* tag_bits;     // Bitset of the IDs of the tags a process has, one for each thread
+static int tag_words;                   // Number of 64 bit words in tag_bits
+
+/*
+ * The well formed lines of the process mark_ptags() was last called for,
+ * recorded while the lines are split anyway so that they can be written
+ * out without being scanned again
+ */
+static __thread struct iovec* marked_lines;     // Start and length of every line, null terminator excluded
+static __thread size_t marked_count;            // Number of lines in marked_lines
+static __thread size_t marked_size;             // Number of lines marked_lines has room for
+
+/*
+ * Processes forked from the same parent usually carry the same tags, so
+ * the result of the program is remembered for every distinct tag bitset
+ * it was run on. Only the expression's own tags have bits, so processes
+ * that differ in other tags still share a result. The memo is an open
+ * addressing hash table keyed by the bitset. Every thread has its own
+ * so that threads never have to wait for each other, see scan_ptags().
+ */
+static __thread uint64_t* memo_keys;            // memo_keys + slot*tag_words is the bitset of a slot
+static __thread uint64_t* memo_results;         // memo_results + slot*result_words is what was computed for the bitset
+static __thread char* memo_used;                // Non-zero for the slots that are in use
+static int result_words;                        // Number of 64 bit words of results, one bit for each selector
+static __thread size_t memo_size;               // Number of slots, always a power of 2
+static __thread size_t memo_count;              // Number of distinct bitsets stored
+static __thread unsigned long memo_lookups;     // Number of processes matched through the memo
+static __thread unsigned long memo_hits;        // Number of those whose result was already known
+static unsigned long scan_lookups;              // memo_lookups of the other threads once they finished
+static unsigned long scan_hits;                 // memo_hits of the other threads once they finished
+static unsigned long scan_sets;                 // memo_count of the other threads once they finished
+
+
+/*
+ * Free's the compiled program, to be used as an exit handler.
+ */
+static void free_program() {
+    free(program);
+    free(stack);
+    free(tag_entries);
+    free(id_table);
+    free(tag_bits);
+    free(memo_keys);
+    free(memo_results);
+    free(memo_used);
+    free(marked_lines);
+}
+
+
+/*
+ * FNV-1a hash of a tag
+ */
+static uint32_t hash_tag(const char* tag, int len) {
+    uint32_t hash = 2166136261u;
+    
+    int i;
+    for(i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)tag[i]) * 16777619u;
+    }
+    
+    return hash;
+}
+
+
+/*
+ * Finds the slot in the ID hash table that either holds the
+ * given tag or is the empty slot where it would be stored
+ */
+static size_t id_slot(const char* tag, int len) {
+    size_t i = hash_tag(tag, len) & (id_table_size-1);
+    
+    while(id_table[i] != 0) {
+        struct tag_entry* entry = &tag_entries[id_table[i]-1];
+        
+        if(entry->len == len && memcmp(expr + entry->start, tag, len) == 0) {
+            break;
+        }
+        
+        i = (i+1) & (id_table_size-1);
+    }
+    
+    return i;
+}
+
+
+/*
+ * Returns the ID of a tag in the expression, handing out
+ * a new ID the first time the tag is seen
+ */
+static int intern_tag(int start, int len) {
+    size_t i = id_slot(expr + start, len);
+    
+    if(id_table[i] == 0) {
+        tag_entries[tag_ids].start = start;
+        tag_entries[tag_ids].len   = len;
+        
+        id_table[i] = ++tag_ids;
+    }
+    
+    return id_table[i]-1;
+}
+
+
+/*
+ * Returns the ID of a tag read from /proc/ptags or -1 if the tag
+ * isn't part of the expression
+ */
+static int lookup_tag(const char* tag, int len) {
+    return id_table[id_slot(tag, len)]-1;
+}
+
+
+/*
+ * Appends an instruction to the program
+ */
+static void emit(int op, int arg) {
+    struct instr* in = &program[program_len++];
+    
+    in->op  = op;
+    in->arg = arg;
+}
+
+
+/*
+ * Recursively appends the instructions for a syntax tree to the program
+ *
+ *  PARAMETERS
+ *      node - a pointer to the root of the syntax tree
+ */
+static void compile_node(struct expr_node* node) {
+    int jump;
+    
+    switch(node->type) {
+        case EXPR_TAG:
+            emit(OP_TAG, intern_tag(node->start, node->len));
+            
+            if(++stack_depth > stack_size) {
+                stack_size = stack_depth;
+            }
+            break;
+        
+        case EXPR_FALSE:
+        case EXPR_TRUE:
+            emit(OP_CONST, node->type == EXPR_TRUE);
+            
+            if(++stack_depth > stack_size) {
+                stack_size = stack_depth;
+            }
+            break;
+        
+        case EXPR_NOT:
+            compile_node(node->left);
+            emit(OP_NOT, 0);
+            break;
+        
+        case EXPR_XOR:
+            compile_node(node->left);
+            compile_node(node->right);
+            emit(OP_XOR, 0);
+            
+            stack_depth--;
+            break;
+        
+        default:    // EXPR_AND and EXPR_OR
+            compile_node(node->left);
+            
+            // The target is patched in once the right hand side has been compiled
+            jump = program_len;
+            emit((node->type == EXPR_AND) ? OP_JZ : OP_JNZ, 0);
+            
+            stack_depth--;
+            compile_node(node->right);
+            
+            program[jump].arg = program_len;
+    }
+}
+
+
+/*
+ * Sets up the tag ID hash table for every syntax tree node the parser
+ * built, exits with code 3 if memory could not be allocated.
+ */
+static void init_tag_ids() {
+    // There can't be more tags than nodes
+    id_table_size = 16;
+    while(id_table_size < node_count*2) {
+        id_table_size *= 2;
+    }
+    
+    tag_entries = malloc(node_count*sizeof(struct tag_entry));
+    id_table    = calloc(id_table_size, sizeof(int));
+    if(tag_entries == NULL || id_table == NULL) {
+        fprintf(stderr, "tagstat: out of memory. qutting...\n");
+        exit(3);
+    }
+    
+    atexit(free_program);
+    
+    tag_ids = 0;
+}
+
+
+/*
+ * Allocates the bitset of a process' tags once every tag has its
+ * ID, exits with code 3 if memory could not be allocated.
+ */
+static void init_tag_bits() {
+    tag_words = (tag_ids+63)/64;
+    
+    tag_bits = malloc(tag_words*sizeof(uint64_t));
+    if(tag_bits == NULL) {
+        fprintf(stderr, "tagstat: out of memory. qutting...\n");
+        exit(3);
+    }
+}
+
+
+/*
+ * Compiles the optimized syntax tree in plan_root into program, see
+ * plan_expression(). Exits with code 3 if memory could not be allocated.
+ */
+static void compile_expression() {
+    // Every node becomes exactly one instruction
+    program = malloc(node_count*sizeof(struct instr));
+    if(program == NULL) {
+        fprintf(stderr, "tagstat: out of memory. qutting...\n");
+        exit(3);
+    }
+    
+    program_len  = 0;
+    stack_size   = 0;
+    stack_depth  = 0;
+    result_words = 1;
+    
+    compile_node(plan_root);
+    
+    /*
+     * A jump that lands on a jump of the same kind is always taken
+     * again, so it can go straight to where that one goes. Going
+     * backwards means every target has already been resolved, long
+     * chains like 'a || b || c || ...' are then left in one jump.
+     */
+    int pc;
+    for(pc = program_len-1; pc >= 0; pc--) {
+        struct instr* in = &program[pc];
+        
+        if( (in->op == OP_JZ || in->op == OP_JNZ) && in->arg < program_len && program[in->arg].op == in->op ) {
+            in->arg = program[in->arg].arg;
+        }
+    }
+    
+    stack = malloc(stack_size*sizeof(int));
+    if(stack == NULL) {
+        fprintf(stderr, "tagstat: out of memory. qutting...\n");
+        exit(3);
+    }
+}
+
+
+/*
+ * Runs the compiled expression and determines whether or not the
+ * expression evaluates to true or false given a set of tags
+ *
+ *  PARAMETERS
+ *      bits - bitset of the IDs of the tags to be matched by the expression
+ *
+ *  RETURN VALUE
+ *      1 if the provided set of tags matched the expression otherwise 0
+ */
+static int evaluate(const uint64_t* bits) {
+    const struct instr* in  = program;
+    const struct instr* end = program + program_len;
+    int* sp = stack;
+    
+    while(in < end) {
+        switch(in->op) {
+            case OP_TAG:
+                *(sp++) = (int)(bits[in->arg >> 6] >> (in->arg & 63)) & 1;
+                break;
+            
+            case OP_NOT:
+                sp[-1] = !sp[-1];
+                break;
+            
+            case OP_XOR:
+                sp--;
+                sp[-1] = (sp[-1] != sp[0]);
+                break;
+            
+            case OP_CONST:
+                *(sp++) = in->arg;
+                break;
+            
+            case OP_JZ:
+                if(sp[-1] == 0) {
+                    in = program + in->arg;
+                    continue;
+                }
+                
+                sp--;
+                break;
+            
+            default:    // OP_JNZ
+                if(sp[-1] != 0) {
+                    in = program + in->arg;
+                    continue;
+                }
+                
+                sp--;
+        }
+        
+        in++;
+    }
+    
+    return stack[0];
+}
+
+
+/*
+ * Returns the slot of a tag bitset in the memo or the empty slot
+ * where it would go
+ */
+static size_t memo_slot(const uint64_t* bits) {
+    uint64_t h = 0;
+    
+    int w;
+    for(w = 0; w < tag_words; w++) {
+        h = (h ^ bits[w]) * 0x9E3779B97F4A7C15ull;
+    }
+    
+    size_t i = (size_t)(h ^ (h >> 32)) & (memo_size-1);
+    
+    while(memo_used[i] && memcmp(memo_keys + i*tag_words, bits, tag_words*sizeof(uint64_t)) != 0) {
+        i = (i+1) & (memo_size-1);
+    }
+    
+    return i;
+}
+
+
+/*
+ * Doubles the number of slots of the memo, exits with code 3 if memory
+ * could not be allocated
+ */
+static void grow_memo() {
+    uint64_t* old_keys    = memo_keys;
+    uint64_t* old_results = memo_results;
+    char*     old_used    = memo_used;
+    size_t    old_size    = memo_size;
+    
+    memo_size    = (old_size > 0) ? old_size*2 : 256;
+    memo_keys    = malloc(memo_size*tag_words*sizeof(uint64_t));
+    memo_results = malloc(memo_size*result_words*sizeof(uint64_t));
+    memo_used    = calloc(memo_size, 1);
+    if(memo_keys == NULL || memo_results == NULL || memo_used == NULL) {
+        fprintf(stderr, "tagstat: out of memory. qutting...\n");
+        exit(3);
+    }
+    
+    size_t i;
+    for(i = 0; i < old_size; i++) {
+        if(old_used[i]) {
+            size_t slot = memo_slot(old_keys + i*tag_words);
+            
+            memcpy(memo_keys + slot*tag_words, old_keys + i*tag_words, tag_words*sizeof(uint64_t));
+            memcpy(memo_results + slot*result_words, old_results + i*result_words, result_words*sizeof(uint64_t));
+            memo_used[slot] = 1;
+        }
+    }
+    
+    free(old_keys);
+    free(old_results);
+    free(old_used);
+}
+
+
+/*
+ * Looks a tag bitset up in the memo. A bitset that wasn't seen before
+ * is added and the caller has to fill in its results.
+ *
+ *  PARAMETERS
+ *      bits    - bitset of the IDs of the tags of a process
+ *      results - where to store a pointer to the result_words results
+ *                of the bitset
+ *
+ *  RETURN VALUE
+ *      1 if the results were already known otherwise 0
+ */
+static int memo_lookup(const uint64_t* bits, uint64_t** results) {
+    memo_lookups++;
+    
+    if( (memo_count+1)*2 > memo_size ) {
+        grow_memo();
+    }
+    
+    size_t slot = memo_slot(bits);
+    *results = memo_results + slot*result_words;
+    
+    if(memo_used[slot]) {
+        memo_hits++;
+        return 1;
+    }
+    
+    memcpy(memo_keys + slot*tag_words, bits, tag_words*sizeof(uint64_t));
+    memo_used[slot] = 1;
+    memo_count++;
+    
+    return 0;
+}
+
+
+/*
+ * Same as evaluate() but the program is only run once for every
+ * distinct bitset, see memo_keys above
+ *
+ *  PARAMETERS
+ *      bits - bitset of the IDs of the tags to be matched by the expression
+ *
+ *  RETURN VALUE
+ *      1 if the provided set of tags matched the expression otherwise 0
+ */
+static int evaluate_memo(const uint64_t* bits) {
+    uint64_t* result;
+    
+    if(!memo_lookup(bits, &result)) {
+        *result = evaluate(bits);
+    }
+    
+    return (int)*result;
+}
+
+
+/*
+ * One line of a buffered proc read split in place by split_line()
+ */
+struct ptag_line {
+    char* tag;          // Start of the tag, NULL if the line is malformed
+    int   tag_len;      // Number of characters in the tag
+    char* state;        // The rest of the line after the tag, newline included
+    long  len;          // Number of characters in the line, not counting the null terminator
+    char* next;         // Start of the next line, 'end' if there is none
+};
+
+
+/*
+ * Reads the pid at the start of a line of a buffered proc read, that
+ * is every digit up to the space in front of the first separator
+ */
+static pid_t line_pid(const char* line, const char* end) {
+    pid_t pid = 0;
+    
+    while(line < end && *line >= '0' && *line <= '9') {
+        pid = pid*10 + (*line++ - '0');
+    }
+    
+    return pid;
+}
+
+
+/*
+ * Splits a line of a buffered proc read into its fields in a single
+ * pass over the line, without copying anything. Lines have the form
+ * "<pid> : <tag> : <state>\n" followed by a null terminator. memchr()
+ * finds the terminator and the separator after the pid, the separator
+ * in front of the state is searched backwards from the end of the line
+ * since a tag may contain colons but a state never does.
+ *
+ *  PARAMETERS
+ *      line - A pointer to the start of the line in the proc entry buffer
+ *
+ *      end  - A pointer to the end of the proc entry buffer
+ *
+ *      out  - where to store the fields of the line
+ */
+static void split_line(char* line, char* end, struct ptag_line* out) {
+    char* nul = memchr(line, '\0', end - line);
+    if(nul == NULL) {
+        nul = end;
+    }
+    
+    out->len  = nul - line;
+    out->next = (nul < end) ? nul + 1 : end;
+    out->tag  = NULL;
+    
+    char* sep1 = memchr(line, ':', nul - line);
+    if(sep1 == NULL) {
+        // Formatting error, shouldn't happen, ignore tag
+        return;
+    }
+    
+    char* sep2 = nul - 1;
+    while(sep2 > sep1 && *sep2 != ':') {
+        sep2--;
+    }
+    
+    if(sep2 - sep1 < 3) {
+        // Formatting error, shouldn't happen, ignore tag
+        return;
+    }
+    
+    out->tag     = sep1 + 2;
+    out->tag_len = (int)(sep2 - sep1) - 3;
+    out->state   = sep2 + 2;
+}
+
+
+/*
+ * Proc parsing helper function, records which of the expression's
+ * tags the process on the first line of a buffered proc read has.
+ * Each of its lines is split once by split_line(), only the pid of
+ * the line after its last one is read as well. The well formed lines
+ * are recorded in marked_lines. Exits with code 3 if memory could not
+ * be allocated.
+ *
+ *  PARAMETERS
+ *      line    - A pointer to the start of the first line of the
+ *                process in the proc entry buffer
+ *
+ *      end     - A pointer to the end of the proc entry buffer
+ *
+ *      bits    - A bitset with room for every tag ID, it is cleared
+ *                before the tags are recorded
+ *
+ *      pid     - where to store the pid of the process
+ *
+ *  RETURN VALUE
+ *      A pointer to the first line of the next process or NULL
+ *      if the end of the proc entry buffer was reached
+ */
+static char* mark_ptags(char* line, char* end, uint64_t* bits, pid_t* pid) {
+    memset(bits, 0, tag_words*sizeof(uint64_t));
+    
+    *pid = line_pid(line, end);
+    marked_count = 0;
+    
+    /*
+     * A line with another pid is not part of the process
+     * currently being scanned, this means that the end
+     * of the current tag set has been reached.
+     */
+    while(line < end && line_pid(line, end) == *pid) {
+        struct ptag_line fields;
+        split_line(line, end, &fields);
+        
+        // Only tags that appear in the expression have an ID
+        if(fields.tag != NULL) {
+            int id = lookup_tag(fields.tag, fields.tag_len);
+            if(id >= 0) {
+                bits[id >> 6] |= (uint64_t)1 << (id & 63);
+            }
+            
+            if(marked_count == marked_size) {
+                marked_size  = (marked_size > 0) ? marked_size*2 : 64;
+                marked_lines = realloc(marked_lines, marked_size*sizeof(struct iovec));
+                
+                if(marked_lines == NULL) {
+                    fprintf(stderr, "tagstat: out of memory. qutting...\n");
+                    exit(3);
+                }
+            }
+            
+            marked_lines[marked_count].iov_base = line;
+            marked_lines[marked_count].iov_len  = fields.len;
+            marked_count++;
+        }
+        
+        line = fields.next;
+    }
+    
+    return (line < end) ? line : NULL;
+}
+
+
+/*
+ * Before the expression is compiled it is optimized for the processes it
+ * is about to be matched against. NOTs of NOTs are removed, chains of the
+ * same operator such as 'a && (b && c)' are flattened and constants are
+ * folded, e.g. 'a && !a' is always false and the tag 'a' in 'a || a' is
+ * only tested once. The operands of every AND and OR chain are then put
+ * in the order that makes the program short circuit as early as possible,
+ * which depends on how many processes carry each tag. Those frequencies
+ * are counted on a sample of the snapshot of /proc/ptags that is matched.
+ *
+ * Every operand gets an estimate of the chance that it is true (p) and of
+ * the number of instructions it runs (cost). An AND chain stops at the
+ * first false operand, so operands are sorted by cost/(1-p), cheap and
+ * rarely true first. An OR chain stops at the first true operand, so they
+ * are sorted by cost/p instead. Tags are assumed to be independent.
+ */
+#define PLAN_SAMPLES 4096   // Most processes whose tags are counted
+#define PLAN_CHUNKS  64     // Number of places in /proc/ptags the samples are spread over
+
+struct plan_op {
+    struct expr_node* node;     // Operand of a flattened chain
+    double rank;                // Key the chain is sorted by
+    int index;                  // Position of the operand in the chain as written
+};
+
+static unsigned long* tag_freq;         // tag_freq[id] is the number of sampled processes with the tag
+static unsigned long sample_count;      // Number of processes sampled, 0 if there was no snapshot
+static struct plan_op* plan_ops;        // Stack of the operands of the chains being optimized
+static size_t plan_op_count;            // Number of operands on the stack
+static size_t plan_op_size;             // Number of operands plan_ops has room for
+static char* literal_seen;              // Bit 1 if tag ID 'id' is an operand of the chain, bit 2 if its NOT is
+static size_t plan_nodes;               // Number of nodes the optimizer added to the arena
+static int explain_mode;                // Non-zero if --explain was given
+
+
+/*
+ * Free's the tag frequencies and the optimizer's scratch
+ * memory, to be used as an exit handler.
+ */
+static void free_plan() {
+    free(tag_freq);
+    free(plan_ops);
+    free(literal_seen);
+}
+
+
+/*
+ * Recursively interns every tag of a syntax tree in the same order
+ * compile_node() would, so the IDs don't depend on the optimizer
+ */
+static void intern_tags(struct expr_node* node) {
+    if(node->type == EXPR_TAG) {
+        intern_tag(node->start, node->len);
+        return;
+    }
+    
+    intern_tags(node->left);
+    
+    if(node->type != EXPR_NOT) {
+        intern_tags(node->right);
+    }
+}
+
+
+/*
+ * Counts how many processes carry each of the expression's tags. Up to
+ * PLAN_SAMPLES processes are read, taken from PLAN_CHUNKS places spread
+ * evenly over the snapshot so that a run of similar processes doesn't
+ * decide the order alone. The first process of a chunk may be missing
+ * some of its lines, which is fine for an estimate.
+ *
+ *  PARAMETERS
+ *      ptags - A pointer to the start of the proc entry buffer
+ *
+ *      end   - A pointer to the end of the proc entry buffer
+ */
+static void sample_tags(char* ptags, char* end) {
+    size_t len = end - ptags;
+    
+    int chunk;
+    for(chunk = 0; chunk < PLAN_CHUNKS; chunk++) {
+        char* line = ptags + len*chunk/PLAN_CHUNKS;
+        char* stop = ptags + len*(chunk+1)/PLAN_CHUNKS;
+        
+        // Skip to the start of the next line
+        if(chunk > 0) {
+            line = memchr(line, '\0', end - line);
+            if(line == NULL || ++line >= end) {
+                break;
+            }
+        }
+        
+        int i;
+        for(i = 0; i < PLAN_SAMPLES/PLAN_CHUNKS && line != NULL && line < stop; i++) {
+            pid_t pid;
+            line = mark_ptags(line, end, tag_bits, &pid);
+            
+            int w;
+            for(w = 0; w < tag_words; w++) {
+                uint64_t bits = tag_bits[w];
+                
+                while(bits != 0) {
+                    tag_freq[w*64 + __builtin_ctzll(bits)]++;
+                    bits &= bits - 1;
+                }
+            }
+            
+            sample_count++;
+        }
+    }
+}
+
+
+/*
+ * Estimates the chance that a subtree of the plan is true and the number
+ * of instructions the program runs for it, see the comment above. The
+ * estimates are stored in the nodes and only worked out once per node
+ * from those of its operands, so estimating a whole tree is linear in
+ * its size however often the optimizer and --explain ask again.
+ *
+ *  PARAMETERS
+ *      node - a pointer to the root of the subtree, node->p and
+ *             node->cost are set once this returns
+ */
+static void estimate(struct expr_node* node) {
+    if(node->cost > 0) {
+        return;
+    }
+    
+    struct expr_node* left  = node->left;
+    struct expr_node* right = node->right;
+    
+    switch(node->type) {
+        case EXPR_TAG:
+            // Never exactly 0 or 1, a tag missing from the sample may still be out there
+            if(sample_count > 0) {
+                node->p = (tag_freq[intern_tag(node->start, node->len)] + 1.0)/(sample_count + 2.0);
+            } else {
+                node->p = 0.5;
+            }
+            
+            node->cost = 1;
+            break;
+        
+        case EXPR_FALSE:
+        case EXPR_TRUE:
+            node->p    = (node->type == EXPR_TRUE);
+            node->cost = 1;
+            break;
+        
+        case EXPR_NOT:
+            estimate(left);
+            
+            node->p    = 1 - left->p;
+            node->cost = left->cost + 1;
+            break;
+        
+        case EXPR_AND:
+            estimate(left);
+            estimate(right);
+            
+            node->p    = left->p*right->p;
+            node->cost = left->cost + 1 + left->p*right->cost;
+            break;
+        
+        case EXPR_OR:
+            estimate(left);
+            estimate(right);
+            
+            node->p    = 1 - (1 - left->p)*(1 - right->p);
+            node->cost = left->cost + 1 + (1 - left->p)*right->cost;
+            break;
+        
+        default:    // EXPR_XOR
+            estimate(left);
+            estimate(right);
+            
+            node->p    = left->p*(1 - right->p) + right->p*(1 - left->p);
+            node->cost = left->cost + 1 + right->cost;
+    }
+}
+
+
+/*
+ * Pushes an operand of a chain onto plan_ops, exits with code 3
+ * if memory could not be allocated.
+ */
+static void push_plan_op(struct expr_node* node) {
+    if(plan_op_count == plan_op_size) {
+        plan_op_size = (plan_op_size > 0) ? plan_op_size*2 : 64;
+        
+        struct plan_op* bigger = realloc(plan_ops, plan_op_size*sizeof(struct plan_op));
+        if(bigger == NULL) {
+            fprintf(stderr, "tagstat: out of memory. qutting...\n");
+            exit(3);
+        }
+        
+        plan_ops = bigger;
+    }
+    
+    plan_ops[plan_op_count].node  = node;
+    plan_ops[plan_op_count].index = (int)plan_op_count;
+    plan_op_count++;
+}
+
+
+/*
+ * Orders the operands of a chain by rank, operands of equal
+ * rank keep the order they were written in
+ */
+static int compare_plan_ops(const void* a, const void* b) {
+    const struct plan_op* op1 = a;
+    const struct plan_op* op2 = b;
+    
+    if(op1->rank != op2->rank) {
+        return (op1->rank < op2->rank) ? -1 : 1;
+    }
+    
+    return op1->index - op2->index;
+}
+
+
+/*
+ * Pushes the operands of an optimized chain of 'type' operators onto plan_ops
+ */
+static void push_flat(struct expr_node* node, int type) {
+    if(node->type == type) {
+        push_flat(node->left, type);
+        push_flat(node->right, type);
+    } else {
+        push_plan_op(node);
+    }
+}
+
+
+static struct expr_node* optimize(struct expr_node* node);
+
+
+/*
+ * Optimizes the operands of a chain of 'type' operators and pushes them
+ * onto plan_ops, operands that turn out to be chains of the same operator
+ * once optimized are flattened into this one
+ */
+static void push_chain(struct expr_node* node, int type) {
+    if(node->type == type) {
+        push_chain(node->left, type);
+        push_chain(node->right, type);
+    } else {
+        push_flat(optimize(node), type);
+    }
+}
+
+
+/*
+ * Returns the NOT of an optimized subtree, removing a NOT
+ * instead of adding one and folding constants
+ */
+static struct expr_node* negate(struct expr_node* node) {
+    if(node->type == EXPR_NOT) {
+        return node->left;
+    }
+    
+    if(node->type == EXPR_FALSE || node->type == EXPR_TRUE) {
+        return new_expr((node->type == EXPR_TRUE) ? EXPR_FALSE : EXPR_TRUE, 0, 0, NULL, NULL);
+    }
+    
+    return new_expr(EXPR_NOT, 0, 0, node, NULL);
+}
+
+
+/*
+ * Folds the constants and repeated tags of an AND or OR chain and sorts
+ * its operands, see the comment above
+ *
+ *  PARAMETERS
+ *      node - a pointer to the first node of the chain
+ *
+ *  RETURN VALUE
+ *      The optimized chain
+ */
+static struct expr_node* optimize_chain(struct expr_node* node) {
+    int type     = node->type;
+    int absorb   = (type == EXPR_AND) ? EXPR_FALSE : EXPR_TRUE;    // Decides the chain on its own
+    int identity = (type == EXPR_AND) ? EXPR_TRUE : EXPR_FALSE;    // Has no effect on the chain
+    
+    size_t base = plan_op_count;
+    push_chain(node, type);
+    
+    struct expr_node* result = NULL;
+    size_t count = 0;
+    
+    size_t i;
+    for(i = base; i < plan_op_count; i++) {
+        struct expr_node* op = plan_ops[i].node;
+        
+        if(op->type == absorb) {
+            result = op;
+            break;
+        }
+        
+        if(op->type == identity) {
+            continue;
+        }
+        
+        // A tag and its NOT make the chain constant, a repeated tag changes nothing
+        struct expr_node* tag = (op->type == EXPR_NOT) ? op->left : op;
+        if(tag->type == EXPR_TAG) {
+            int id  = intern_tag(tag->start, tag->len);
+            int bit = (op->type == EXPR_NOT) ? 2 : 1;
+            
+            if(literal_seen[id] & bit) {
+                continue;
+            }
+            
+            literal_seen[id] |= bit;
+            
+            if(literal_seen[id] == 3) {
+                result = new_expr(absorb, 0, 0, NULL, NULL);
+                break;
+            }
+        }
+        
+        plan_ops[base + count++] = plan_ops[i];
+    }
+    
+    // Clear the marks for the next chain, the operands that were dropped carry the same tags
+    for(i = base; i < base + count; i++) {
+        struct expr_node* op  = plan_ops[i].node;
+        struct expr_node* tag = (op->type == EXPR_NOT) ? op->left : op;
+        
+        if(tag->type == EXPR_TAG) {
+            literal_seen[intern_tag(tag->start, tag->len)] = 0;
+        }
+    }
+    
+    if(result == NULL && count == 0) {
+        result = new_expr(identity, 0, 0, NULL, NULL);
+    }
+    
+    if(result == NULL) {
+        for(i = base; i < base + count; i++) {
+            struct expr_node* op = plan_ops[i].node;
+            estimate(op);
+            
+            double stop = (type == EXPR_AND) ? 1 - op->p : op->p;
+            plan_ops[i].rank = (stop > 0) ? op->cost/stop : HUGE_VAL;
+        }
+        
+        qsort(plan_ops + base, count, sizeof(struct plan_op), compare_plan_ops);
+        
+        // Rebuilt leaning left, the way the parser builds chains
+        result = plan_ops[base].node;
+        for(i = base+1; i < base + count; i++) {
+            result = new_expr(type, 0, 0, result, plan_ops[i].node);
+        }
+    }
+    
+    plan_op_count = base;
+    
+    return result;
+}
+
+
+/*
+ * Recursively optimizes a syntax tree, see the comment above. Nodes that
+ * change are allocated anew, expr_root itself is left as it was.
+ *
+ *  PARAMETERS
+ *      node - a pointer to the root of the syntax tree
+ *
+ *  RETURN VALUE
+ *      The optimized tree
+ */
+static struct expr_node* optimize(struct expr_node* node) {
+    struct expr_node* left;
+    struct expr_node* right;
+    
+    switch(node->type) {
+        case EXPR_TAG:
+            return node;
+        
+        case EXPR_NOT:
+            left = optimize(node->left);
+            
+            // The parser never makes constants, so an operand that didn't change isn't one
+            if(left == node->left && left->type != EXPR_NOT) {
+                return node;
+            }
+            
+            return negate(left);
+        
+        case EXPR_XOR:
+            left  = optimize(node->left);
+            right = optimize(node->right);
+            
+            // Either side being constant leaves the other side or its NOT
+            if(left->type == EXPR_FALSE || left->type == EXPR_TRUE) {
+                struct expr_node* tmp = left;
+                left  = right;
+                right = tmp;
+            }
+            
+            if(right->type == EXPR_FALSE) {
+                return left;
+            }
+            
+            if(right->type == EXPR_TRUE) {
+                return negate(left);
+            }
+            
+            if(left->type == EXPR_TAG && right->type == EXPR_TAG &&
+               intern_tag(left->start, left->len) == intern_tag(right->start, right->len)) {
+                return new_expr(EXPR_FALSE, 0, 0, NULL, NULL);
+            }
+            
+            return (left == node->left && right == node->right) ? node : new_expr(EXPR_XOR, 0, 0, left, right);
+        
+        default:    // EXPR_AND and EXPR_OR
+            return optimize_chain(node);
+    }
+}
+
+
+/*
+ * Interns the expression's tags, counts how often they occur in a snapshot
+ * of /proc/ptags and optimizes expr_root into plan_root for it. Exits with
+ * code 3 if memory could not be allocated.
+ *
+ *  PARAMETERS
+ *      ptags - the snapshot the expression will be matched against or NULL,
+ *              the operands are then ordered as if every tag was as common
+ *              as it is rare
+ *
+ *      len   - the number of bytes in the snapshot
+ */
+static void plan_expression(char* ptags, long len) {
+    init_tag_ids();
+    intern_tags(expr_root);
+    init_tag_bits();
+    
+    tag_freq     = calloc(tag_ids, sizeof(unsigned long));
+    literal_seen = calloc(tag_ids, 1);
+    if(tag_freq == NULL || literal_seen == NULL) {
+        fprintf(stderr, "tagstat: out of memory. qutting...\n");
+        exit(3);
+    }
+    
+    atexit(free_plan);
+    
+    if(ptags != NULL && len > 0) {
+        sample_tags(ptags, ptags + len);
+    }
+    
+    size_t parsed = node_count;
+    plan_root  = optimize(expr_root);
+    plan_nodes = node_count - parsed;
+}
+
+
+static void print_plan(struct expr_node* node, int depth);
+
+
+/*
+ * Prints the operands of a chain of 'type' operators at the same depth
+ */
+static void print_chain(struct expr_node* node, int type, int depth) {
+    if(node->type == type) {
+        print_chain(node->left, type, depth);
+        print_chain(node->right, type, depth);
+    } else {
+        print_plan(node, depth);
+    }
+}
+
+/*
+ * Recursively prints a subtree of the plan with the estimates of every
+ * node, chains of the same operator are printed as a single node
+ *
+ *  PARAMETERS
+ *      node  - a pointer to the root of the subtree
+ *      depth - the number of nodes above it
+ */
+static void print_plan(struct expr_node* node, int depth) {
+    static const char* const names[] = { "", "NOT", "AND", "OR", "XOR", "FALSE", "TRUE" };
+    
+    estimate(node);
+    
+    fprintf(stderr, "\t%*s", depth*4, "");
+    
+    if(node->type == EXPR_TAG) {
+        fprintf(stderr, "'%.*s'", node->len, expr + node->start);
+    } else {
+        fprintf(stderr, "%s", names[node->type]);
+    }
+    
+    fprintf(stderr, "  (p=%.3f, cost=%.2f)\n", node->p, node->cost);
+    
+    if(node->type == EXPR_AND || node->type == EXPR_OR || node->type == EXPR_XOR) {
+        print_chain(node->left, node->type, depth+1);
+        print_chain(node->right, node->type, depth+1);
+    } else if(node->type == EXPR_NOT) {
+        print_plan(node->left, depth+1);
+    }
+}
+
+
+/*
+ * Prints the optimized expression to stderr (--explain), stdout
+ * is left alone so the output can still be piped.
+ */
+static void print_explain() {
+    if(sample_count > 0) {
+        fprintf(stderr, "Plan, tag frequencies from %lu sampled processes:\n", sample_count);
+    } else {
+        fprintf(stderr, "Plan, without tag frequencies:\n");
+    }
+    
+    print_plan(plan_root, 0);
+}
+
+
+/*
+ * Batch mode (--batch) evaluates the expression for every process at
+ * once. While /proc/ptags is scanned each process is given an index and
+ * every tag ID gets a column, a bitmap with bit p set if process p has
+ * the tag. The expression is then compiled into a second program without
+ * jumps whose instructions combine whole columns, so matching thousands
+ * of processes takes a handful of passes over memory instead of running
+ * the program once per process.
+ */
+#define COL_TAG    0    // Pushes a copy of the column of tag 'arg'
+#define COL_NOT    1    // Inverts the column on top of the stack
+#define COL_AND    2    // Combines the column below the top with the top
+#define COL_OR     3    // column, or with the column of tag 'arg' if 'arg'
+#define COL_XOR    4    // is not -1 (in which case nothing is popped)
+#define COL_ANDNOT 5    // Like COL_AND but with the second column inverted
+
+static int batch_mode;                  // Non-zero if --batch was given
+
+static struct instr* column_program;    // The compiled expression for batch mode
+static int column_program_len;          // Number of instructions in the program
+static int column_stack_size;           // Most columns the program ever has on the stack
+static int column_stack_depth;          // Columns on the stack at the point being compiled
+static uint64_t* column_stack;          // Column stack used to run the program
+
+static uint64_t* columns;               // columns + id*batch_words is the column of tag id
+static size_t batch_words;              // Number of 64 bit words allocated for each column
+static size_t batch_count;              // Number of processes scanned
+static pid_t* batch_pids;               // batch_pids[p] is the pid of process p
+static char** batch_lines;              // batch_lines[p] is the first line of process p in the proc buffer
+
+/*
+ * Combines two columns of 'words' words, dst = dst op src (dst = ~dst for COL_NOT)
+ */
+static void (*column_op)(int op, uint64_t* dst, const uint64_t* src, size_t words);
+static const char* column_isa;          // Name of the instruction set column_op uses
+
+
+/*
+ * Free's everything allocated for batch mode, to be used as an exit handler.
+ */
+static void free_batch() {
+    free(column_program);
+    free(column_stack);
+    free(columns);
+    free(batch_pids);
+    free(batch_lines);
+}
+
+
+/*
+ * Portable version of column_op, also used for whatever is left over
+ * after the vectorized versions have gone through all the full vectors
+ */
+static void column_op_scalar(int op, uint64_t* dst, const uint64_t* src, size_t words) {
+    size_t i;
+    
+    switch(op) {
+        case COL_NOT:
+            for(i = 0; i < words; i++) {
+                dst[i] = ~dst[i];
+            }
+            break;
+        
+        case COL_AND:
+            for(i = 0; i < words; i++) {
+                dst[i] &= src[i];
+            }
+            break;
+        
+        case COL_OR:
+            for(i = 0; i < words; i++) {
+                dst[i] |= src[i];
+            }
+            break;
+        
+        case COL_XOR:
+            for(i = 0; i < words; i++) {
+                dst[i] ^= src[i];
+            }
+            break;
+        
+        default:    // COL_ANDNOT
+            for(i = 0; i < words; i++) {
+                dst[i] &= ~src[i];
+            }
+    }
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/*
+ * SSE2 version of column_op, works on 2 words at a time
+ */
+__attribute__((target("sse2")))
+static void column_op_sse2(int op, uint64_t* dst, const uint64_t* src, size_t words) {
+    __m128i* d = (__m128i*)dst;
+    const __m128i* s = (const __m128i*)src;
+    size_t vecs = words/2;
+    size_t i;
+    
+    switch(op) {
+        case COL_NOT:
+            for(i = 0; i < vecs; i++) {
+                _mm_storeu_si128(d+i, _mm_xor_si128(_mm_loadu_si128(d+i), _mm_set1_epi32(-1)));
+            }
+            break;
+        
+        case COL_AND:
+            for(i = 0; i < vecs; i++) {
+                _mm_storeu_si128(d+i, _mm_and_si128(_mm_loadu_si128(d+i), _mm_loadu_si128(s+i)));
+            }
+            break;
+        
+        case COL_OR:
+            for(i = 0; i < vecs; i++) {
+                _mm_storeu_si128(d+i, _mm_or_si128(_mm_loadu_si128(d+i), _mm_loadu_si128(s+i)));
+            }
+            break;
+        
+        case COL_XOR:
+            for(i = 0; i < vecs; i++) {
+                _mm_storeu_si128(d+i, _mm_xor_si128(_mm_loadu_si128(d+i), _mm_loadu_si128(s+i)));
+            }
+            break;
+        
+        default:    // COL_ANDNOT, note that _mm_andnot_si128 inverts its first operand
+            for(i = 0; i < vecs; i++) {
+                _mm_storeu_si128(d+i, _mm_andnot_si128(_mm_loadu_si128(s+i), _mm_loadu_si128(d+i)));
+            }
+    }
+    
+    column_op_scalar(op, dst + vecs*2, (src != NULL) ? src + vecs*2 : NULL, words - vecs*2);
+}
+
+
+/*
+ * AVX2 version of column_op, works on 4 words at a time
+ */
+__attribute__((target("avx2")))
+static void column_op_avx2(int op, uint64_t* dst, const uint64_t* src, size_t words) {
+    __m256i* d = (__m256i*)dst;
+    const __m256i* s = (const __m256i*)src;
+    size_t vecs = words/4;
+    size_t i;
+    
+    switch(op) {
+        case COL_NOT:
+            for(i = 0; i < vecs; i++) {
+                _mm256_storeu_si256(d+i, _mm256_xor_si256(_mm256_loadu_si256(d+i), _mm256_set1_epi32(-1)));
+            }
+            break;
+        
+        case COL_AND:
+            for(i = 0; i < vecs; i++) {
+                _mm256_storeu_si256(d+i, _mm256_and_si256(_mm256_loadu_si256(d+i), _mm256_loadu_si256(s+i)));
+            }
+            break;
+        
+        case COL_OR:
+            for(i = 0; i < vecs; i++) {
+                _mm256_storeu_si256(d+i, _mm256_or_si256(_mm256_loadu_si256(d+i), _mm256_loadu_si256(s+i)));
+            }
+            break;
+        
+        case COL_XOR:
+            for(i = 0; i < vecs; i++) {
+                _mm256_storeu_si256(d+i, _mm256_xor_si256(_mm256_loadu_si256(d+i), _mm256_loadu_si256(s+i)));
+            }
+            break;
+        
+        default:    // COL_ANDNOT, note that _mm256_andnot_si256 inverts its first operand
+            for(i = 0; i < vecs; i++) {
+                _mm256_storeu_si256(d+i, _mm256_andnot_si256(_mm256_loadu_si256(s+i), _mm256_loadu_si256(d+i)));
+            }
+    }
+    
+    column_op_scalar(op, dst + vecs*4, (src != NULL) ? src + vecs*4 : NULL, words - vecs*4);
+}
+
+#endif
+
+
+/*
+ * Picks the best version of column_op the CPU supports
+ */
+static void select_column_op() {
+    column_op  = column_op_scalar;
+    column_isa = "scalar";
+    
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    
+    if(__builtin_cpu_supports("avx2")) {
+        column_op  = column_op_avx2;
+        column_isa = "avx2";
+    } else if(__builtin_cpu_supports("sse2")) {
+        column_op  = column_op_sse2;
+        column_isa = "sse2";
+    }
+#endif
+}
+
+
+/*
+ * Recursively appends the batch mode instructions for a syntax tree
+ * to the column program. Binary operators whose right hand side is a
+ * tag (or a negated tag for AND) read its column directly instead of
+ * pushing a copy of it first.
+ *
+ *  PARAMETERS
+ *      node - a pointer to the root of the syntax tree
+ */
+static void compile_column_node(struct expr_node* node) {
+    struct instr* in;
+    struct expr_node* right;
+    int op;
+    
+    switch(node->type) {
+        case EXPR_TAG:
+            in = &column_program[column_program_len++];
+            in->op  = COL_TAG;
+            in->arg = intern_tag(node->start, node->len);
+            
+            if(++column_stack_depth > column_stack_size) {
+                column_stack_size = column_stack_depth;
+            }
+            return;
+        
+        case EXPR_NOT:
+            compile_column_node(node->left);
+            
+            in = &column_program[column_program_len++];
+            in->op  = COL_NOT;
+            in->arg = -1;
+            return;
+        
+        case EXPR_AND:
+            op = COL_AND;
+            break;
+        
+        case EXPR_OR:
+            op = COL_OR;
+            break;
+        
+        default:    // EXPR_XOR
+            op = COL_XOR;
+    }
+    
+    compile_column_node(node->left);
+    
+    right = node->right;
+    if(op == COL_AND && right->type == EXPR_NOT) {
+        op    = COL_ANDNOT;
+        right = right->left;
+    }
+    
+    int arg = -1;
+    if(right->type == EXPR_TAG) {
+        arg = intern_tag(right->start, right->len);
+    } else {
+        compile_column_node(right);
+        column_stack_depth--;
+    }
+    
+    in = &column_program[column_program_len++];
+    in->op  = op;
+    in->arg = arg;
+}
+
+
+/*
+ * Compiles the syntax tree in expr_root into column_program and picks
+ * the column_op to run it with, exits with code 3 if memory could not
+ * be allocated. Has to be called after compile_expression.
+ */
+static void compile_columns() {
+    // Every node becomes at most one instruction
+    column_program = malloc(node_count*sizeof(struct instr));
+    if(column_program == NULL) {
+        fprintf(stderr, "tagstat: out of memory. qutting...\n");
+        exit(3);
+    }
+    
+    atexit(free_batch);
+    
+    column_program_len = 0;
+    column_stack_size  = 0;
+    column_stack_depth = 0;
+    
+    compile_column_node(expr_root);
+    
+    select_column_op();
+}
+
+
+/*
+ * Doubles the number of processes the columns have room for, exits
+ * with code 3 if memory could not be allocated.
+ */
+static void grow_columns() {
+    size_t words = (batch_words == 0) ? 16 : batch_words*2;
+    
+    uint64_t* new_columns = calloc(tag_ids*words, sizeof(uint64_t));
+    pid_t*    new_pids    = realloc(batch_pids, words*64*sizeof(pid_t));
+    if(new_pids != NULL) {
+        batch_pids = new_pids;
+    }
+    
+    char** new_lines = realloc(batch_lines, words*64*sizeof(char*));
+    if(new_lines != NULL) {
+        batch_lines = new_lines;
+    }
+    
+    if(new_columns == NULL || new_pids == NULL || new_lines == NULL) {
+        fprintf(stderr, "tagstat: out of memory. qutting...\n");
+        free(new_columns);
+        exit(3);
+    }
+    
+    int id;
+    for(id = 0; id < tag_ids && batch_words > 0; id++) {
+        memcpy(new_columns + id*words, columns + id*batch_words, batch_words*sizeof(uint64_t));
+    }
+    
+    free(columns);
+    
+    columns     = new_columns;
+    batch_words = words;
+}
+
+
+/*
+ * Scans every process in a buffered proc read, builds the tag columns
+ * and runs the column program over them, exits with code 3 if memory
+ * could not be allocated.
+ *
+ *  PARAMETERS
+ *      ptags - A pointer to the start of the proc entry buffer
+ *
+ *      end   - A pointer to the end of the proc entry buffer
+ *
+ *  RETURN VALUE
+ *      A bitmap with bit p set if process p (see batch_pids and
+ *      batch_lines) matches the expression, bits past batch_count
+ *      are meaningless
+ */
+static const uint64_t* evaluate_batch(char* ptags, char* end) {
+    char* line = ptags;
+    
+    // Clear the columns of any earlier scan (--watch scans again on every change)
+    if(columns != NULL) {
+        memset(columns, 0, tag_ids*batch_words*sizeof(uint64_t));
+    }
+    
+    batch_count = 0;
+    
+    do {
+        if(batch_count == batch_words*64) {
+            grow_columns();
+        }
+        
+        size_t p = batch_count++;
+        
+        batch_lines[p] = line;
+        
+        char* next = mark_ptags(line, end, tag_bits, &batch_pids[p]);
+        
+        // Move the process's bits over to the columns
+        int w;
+        for(w = 0; w < tag_words; w++) {
+            uint64_t word = tag_bits[w];
+            
+            while(word != 0) {
+                int id = w*64 + __builtin_ctzll(word);
+                word &= word-1;
+                
+                columns[id*batch_words + (p >> 6)] |= (uint64_t)1 << (p & 63);
+            }
+        }
+        
+        line = next;
+    } while(line != NULL);
+    
+    // Only the words that hold processes take part from here on
+    size_t words = (batch_count+63)/64;
+    
+    free(column_stack);
+    column_stack = malloc(column_stack_size*words*sizeof(uint64_t));
+    if(column_stack == NULL) {
+        fprintf(stderr, "tagstat: out of memory. qutting...\n");
+        exit(3);
+    }
+    
+    uint64_t* top = column_stack;   // One past the column on top of the stack
+    
+    int pc;
+    for(pc = 0; pc < column_program_len; pc++) {
+        const struct instr* in = &column_program[pc];
+        
+        switch(in->op) {
+            case COL_TAG:
+                memcpy(top, columns + in->arg*batch_words, words*sizeof(uint64_t));
+                top += words;
+                break;
+            
+            case COL_NOT:
+                column_op(COL_NOT, top - words, NULL, words);
+                break;
+            
+            default:
+                if(in->arg >= 0) {
+                    column_op(in->op, top - words, columns + in->arg*batch_words, words);
+                } else {
+                    column_op(in->op, top - 2*words, top - words, words);
+                    top -= words;
+                }
+        }
+    }
+    
+    return column_stack;
+}
+
+
+/*
+ * Several selectors can be matched in a single scan of /proc/ptags, given
+ * either as more than one expression or in a rules file (--rules). All of
+ * them are copied into one buffer, null terminated, and parsed together so
+ * that every tag gets a single ID. Their syntax trees are then merged into
+ * a DAG in which identical subexpressions exist only once, 'a && b' in one
+ * selector and 'b && a' in another are the same node. A node always comes
+ * after its operands, so running the DAG from start to end for the tags
+ * of a process gives the result of every selector at once.
+ */
+struct rule {
+    size_t label;               // Index of the label in rule_buf, printed in front of matching lines
+    size_t start;               // Index of the selector in rule_buf
+    size_t end;                 // Index one past the last character of the selector
+    struct expr_node* root;     // Syntax tree of the selector, NULL if it is invalid
+    int node;                   // DAG node holding the result of the selector
+};
+
+struct dag_node {
+    int type;       // One of the EXPR_* constants
+    int left;       // ID of the tag for EXPR_TAG, otherwise the left or only operand
+    int right;      // The right operand, -1 for EXPR_TAG and EXPR_NOT
+};
+
+static struct rule* rules;              // The selectors in the order they were given
+static int rule_count;                  // Number of selectors
+static int rule_size;                   // Number of selectors rules has room for
+static char* rule_buf;                  // Labels and selectors, each null terminated
+static size_t rule_buf_len;             // Number of characters used in rule_buf
+static size_t rule_buf_size;            // Number of characters allocated for rule_buf
+
+static struct dag_node* dag;            // The merged selectors
+static int dag_len;                     // Number of nodes in the DAG
+static int* dag_table;                  // Open addressing hash table of node+1, 0 marks an empty slot
+static size_t dag_table_size;           // Number of slots, always a power of 2
+static char* dag_values;                // Value of every node for the process being matched
+
+
+/*
+ * Free's the selectors and the DAG, to be used as an exit handler.
+ */
+static void free_rules() {
+    free(rules);
+    free(rule_buf);
+    free(dag);
+    free(dag_table);
+    free(dag_values);
+}
+
+
+/*
+ * Appends a string and a null terminator to rule_buf, exits with code 3
+ * if memory could not be allocated.
+ *
+ *  RETURN VALUE
+ *      The index of the string in rule_buf
+ */
+static size_t append_rule_buf(const char* str, size_t len) {
+    while(rule_buf_len + len + 1 > rule_buf_size) {
+        rule_buf_size = (rule_buf_size > 0) ? rule_buf_size*2 : 4096;
+        
+        char* bigger = realloc(rule_buf, rule_buf_size);
+        if(bigger == NULL) {
+            fprintf(stderr, "tagstat: out of memory. qutting...\n");
+            exit(3);
+        }
+        
+        rule_buf = bigger;
+    }
+    
+    size_t start = rule_buf_len;
+    
+    memcpy(rule_buf + start, str, len);
+    rule_buf[start + len] = '\0';
+    rule_buf_len += len + 1;
+    
+    return start;
+}
+
+
+/*
+ * Adds a selector to the rule set, exits with code 3 if memory could
+ * not be allocated.
+ *
+ *  PARAMETERS
+ *      label     - the label of the selector, NULL to use the selector itself
+ *      label_len - the number of characters in the label
+ *      sel       - the selector, an expression
+ *      sel_len   - the number of characters in the selector
+ */
+static void add_rule(const char* label, size_t label_len, const char* sel, size_t sel_len) {
+    if(rule_count == rule_size) {
+        if(rules == NULL) {
+            atexit(free_rules);
+        }
+        
+        rule_size = (rule_size > 0) ? rule_size*2 : 16;
+        
+        struct rule* bigger = realloc(rules, rule_size*sizeof(struct rule));
+        if(bigger == NULL) {
+            fprintf(stderr, "tagstat: out of memory. qutting...\n");
+            exit(3);
+        }
+        
+        rules = bigger;
+    }
+    
+    struct rule* rule = &rules[rule_count++];
+    
+    rule->start = append_rule_buf(sel, sel_len);
+    rule->end   = rule->start + sel_len;
+    rule->label = (label != NULL) ? append_rule_buf(label, label_len) : rule->start;
+    rule->root  = NULL;
+    rule->node  = -1;
+}
+
+
+/*
+ * Returns non-zero for the characters trimmed from either end
+ * of the lines of a rules file
+ */
+static int is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+
+/*
+ * Returns non-zero if the characters from start up to end make a label,
+ * that is one or more letters, digits and '_' not starting with a digit
+ */
+static int is_label(const char* start, const char* end) {
+    if(start == end || (*start >= '0' && *start <= '9')) {
+        return 0;
+    }
+    
+    for(; start < end; start++) {
+        char c = *start;
+        
+        if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_')) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+
+/*
+ * Adds every selector of a rules file to the rule set. The file has one
+ * selector per line, optionally preceded by a label and " = ", see
+ * is_label(). Blank lines and lines starting with '#' are skipped. Exits with code 5 if the file
+ * can't be read or with code 3 if memory could not be allocated.
+ *
+ *  PARAMETERS
+ *      path - the path of the rules file
+ */
+static void read_rules(const char* path) {
+    FILE* file = fopen(path, "r");
+    if(file == NULL) {
+        fprintf(stderr, "tagstat: error accessing %s: %s\n", path, strerror(errno));
+        exit(5);
+    }
+    
+    char* line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    
+    while((len = getline(&line, &line_size, file)) >= 0) {
+        char* start = line;
+        char* end   = line + len;
+        
+        while(start < end && is_blank(*start)) {
+            start++;
+        }
+        
+        while(end > start && is_blank(end[-1])) {
+            end--;
+        }
+        
+        if(start == end || *start == '#') {
+            continue;
+        }
+        
+        /*
+         * An expression can only contain " = " inside an escaped tag, which
+         * can't be taken for a label since it starts with "%("
+         */
+        *end = '\0';
+        char* sep = strstr(start, " = ");
+        
+        char* label_end = sep;
+        while(label_end != NULL && label_end > start && is_blank(label_end[-1])) {
+            label_end--;
+        }
+        
+        if(sep == NULL || !is_label(start, label_end)) {
+            add_rule(NULL, 0, start, end - start);
+            continue;
+        }
+        
+        char* sel = sep + 3;
+        while(sel < end && is_blank(*sel)) {
+            sel++;
+        }
+        
+        add_rule(start, label_end - start, sel, end - sel);
+    }
+    
+    int failed_read = ferror(file);
+    
+    free(line);
+    fclose(file);
+    
+    if(failed_read) {
+        fprintf(stderr, "tagstat: error reading %s\n", path);
+        exit(5);
+    }
+}
+
+
+/*
+ * Builds the syntax tree of every selector in the rule set
+ *
+ *  RETURN VALUE
+ *      The first invalid selector or NULL if all of them are valid
+ */
+static struct rule* parse_rules() {
+    struct rule* invalid = NULL;
+    
+    begin_parse(rule_buf, rule_buf_len-1);
+    
+    int i;
+    for(i = 0; i < rule_count; i++) {
+        rules[i].root = parse_expr((int)rules[i].start, (int)rules[i].end, 1);
+        
+        if(rules[i].root == NULL && invalid == NULL) {
+            invalid = &rules[i];
+        }
+    }
+    
+    end_parse();
+    
+    return invalid;
+}
+
+
+/*
+ * Finds the slot in the DAG hash table that either holds the given
+ * node or is the empty slot where it would be stored
+ */
+static size_t dag_slot(int type, int left, int right) {
+    uint64_t key = ((uint64_t)type << 56) ^ ((uint64_t)(uint32_t)left << 24) ^ (uint32_t)right;
+    size_t i = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (dag_table_size-1);
+    
+    while(dag_table[i] != 0) {
+        struct dag_node* node = &dag[dag_table[i]-1];
+        
+        if(node->type == type && node->left == left && node->right == right) {
+            break;
+        }
+        
+        i = (i+1) & (dag_table_size-1);
+    }
+    
+    return i;
+}
+
+
+/*
+ * Returns the DAG node with the given operator and operands,
+ * adding it the first time it is asked for
+ */
+static int add_dag_node(int type, int left, int right) {
+    size_t i = dag_slot(type, left, right);
+    
+    if(dag_table[i] == 0) {
+        dag[dag_len].type  = type;
+        dag[dag_len].left  = left;
+        dag[dag_len].right = right;
+        
+        dag_table[i] = ++dag_len;
+    }
+    
+    return dag_table[i]-1;
+}
+
+
+/*
+ * Recursively merges a syntax tree into the DAG
+ *
+ *  PARAMETERS
+ *      node - a pointer to the root of the syntax tree
+ *
+ *  RETURN VALUE
+ *      The DAG node of the root
+ */
+static int compile_dag_node(struct expr_node* node) {
+    int left, right;
+    
+    switch(node->type) {
+        case EXPR_TAG:
+            return add_dag_node(EXPR_TAG, intern_tag(node->start, node->len), -1);
+        
+        case EXPR_NOT:
+            left = compile_dag_node(node->left);
+            
+            // Two NOTs cancel out
+            if(dag[left].type == EXPR_NOT) {
+                return dag[left].left;
+            }
+            
+            return add_dag_node(EXPR_NOT, left, -1);
+        
+        default:    // EXPR_AND, EXPR_OR and EXPR_XOR
+            left  = compile_dag_node(node->left);
+            right = compile_dag_node(node->right);
+            
+            // All of them are commutative, ordering the operands makes 'a && b' the same as 'b && a'
+            if(left > right) {
+                int tmp = left;
+                left  = right;
+                right = tmp;
+            }
+            
+            return add_dag_node(node->type, left, right);
+    }
+}
+
+
+/*
+ * Merges the syntax trees of the rule set into the DAG, exits with
+ * code 3 if memory could not be allocated.
+ */
+static void compile_rules() {
+    init_tag_ids();
+    
+    // Every node adds at most one node to the DAG
+    dag_table_size = 16;
+    while(dag_table_size < node_count*2) {
+        dag_table_size *= 2;
+    }
+    
+    dag        = malloc(node_count*sizeof(struct dag_node));
+    dag_table  = calloc(dag_table_size, sizeof(int));
+    dag_values = malloc(node_count);
+    if(dag == NULL || dag_table == NULL || dag_values == NULL) {
+        fprintf(stderr, "tagstat: out of memory. qutting...\n");
+        exit(3);
+    }
+    
+    dag_len = 0;
+    
+    int i;
+    for(i = 0; i < rule_count; i++) {
+        rules[i].node = compile_dag_node(rules[i].root);
+    }
+    
+    result_words = (rule_count+63)/64;
+    
+    init_tag_bits();
+}
+
+
+/*
+ * Runs the DAG and determines which selectors a set of tags matches
+ *
+ *  PARAMETERS
+ *      bits    - bitset of the IDs of the tags to be matched
+ *      results - where to store the results, bit i is set if
+ *                selector i matched
+ */
+static void evaluate_rules(const uint64_t* bits, uint64_t* results) {
+    int i;
+    for(i = 0; i < dag_len; i++) {
+        const struct dag_node* node = &dag[i];
+        
+        switch(node->type) {
+            case EXPR_TAG:
+                dag_values[i] = (char)(bits[node->left >> 6] >> (node->left & 63)) & 1;
+                break;
+            
+            case EXPR_NOT:
+                dag_values[i] = !dag_values[node->left];
+                break;
+            
+            case EXPR_AND:
+                dag_values[i] = dag_values[node->left] & dag_values[node->right];
+                break;
+            
+            case EXPR_OR:
+                dag_values[i] = dag_values[node->left] | dag_values[node->right];
+                break;
+            
+            default:    // EXPR_XOR
+                dag_values[i] = dag_values[node->left] ^ dag_values[node->right];
+        }
+    }
+    
+    memset(results, 0, result_words*sizeof(uint64_t));
+    
+    for(i = 0; i < rule_count; i++) {
+        if(dag_values[rules[i].node]) {
+            results[i >> 6] |= (uint64_t)1 << (i & 63);
+        }
+    }
+}
+
+
+/*
+ * Prints how much memory was needed to parse the expression to stderr
+ * (--stats), stdout is left alone so the output can still be piped.
+ */
+static void print_stats() {
+    fprintf(stderr, "Parser statistics:\n");
+    fprintf(stderr, "\texpression length:  %lu characters\n", (unsigned long)n);
+    fprintf(stderr, "\tsyntax tree nodes:  %lu (%lu bytes)\n", (unsigned long)(node_count - plan_nodes), (unsigned long)((node_count - plan_nodes)*sizeof(struct expr_node)));
+    fprintf(stderr, "\tspans remembered:   %lu, %lu kept in %lu slots (%lu bytes)\n", (unsigned long)span_count,
+            (unsigned long)span_used, (unsigned long)span_slots, (unsigned long)(span_slots*sizeof(uint64_t)));
+    fprintf(stderr, "\tpeak parser memory: %lu bytes\n", (unsigned long)parser_peak);
+    
+    if(program != NULL) {
+        fprintf(stderr, "\toptimizer nodes:    %lu\n", (unsigned long)plan_nodes);
+        fprintf(stderr, "\tprogram length:     %d instructions (%lu bytes)\n", program_len, (unsigned long)(program_len*sizeof(struct instr)));
+        fprintf(stderr, "\tstack size:         %d\n", stack_size);
+        fprintf(stderr, "\tdistinct tags:      %d\n", tag_ids);
+    }
+    
+    if(dag != NULL) {
+        fprintf(stderr, "\tselectors:          %d\n", rule_count);
+        fprintf(stderr, "\tshared DAG nodes:   %d (%lu bytes)\n", dag_len, (unsigned long)(dag_len*sizeof(struct dag_node)));
+        fprintf(stderr, "\tdistinct tags:      %d\n", tag_ids);
+    }
+    
+    if(column_program != NULL) {
+        fprintf(stderr, "\tbatch program:      %d instructions, %d columns on the stack\n", column_program_len, column_stack_size);
+        fprintf(stderr, "\tbatch instructions: %s\n", column_isa);
+    }
+}
+
+
+/*
+ * Prints how well the memo worked to stderr (--stats), once every
+ * process was matched or after every scan in watch mode
+ */
+static void print_memo_stats() {
+    // Every thread has its own memo, a tag set seen by several threads is counted by each
+    unsigned long lookups = memo_lookups + scan_lookups;
+    unsigned long hits    = memo_hits + scan_hits;
+    
+    fprintf(stderr, "Matching statistics:\n");
+    fprintf(stderr, "\tprocesses tested:   %lu\n", lookups);
+    fprintf(stderr, "\tdistinct tag sets:  %lu\n", (unsigned long)memo_count + scan_sets);
+    fprintf(stderr, "\tmemo hit rate:      %.1f%%\n", (lookups > 0) ? 100.0*hits/lookups : 0.0);
+}
+
+
+/*
+ * Matching lines are written to stdout straight out of the buffer of
+ * /proc/ptags, up to OUT_IOVECS of them with a single writev(), rather
+ * than being copied into the buffer of stdio one line at a time.
+ */
+#define OUT_IOVECS 1024     // Lines written at once, the most writev() takes on Linux
+
+static struct iovec out_iov[OUT_IOVECS];    // Lines waiting to be written
+static int out_count;                       // Number of lines in out_iov
+
+
+/*
+ * Writes every line waiting in out_iov to stdout, exits with
+ * code 5 if stdout can't be written to.
+ */
+static void flush_output() {
+    // Whatever was printed with stdio comes first
+    fflush(stdout);
+    
+    struct iovec* iov = out_iov;
+    int count = out_count;
+    
+    while(count > 0) {
+        ssize_t bytes = writev(STDOUT_FILENO, iov, count);
+        if(bytes < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            
+            fprintf(stderr, "tagstat: error writing to stdout: %s\n", strerror(errno));
+            exit(5);
+        }
+        
+        // Skip what was written, a short write can stop in the middle of a line
+        while(count > 0 && (size_t)bytes >= iov->iov_len) {
+            bytes -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        
+        if(count > 0) {
+            iov->iov_base = (char*)iov->iov_base + bytes;
+            iov->iov_len -= bytes;
+        }
+    }
+    
+    out_count = 0;
+}
+
+
+/*
+ * Queues a line to be written to stdout, the line has to stay where
+ * it is until flush_output() was called
+ */
+static void write_line(const void* line, size_t len) {
+    if(out_count == OUT_IOVECS) {
+        flush_output();
+    }
+    
+    out_iov[out_count].iov_base = (void*)line;
+    out_iov[out_count].iov_len  = len;
+    out_count++;
+}
+
+
+/*
+ * Proc parsing helper function, prints the ptags from a buffered
+ * proc read for a process specified by 'cur_pid'. The lines are
+ * queued with write_line().
+ *
+ *  PARAMETERS
+ *      line     - A pointer to the start of the first line of the
+ *                 in the proc entry buffer
+ *
+ *      end      - A pointer to the end of the proc entry buffer
+ *
+ *      cur_pid  - the pid of the process to print the tags of
+ *
+ *  RETURN VALUE
+ *      A pointer to the line that would've been printed next had
+ *      cur_pid matched the pid value in the next line or NULL
+ *      if the end of the proc entry buffer was reached
+ */
+static char* print_ptags(char* line, char* end, pid_t cur_pid) {
+    // The lines of the process end at the first line with another pid
+    while(line < end && line_pid(line, end) == cur_pid) {
+        struct ptag_line fields;
+        split_line(line, end, &fields);
+        
+        // Copy line from /proc/ptags to stdout, malformed lines are ignored
+        if(fields.tag != NULL) {
+            write_line(line, fields.len);
+        }
+        
+        line = fields.next;
+    }
+    
+    return (line < end) ? line : NULL;
+}
+
+/*
+ * Reads the entire contents of /proc/ptags into memory. The proc entry
+ * can be any size so it is read in a loop into a buffer that doubles in
+ * size whenever it fills up. Exits with code 5 if /proc/ptags can't be
+ * read or with code 3 if memory could not be allocated.
+ *
+ *  PARAMETERS
+ *      len - pointer to a location to store the number of bytes read
+ *
+ *  RETURN VALUE
+ *      A pointer to the contents of /proc/ptags, has to be free'd
+ */
+static char* read_ptags(long* len) {
+    // Open ptag proc entry for reading
+    int ptags_pfd = open("/proc/ptags", O_RDONLY);
+    if(ptags_pfd < 0) {
+        fprintf(stderr, "tagstat: error accessing /proc/ptags: %s\n", strerror(errno));
+        exit(5);
+    }
+    
+    // Start big enough for most systems so there's usually only a single read
+    long size  = sysconf(_SC_PAGESIZE)*16;
+    char* ptags = malloc(size);
+    
+    *len = 0;
+    
+    while(ptags != NULL) {
+        if(*len == size) {
+            char* bigger = realloc(ptags, size*2);
+            if(bigger == NULL) {
+                break;
+            }
+            
+            ptags = bigger;
+            size *= 2;
+        }
+        
+        long bytes = read(ptags_pfd, ptags + *len, size - *len);
+        if(bytes < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            
+            fprintf(stderr, "tagstat: error reading /proc/ptags: %s\n", strerror(errno));
+            
+            free(ptags);
+            close(ptags_pfd);
+            
+            exit(5);
+        }
+        
+        if(bytes == 0) {    // End of file
+            close(ptags_pfd);
+            
+            return ptags;
+        }
+        
+        *len += bytes;
+    }
+    
+    fprintf(stderr, "tagstat: out of memory. qutting...\n");
+    
+    free(ptags);
+    close(ptags_pfd);
+    
+    exit(3);
+}
+
+
+/*
+ * Large snapshots are matched by several threads (--threads). The buffer
+ * is split at process boundaries into chunks, a few for every thread, and
+ * each thread keeps taking the next chunk nobody has taken yet until none
+ * are left, so a thread that got chunks full of heavily tagged processes
+ * simply ends up taking fewer of them. Every thread has its own bitset,
+ * stack and memo (they are thread local). The matches of each chunk are
+ * recorded and handed on in chunk order once every thread is done, so the
+ * output is in ascending pid order just like without threads.
+ */
+#define SCAN_MAX_THREADS       64           // Most threads --threads accepts
+#define SCAN_CHUNK_BYTES       (256*1024)   // Smallest chunk worth a thread
+#define SCAN_CHUNKS_PER_THREAD 8            // Chunks per thread, more balance the load better
+
+struct scan_chunk {
+    char*  start;       // First line of the first process in the chunk
+    char*  end;         // First line of the first process of the next chunk
+    char** lines;       // First line of every matching process
+    pid_t* pids;        // pid of every matching process
+    size_t count;       // Number of matching processes
+    size_t size;        // Number of processes lines and pids have room for
+    
+    struct iovec* iov;  // Every line of the matching processes if scan_record is set
+    size_t iov_count;   // Number of lines in iov
+    size_t iov_size;    // Number of lines iov has room for
+};
+
+static int scan_threads;                    // Number of threads given with --threads, 0 for one per CPU
+static struct scan_chunk* scan_chunks;      // The chunks of the snapshot being matched
+static int scan_chunk_count;                // Number of chunks
+static int scan_next;                       // Next chunk to be taken, shared by every thread
+static int scan_record;                     // Non-zero if the lines of matching processes are recorded
+
+
+/*
+ * Free's the matches of every chunk and the chunks themselves
+ */
+static void free_chunks() {
+    int c;
+    for(c = 0; c < scan_chunk_count; c++) {
+        free(scan_chunks[c].lines);
+        free(scan_chunks[c].pids);
+        free(scan_chunks[c].iov);
+    }
+    
+    free(scan_chunks);
+    
+    scan_chunks      = NULL;
+    scan_chunk_count = 0;
+}
+
+
+/*
+ * Finds the first process that starts at or after a position in
+ * a buffered proc read
+ *
+ *  PARAMETERS
+ *      pos   - A pointer into the proc entry buffer
+ *
+ *      ptags - A pointer to the start of the proc entry buffer
+ *
+ *      end   - A pointer to the end of the proc entry buffer
+ *
+ *  RETURN VALUE
+ *      A pointer to the first line of the process or 'end'
+ */
+static char* next_process(char* pos, char* ptags, char* end) {
+    // Back up to the start of the line pos is in
+    while(pos > ptags && pos[-1] != '\0') {
+        pos--;
+    }
+    
+    if(pos == ptags) {
+        return pos;
+    }
+    
+    // The line before it decides whether it is the first line of its process
+    char* prev = pos - 1;
+    while(prev > ptags && prev[-1] != '\0') {
+        prev--;
+    }
+    
+    pid_t prev_pid = line_pid(prev, end);
+    
+    while(pos < end && line_pid(pos, end) == prev_pid) {
+        pos = memchr(pos, '\0', end - pos);
+        pos = (pos != NULL) ? pos + 1 : end;
+    }
+    
+    return pos;
+}
+
+
+/*
+ * Matches the processes of a chunk and records the matching ones, exits
+ * with code 3 if memory could not be allocated.
+ */
+static void scan_chunk(struct scan_chunk* chunk) {
+    char* cur_line = chunk->start;
+    
+    while(cur_line != NULL && cur_line < chunk->end) {
+        pid_t cur_pid;
+        char* tmp_line;
+        tmp_line = mark_ptags(cur_line, chunk->end, tag_bits, &cur_pid);
+        
+        if(evaluate_memo(tag_bits)) {
+            if(chunk->count == chunk->size) {
+                chunk->size  = (chunk->size > 0) ? chunk->size*2 : 256;
+                chunk->lines = realloc(chunk->lines, chunk->size*sizeof(char*));
+                chunk->pids  = realloc(chunk->pids, chunk->size*sizeof(pid_t));
+                
+                if(chunk->lines == NULL || chunk->pids == NULL) {
+                    fprintf(stderr, "tagstat: out of memory. qutting...\n");
+                    exit(3);
+                }
+            }
+            
+            chunk->lines[chunk->count] = cur_line;
+            chunk->pids[chunk->count]  = cur_pid;
+            chunk->count++;
+            
+            // The lines were just recorded by mark_ptags()
+            if(scan_record) {
+                while(chunk->iov_count + marked_count > chunk->iov_size) {
+                    chunk->iov_size = (chunk->iov_size > 0) ? chunk->iov_size*2 : 1024;
+                    chunk->iov      = realloc(chunk->iov, chunk->iov_size*sizeof(struct iovec));
+                    
+                    if(chunk->iov == NULL) {
+                        fprintf(stderr, "tagstat: out of memory. qutting...\n");
+                        exit(3);
+                    }
+                }
+                
+                memcpy(chunk->iov + chunk->iov_count, marked_lines, marked_count*sizeof(struct iovec));
+                chunk->iov_count += marked_count;
+            }
+        }
+        
+        cur_line = tmp_line;
+    }
+}
+
+
+/*
+ * Takes chunks until there are none left, see scan_chunks above
+ */
+static void scan_chunks_left() {
+    while(1) {
+        int c = __atomic_fetch_add(&scan_next, 1, __ATOMIC_RELAXED);
+        if(c >= scan_chunk_count) {
+            break;
+        }
+        
+        scan_chunk(&scan_chunks[c]);
+    }
+}
+
+
+/*
+ * Entry point of the threads started by scan_ptags(), the main thread
+ * set up its thread local memory when the expression was compiled but
+ * every other thread needs its own. Exits with code 3 if memory could
+ * not be allocated.
+ */
+static void* scan_thread(void* arg) {
+    tag_bits = malloc(tag_words*sizeof(uint64_t));
+    stack    = malloc(stack_size*sizeof(int));
+    if(tag_bits == NULL || stack == NULL) {
+        fprintf(stderr, "tagstat: out of memory. qutting...\n");
+        exit(3);
+    }
+    
+    scan_chunks_left();
+    
+    __atomic_fetch_add(&scan_lookups, memo_lookups, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&scan_hits, memo_hits, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&scan_sets, (unsigned long)memo_count, __ATOMIC_RELAXED);
+    
+    free(tag_bits);
+    free(stack);
+    free(memo_keys);
+    free(memo_results);
+    free(memo_used);
+    free(marked_lines);
+    
+    return NULL;
+}
+
+
+/*
+ * Matches a buffered proc read with several threads, see scan_chunks
+ * above. Nothing is done if the snapshot is too small for more than
+ * one chunk or only one thread is to be used. Exits with code 3 if
+ * memory could not be allocated.
+ *
+ *  PARAMETERS
+ *      ptags  - A pointer to the start of the proc entry buffer
+ *
+ *      end    - A pointer to the end of the proc entry buffer
+ *
+ *      record - non-zero to record the lines of the matching processes
+ *               as well, see scan_record
+ *
+ *  RETURN VALUE
+ *      non-zero if the snapshot was matched, scan_chunks then holds
+ *      the matches and has to be free'd with free_chunks()
+ */
+static int scan_ptags(char* ptags, char* end, int record) {
+    int threads = scan_threads;
+    if(threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus < 1) ? 1 : (cpus > SCAN_MAX_THREADS) ? SCAN_MAX_THREADS : (int)cpus;
+    }
+    
+    size_t len   = end - ptags;
+    size_t count = len/SCAN_CHUNK_BYTES;
+    if(count > (size_t)threads*SCAN_CHUNKS_PER_THREAD) {
+        count = (size_t)threads*SCAN_CHUNKS_PER_THREAD;
+    }
+    
+    if(threads < 2 || count < 2) {
+        return 0;
+    }
+    
+    scan_chunks = calloc(count, sizeof(struct scan_chunk));
+    if(scan_chunks == NULL) {
+        fprintf(stderr, "tagstat: out of memory. qutting...\n");
+        exit(3);
+    }
+    
+    scan_chunk_count = (int)count;
+    scan_next        = 0;
+    scan_record      = record;
+    
+    char* start = ptags;
+    
+    size_t c;
+    for(c = 0; c < count; c++) {
+        char* split = (c+1 < count) ? next_process(ptags + len*(c+1)/count, ptags, end) : end;
+        
+        scan_chunks[c].start = start;
+        scan_chunks[c].end   = (split > start) ? split : start;
+        
+        start = scan_chunks[c].end;
+    }
+    
+    // The main thread takes chunks as well, threads that can't be started are made up for by the others
+    pthread_t tids[SCAN_MAX_THREADS];
+    int started = 0;
+    
+    while(started < threads-1 && started < scan_chunk_count-1) {
+        if(pthread_create(&tids[started], NULL, scan_thread, NULL) != 0) {
+            break;
+        }
+        
+        started++;
+    }
+    
+    scan_chunks_left();
+    
+    int t;
+    for(t = 0; t < started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    
+    return 1;
+}
+
+
+/*
+ * Goes through every process in a buffered proc read and calls 'found'
+ * for each process that matches the expression, in ascending pid order.
+ * Uses the column program if --batch was given and several threads if
+ * the snapshot is large enough.
+ *
+ *  PARAMETERS
+ *      ptags - A pointer to the start of the proc entry buffer
+ *
+ *      end   - A pointer to the end of the proc entry buffer
+ *
+ *      found - called with the first line of the matching process, the
+ *              end of the buffer and the pid of the process. If NULL
+ *              the lines of the matching processes are written to
+ *              stdout straight from the buffer.
+ *
+ *  RETURN VALUE
+ *      non-zero if any process matched
+ */
+static int match_ptags(char* ptags, char* end, char* (*found)(char* line, char* end, pid_t cur_pid)) {
+    int found_match = 0;
+    
+    char* cur_line = ptags;
+    
+    if(batch_mode) {
+        // Match every process at once and then go through the matches in order
+        const uint64_t* matches = evaluate_batch(ptags, end);
+        
+        size_t p;
+        for(p = 0; p < batch_count; p++) {
+            if( (matches[p >> 6] >> (p & 63)) & 1 ) {
+                ((found != NULL) ? found : print_ptags)(batch_lines[p], end, batch_pids[p]);
+                found_match = 1;
+            }
+        }
+    } else if(scan_ptags(ptags, end, found == NULL)) {
+        // The chunks are in pid order and so are the matches of each chunk
+        int c;
+        for(c = 0; c < scan_chunk_count; c++) {
+            size_t i;
+            if(found == NULL) {
+                for(i = 0; i < scan_chunks[c].iov_count; i++) {
+                    write_line(scan_chunks[c].iov[i].iov_base, scan_chunks[c].iov[i].iov_len);
+                }
+            } else {
+                for(i = 0; i < scan_chunks[c].count; i++) {
+                    found(scan_chunks[c].lines[i], end, scan_chunks[c].pids[i]);
+                }
+            }
+            
+            if(scan_chunks[c].count > 0) {
+                found_match = 1;
+            }
+        }
+        
+        free_chunks();
+    } else {
+        /*
+         * This loop scans all tags for each process and
+         * determines whether or not the processes tags
+         * match the given expression and if so hands the
+         * lines in the proc entry to 'found'.
+         */
+        do {
+            // Record which of the expression's tags the current process has
+            pid_t cur_pid;
+            char* tmp_line;
+            tmp_line = mark_ptags(cur_line, end, tag_bits, &cur_pid);
+            
+            /*
+             * Test expression against the current set of tags and
+             * pass them on if there's a match
              */
+            if(evaluate_memo(tag_bits)) {
+                if(found != NULL) {
+                    found(cur_line, end, cur_pid);
+                } else {
+                    // The lines were just recorded by mark_ptags()
+                    size_t i;
+                    for(i = 0; i < marked_count; i++) {
+                        write_line(marked_lines[i].iov_base, marked_lines[i].iov_len);
+                    }
+                }
+                
+                found_match = 1;
+            }
+            
+            cur_line = tmp_line;
+        } while(cur_line != NULL);
+    }
+    
+    if(found == NULL) {
+        flush_output();
+    }
+    
+    return found_match;
+}
+
+
+/*
+ * Goes through every process in a buffered proc read once and prints
+ * its lines for each selector of the rule set it matches, in ascending
+ * pid order and then in the order the selectors were given.
+ *
+ *  PARAMETERS
+ *      ptags - A pointer to the start of the proc entry buffer
+ *
+ *      end   - A pointer to the end of the proc entry buffer
+ *
+ *  RETURN VALUE
+ *      non-zero if any process matched any selector
+ */
+static int match_rules(char* ptags, char* end) {
+    int found_match = 0;
+    
+    char* cur_line = ptags;
+    
+    do {
+        pid_t cur_pid;
+        char* tmp_line;
+        tmp_line = mark_ptags(cur_line, end, tag_bits, &cur_pid);
+        
+        // The DAG only runs for tag sets that haven't been seen yet
+        uint64_t* results;
+        if(!memo_lookup(tag_bits, &results)) {
+            evaluate_rules(tag_bits, results);
+        }
+        
+        int i;
+        for(i = 0; i < rule_count; i++) {
+            if( (results[i >> 6] >> (i & 63)) & 1 ) {
+                // Every line of the process is prefixed with the label and a tab
+                const char* label = rule_buf + rules[i].label;
+                size_t label_len  = strlen(label);
+                
+                size_t l;
+                for(l = 0; l < marked_count; l++) {
+                    write_line(label, label_len);
+                    write_line("\t", 1);
+                    write_line(marked_lines[l].iov_base, marked_lines[l].iov_len);
+                }
+                
+                found_match = 1;
+            }
+        }
+        
+        cur_line = tmp_line;
+    } while(cur_line != NULL);
+    
+    flush_output();
+    
+    return found_match;
+}
+
+
+/*
+ * Matches every selector given on the command line and in a rules file
+ * against a single read of /proc/ptags
+ *
+ *  PARAMETERS
+ *      path  - the rules file or NULL if there is none
+ *      sels  - the selectors given on the command line
+ *      count - the number of selectors in sels
+ *
+ *  RETURN VALUE
+ *      The exit code of tagstat
+ */
+static int print_rules(const char* path, const char* const* sels, int count) {
+    int i;
+    for(i = 0; i < count; i++) {
+        add_rule(NULL, 0, sels[i], strlen(sels[i]));
+    }
+    
+    if(path != NULL) {
+        read_rules(path);
+    }
+    
+    if(rule_count == 0) {
+        fprintf(stderr, "tagstat: %s has no selectors.\n", path);
+        return 1;
+    }
+    
+    struct rule* invalid = parse_rules();
+    
+    if(invalid == NULL) {
+        compile_rules();
+    }
+    
+    if(show_stats) {
+        print_stats();
+    }
+    
+    if(invalid != NULL) {
+        fprintf(stderr, "tagstat: Syntax error: invalid expression '%s'.\n", rule_buf + invalid->start);
+        fprintf(stderr, "Try tagstat --help for more info.\n");
+        
+        return 2;
+    }
+    
+    long proc_len;
+    char* ptags = read_ptags(&proc_len);
+    
+    if(proc_len > 0) {
+        if(!match_rules(ptags, ptags + proc_len)) {
+            printf("No matching tagged processes found.\n");
+        }
+    } else {
+        printf("You do not currently own any tagged processes.\n");
+    }
+    
+    if(show_stats) {
+        print_memo_stats();
+    }
+    
+    free(ptags);
+    
+    return 0;
+}
+
+
+/*
+ * Recursively appends the postfix instructions of a syntax tree to a
+ * selector
+ *
+ *  PARAMETERS
+ *      node  - a pointer to the root of the syntax tree
+ *      insns - the instructions of the selector
+ *      len   - the number of instructions so far, updated
+ */
+static void compile_selector_node(struct expr_node* node, uint32_t* insns, int* len) {
+    switch(node->type) {
+        case EXPR_TAG:
+            insns[(*len)++] = PTAG_SEL_TAG | ((uint32_t)lookup_tag(expr + node->start, node->len) << 8);
+            break;
+        
+        case EXPR_NOT:
+            compile_selector_node(node->left, insns, len);
+            insns[(*len)++] = PTAG_SEL_NOT;
+            break;
+        
+        default:
+            compile_selector_node(node->left, insns, len);
+            compile_selector_node(node->right, insns, len);
             
+            insns[(*len)++] = (node->type == EXPR_AND) ? PTAG_SEL_AND :
+                              (node->type == EXPR_OR)  ? PTAG_SEL_OR  : PTAG_SEL_XOR;
+    }
+}
+
+
+/*
+ * Compiles the syntax tree into a selector for tagd. Every distinct tag
+ * is stored once, every node is one instruction. Exits with code 3 if
+ * memory could not be allocated.
+ *
+ *  PARAMETERS
+ *      size - where to store the size of the selector in bytes
+ *
+ *  RETURN VALUE
+ *      The selector, has to be free'd
+ */
+static char* build_selector(size_t* size) {
+    size_t max_size = sizeof(struct ptag_sel_header) + node_count*sizeof(uint32_t);
+    
+    int id;
+    for(id = 0; id < tag_ids; id++) {
+        max_size += sizeof(uint32_t) + ((tag_entries[id].len + 3) & ~3);
+    }
+    
+    char* sel = calloc(1, max_size);
+    if(sel == NULL) {
+        fprintf(stderr, "tagstat: out of memory. qutting...\n");
+        exit(3);
+    }
+    
+    struct ptag_sel_header* hdr = (struct ptag_sel_header*)sel;
+    size_t off = sizeof(struct ptag_sel_header);
+    
+    for(id = 0; id < tag_ids; id++) {
+        uint32_t len = tag_entries[id].len;
+        
+        memcpy(sel + off, &len, sizeof(uint32_t));
+        memcpy(sel + off + sizeof(uint32_t), expr + tag_entries[id].start, len);
+        
+        off += sizeof(uint32_t) + ((len + 3) & ~3);
+    }
+    
+    int insn_count = 0;
+    compile_selector_node(expr_root, (uint32_t*)(sel + off), &insn_count);
+    
+    hdr->magic      = PTAG_SEL_MAGIC;
+    hdr->tag_count  = tag_ids;
+    hdr->insn_count = insn_count;
+    
+    *size = off + insn_count*sizeof(uint32_t);
+    
+    return sel;
+}
+
+
+static int daemon_mode;     // Non-zero if --daemon was given
+
+
+/*
+ * Sends or receives exactly 'len' bytes over a socket
+ *
+ *  RETURN VALUE
+ *      0 on success, -1 if the socket failed or was closed
+ */
+static int transfer(int fd, void* buf, size_t len, int sending) {
+    while(len > 0) {
+        ssize_t bytes = sending ? send(fd, buf, len, MSG_NOSIGNAL) : recv(fd, buf, len, 0);
+        if(bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        
+        if(bytes <= 0) {
+            return -1;
+        }
+        
+        buf  = (char*)buf + bytes;
+        len -= bytes;
+    }
+    
+    return 0;
+}
+
+
+/*
+ * Sends a selector to tagd, which listens on $TAGD_SOCKET, on
+ * $XDG_RUNTIME_DIR/tagd.sock or on /tmp/tagd-<uid>.sock, and reads the
+ * reply. Nothing is sent unless the socket belongs to a tagd run by the
+ * same user or by root. Exits with code 3 if memory could not be
+ * allocated.
+ *
+ *  PARAMETERS
+ *      sel   - the selector
+ *      size  - the size of the selector in bytes
+ *      reply - where to store the reply
+ *
+ *  RETURN VALUE
+ *      The data following the reply, has to be free'd, or NULL if tagd
+ *      isn't running or failed to answer
+ */
+static char* query_daemon(const char* sel, size_t size, struct tagd_reply* reply) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    
+    addr.sun_family = AF_UNIX;
+    
+    const char* path = getenv("TAGD_SOCKET");
+    if(path != NULL && *path != '\0') {
+        if(strlen(path) >= sizeof(addr.sun_path)) {
+            return NULL;
+        }
+        
+        strcpy(addr.sun_path, path);
+    } else if((path = getenv("XDG_RUNTIME_DIR")) != NULL && *path != '\0') {
+        if(strlen(path) + sizeof("/tagd.sock") > sizeof(addr.sun_path)) {
+            return NULL;
+        }
+        
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/tagd.sock", path);
+    } else {
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/tagd-%u.sock", (unsigned)getuid());
+    }
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        return NULL;
+    }
+    
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    // Anyone can bind /tmp/tagd-<uid>.sock first, the selector isn't sent to another user's process
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    
+    if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 || (cred.uid != getuid() && cred.uid != 0)) {
+        close(fd);
+        return NULL;
+    }
+    
+    struct tagd_request req = { TAGD_MAGIC, TAGD_TAGS, size };
+    char* data = NULL;
+    
+    if(transfer(fd, &req, sizeof(req), 1) == 0 && transfer(fd, (char*)sel, size, 1) == 0 &&
+       transfer(fd, reply, sizeof(struct tagd_reply), 0) == 0 && reply->magic == TAGD_MAGIC && reply->status == 0) {
+        data = malloc(reply->size + 1);
+        if(data == NULL) {
+            fprintf(stderr, "tagstat: out of memory. qutting...\n");
+            exit(3);
+        }
+        
+        if(transfer(fd, data, reply->size, 0) != 0) {
+            free(data);
+            data = NULL;
+        }
+    }
+    
+    close(fd);
+    
+    return data;
+}
+
+
+/*
+ * Returns the process state the way /proc/ptags shows it for the first
+ * letter of the state
+ */
+static const char* state_name(char state) {
+    switch(state) {
+        case 'R': return "R (running)";
+        case 'S': return "S (sleeping)";
+        case 'D': return "D (disk sleep)";
+        case 'T': return "T (stopped)";
+        case 't': return "t (tracing stop)";
+        case 'Z': return "Z (zombie)";
+        case 'X': return "X (dead)";
+        default:  return "? (unknown)";
+    }
+}
+
+
+/*
+ * Prints the lines of the processes matching the expression as found by
+ * tagd, which keeps the tags of all processes in memory so /proc/ptags
+ * doesn't have to be read or parsed. The lines are the same as the ones
+ * /proc/ptags has for the processes. Exits with code 3 if memory could
+ * not be allocated.
+ *
+ *  RETURN VALUE
+ *      non-zero if any process matched, 0 if none did or tagd isn't
+ *      running, in both cases /proc/ptags should be used instead (so the
+ *      right message is printed for no matches)
+ */
+static int print_daemon() {
+    size_t size;
+    char* sel = build_selector(&size);
+    
+    struct tagd_reply reply;
+    char* data = query_daemon(sel, size, &reply);
+    
+    free(sel);
+    
+    if(data == NULL) {
+        return 0;
+    }
+    
+    size_t   off = 0;
+    uint32_t i;
+    
+    for(i = 0; i < reply.count && reply.size - off >= sizeof(struct ptag_bin_record); i++) {
+        const struct ptag_bin_record* rec = (const struct ptag_bin_record*)(data + off);
+        if(rec->size < sizeof(struct ptag_bin_record) || rec->size > reply.size - off) {
             break;
         }
         
-        // Find colon seperating pid and tag
-        char* sep1 = strchr(line, ':');
-        if(sep1 == NULL) {
-            // Formatting error, shouldn't happen, ignore tag
-            continue;
+        const char* state = state_name(rec->state);
+        
+        size_t   tag_off = sizeof(struct ptag_bin_record);
+        uint32_t t;
+        
+        for(t = 0; t < rec->tag_count && rec->size - tag_off >= sizeof(struct ptag_bin_tag); t++) {
+            const struct ptag_bin_tag* tag = (const struct ptag_bin_tag*)(data + off + tag_off);
+            if(tag->len > rec->size - tag_off - sizeof(struct ptag_bin_tag)) {
+                break;
+            }
+            
+            printf("%d : %.*s : %s\n", rec->pid, (int)tag->len, tag->tag, state);
+            
+            tag_off += sizeof(struct ptag_bin_tag) + ((tag->len + 3) & ~3);
+        }
+        
+        off += rec->size;
+    }
+    
+    free(data);
+    
+    return reply.count > 0;
+}
+
+
+/*
+ * Watch mode (--watch) keeps the compiled expression and the matching
+ * lines of the previous scan, and after every change only prints the
+ * lines that were added, removed or whose process state changed.
+ * Instead of rescanning on a fixed interval it polls /proc/ptags, which
+ * reports POLLPRI as soon as the tags of any process changed. Process
+ * states change without any tag changing, so the scan is also repeated
+ * if nothing happened for WATCH_TIMEOUT milliseconds.
+ */
+#define WATCH_TIMEOUT 1000
+
+struct watch_row {
+    pid_t       pid;
+    const char* tag;
+    int         tag_len;
+    const char* state;  // The rest of the line after the tag, newline included
+    const char* line;   // The whole line in the proc buffer
+};
+
+static struct watch_row* rows;          // Matching lines of the current scan
+static size_t row_count;                // Number of lines in rows
+static size_t row_size;                 // Number of lines rows has room for
+static struct watch_row* prev_rows;     // Matching lines of the previous scan
+static size_t prev_count;               // Number of lines in prev_rows
+static size_t prev_size;                // Number of lines prev_rows has room for
+
+
+/*
+ * Proc parsing helper function for watch mode, adds the lines of the
+ * process 'cur_pid' to rows. Same arguments and return value as
+ * print_ptags(), exits with code 3 if memory could not be allocated.
+ */
+static char* add_rows(char* line, char* end, pid_t cur_pid) {
+    struct ptag_line fields;
+    
+    for(; line < end; line = fields.next) {
+        if(line_pid(line, end) != cur_pid) {
+            return line;
         }
         
-        // Find colon seperating tag and state
-        char* sep2 = strrchr(line, ':');
-        if(sep2 == NULL) {
-            // Formatting error, shouldn't happen, ignore tag
+        split_line(line, end, &fields);
+        if(fields.tag == NULL) {
             continue;
         }
         
-        long tag_len = (sep2 - sep1) - 3;
+        if(row_count == row_size) {
+            size_t size = (row_size > 0) ? row_size*2 : 256;
+            struct watch_row* bigger = realloc(rows, size*sizeof(struct watch_row));
+            if(bigger == NULL) {
+                fprintf(stderr, "tagstat: out of memory. qutting...\n");
+                exit(3);
+            }
+            
+            rows     = bigger;
+            row_size = size;
+        }
         
-        // Copy tag and add null terminator
-        memcpy(tag_pool, sep1+2, tag_len);
-        tag_pool[tag_len] = '\0';
+        struct watch_row* row = &rows[row_count++];
         
-        // Update pointers
-        *(tags++) = tag_pool;
-        tag_pool += tag_len+1;
-    } while( (line = strchr(line, '\0')) != NULL);
+        row->pid     = cur_pid;
+        row->tag     = fields.tag;
+        row->tag_len = fields.tag_len;
+        row->state   = fields.state;
+        row->line    = line;
+    }
     
-    return line;
+    return NULL;
 }
 
 
 /*
- * Proc parsing helper function, prints the ptags from a buffered
- * proc read for a process specified by 'cur_pid'
- *
- *  PARAMETERS
- *      line     - A pointer to the start of the first line of the
- *                 in the proc entry buffer
- *
- *      end      - A pointer to the end of the proc entry buffer
- *
- *      cur_pid  - the pid of the process to print the tags of
- *
- *  RETURN VALUE
- *      A pointer to the line that would've been printed next had
- *      cur_pid matched the pid value in the next line or NULL
- *      if the end of the proc entry buffer was reached
+ * Orders watch rows by pid and then by tag, the order of the tags of
+ * a process in /proc/ptags isn't guaranteed to stay the same
  */
-static char* print_ptags(char* line, char* end, pid_t cur_pid) {
-    line -= 1;
+static int compare_rows(const void* a, const void* b) {
+    const struct watch_row* x = a;
+    const struct watch_row* y = b;
     
-    do {
-        // Move to start of line
-        line += 1;
+    if(x->pid != y->pid) {
+        return (x->pid > y->pid) - (x->pid < y->pid);
+    }
+    
+    int len = (x->tag_len < y->tag_len) ? x->tag_len : y->tag_len;
+    int cmp = memcmp(x->tag, y->tag, len);
+    
+    return (cmp != 0) ? cmp : x->tag_len - y->tag_len;
+}
+
+
+/*
+ * Prints the difference between the previous and the current scan,
+ * lines that are new are prefixed with "+ ", lines that are gone with
+ * "- " and lines whose process state changed with "~ "
+ */
+static void print_changes() {
+    size_t i = 0;
+    size_t j = 0;
+    
+    while(i < prev_count || j < row_count) {
+        int cmp;
         
-        // This condition is basically an EOF
-        if(line >= end) {
-            return NULL;
+        if(i == prev_count) {
+            cmp = 1;
+        } else if(j == row_count) {
+            cmp = -1;
+        } else {
+            cmp = compare_rows(&prev_rows[i], &rows[j]);
         }
         
-        pid_t pid = (pid_t)strtoul(line, NULL, 10);
-        if(pid != cur_pid) {
-            /*
-             * This tag is not part of the process
-             * currently being scanned, this means
-             * that the end of the current tag set
-             * has been reached.
-             */
+        if(cmp < 0) {
+            printf("- %s", prev_rows[i++].line);
+        } else if(cmp > 0) {
+            printf("+ %s", rows[j++].line);
+        } else {
+            if(strcmp(prev_rows[i].state, rows[j].state) != 0) {
+                printf("~ %s", rows[j].line);
+            }
             
-            break;
+            i++;
+            j++;
         }
+    }
+    
+    fflush(stdout);
+}
+
+
+/*
+ * Runs watch mode until tagstat is killed, exits with code 5 if
+ * /proc/ptags can't be read or polled or with code 3 if memory could
+ * not be allocated
+ */
+static void watch_ptags() {
+    // Only used to wait for changes, a new snapshot is read for every scan
+    int watch_fd = open("/proc/ptags", O_RDONLY);
+    if(watch_fd < 0) {
+        fprintf(stderr, "tagstat: error accessing /proc/ptags: %s\n", strerror(errno));
+        exit(5);
+    }
+    
+    char* prev_ptags = NULL;
+    
+    while(1) {
+        long proc_len;
+        char* ptags = read_ptags(&proc_len);
         
-        // Find colon seperating pid and tag
-        char* sep1 = strchr(line, ':');
-        if(sep1 == NULL) {
-            // Formatting error, shouldn't happen, ignore tag
-            continue;
+        row_count = 0;
+        if(proc_len > 0) {
+            match_ptags(ptags, ptags + proc_len, add_rows);
         }
         
-        // Find colon seperating tag and state
-        char* sep2 = strrchr(line, ':');
-        if(sep2 == NULL) {
-            // Formatting error, shouldn't happen, ignore tag
-            continue;
+        qsort(rows, row_count, sizeof(struct watch_row), compare_rows);
+        
+        print_changes();
+        
+        if(show_stats) {
+            print_memo_stats();
         }
         
-        // Copy line from /proc/ptags to stdout
-        printf("%s", line);
-    } while( (line = strchr(line, '\0')) != NULL);
-    
-    return line;
+        // The current scan becomes the previous one, its lines stay in its buffer
+        struct watch_row* tmp_rows = prev_rows;
+        size_t            tmp_size = prev_size;
+        
+        prev_rows  = rows;
+        prev_count = row_count;
+        prev_size  = row_size;
+        rows       = tmp_rows;
+        row_size   = tmp_size;
+        
+        free(prev_ptags);
+        prev_ptags = ptags;
+        
+        struct pollfd pfd;
+        pfd.fd      = watch_fd;
+        pfd.events  = POLLPRI;
+        pfd.revents = 0;
+        
+        int ready = poll(&pfd, 1, WATCH_TIMEOUT);
+        if(ready < 0 && errno != EINTR) {
+            fprintf(stderr, "tagstat: error polling /proc/ptags: %s\n", strerror(errno));
+            exit(5);
+        }
+        
+        // A change is reported as POLLERR | POLLPRI, POLLERR alone or POLLNVAL is a real error
+        if(ready > 0 && ((pfd.revents & POLLNVAL) || (pfd.revents & (POLLERR | POLLPRI)) == POLLERR)) {
+            fprintf(stderr, "tagstat: error polling /proc/ptags\n");
+            exit(5);
+        }
+    }
 }
 
+
 const char* const usage_str = "Usage:\n"
-                                "\ttagstat <tag> OR tagstat '<expr>'\n\n"
+                                "\ttagstat [options] <tag> OR tagstat [options] '<expr>' ['<expr>' ...]\n\n"
+
+                                "\tGiven more than one expression every line is printed once for each\n"
+                                "\texpression its process matches, prefixed with the expression and a\n"
+                                "\ttab. All expressions are matched in a single scan of /proc/ptags.\n"
+                                "\t--batch, --threads, --watch, --daemon, --explain and --stats take\n"
+                                "\ta single expression.\n\n"
+
+                                "\t--rules <file> reads more expressions from a file, one per line,\n"
+                                "\teach optionally preceded by a label of letters, digits and '_' and\n"
+                                "\t' = ' which is printed in place of the expression. Blank lines\n"
+                                "\tand lines starting with '#' are skipped.\n\n"
+
+                                "\t--stats prints the number of syntax tree nodes, of spans the\n"
+                                "\tparser remembered and the size of the table keeping them,\n"
+                                "\tand the peak memory used to parse the expression to stderr, and\n"
+                                "\tonce the processes are matched how many distinct tag sets were\n"
+                                "\tseen, with --watch after every scan.\n\n"
+
+                                "\t--batch matches all processes at once using one bitmap per tag,\n"
+                                "\twith AVX2 or SSE2 instructions if the CPU has them. This is faster\n"
+                                "\twhen there are a lot of tagged processes.\n\n"
+
+                                "\t--threads <n> matches large snapshots of /proc/ptags with n threads\n"
+                                "\t(1 to 64) instead of one thread for every CPU. The result is the\n"
+                                "\tsame with any number of threads.\n\n"
+
+                                "\t--watch keeps running and prints the lines that were added (+),\n"
+                                "\tremoved (-) or whose process state changed (~) whenever the tags\n"
+                                "\tof any process change, or at least once a second.\n\n"
+
+                                "\t--daemon asks tagd for the matching processes instead of reading\n"
+                                "\t/proc/ptags, see tagd/tagd.c. /proc/ptags is used if tagd isn't\n"
+                                "\trunning or if its socket belongs to another user.\n\n"
+
+                                "\t--explain prints the expression to stderr the way it is matched,\n"
+                                "\tafter it was simplified and the operands of every AND and OR were\n"
+                                "\tordered by how often their tags occur, with the estimated chance\n"
+                                "\tof every part being true and the instructions it takes to find out.\n\n"
 
                                 "\tpassing --help will print this usage information, thus if\n"
                                 "\tyou wish to use --help as tag it must be encased in either\n"
@@ -740,70 +4233,28 @@ const char* const usage_str = "Usage:\n"
                                 "\te.g. %%(tagwith || and !!)\n\n"
 
                                 "\tTags cannot contain percent signs or parenthesis unless\n"
-                                "\tescaped.\n\n";
+                                "\tescaped. If you wish to use an option as a tag it\n"
+                                "\tmust be encased in parenthesis or escaped.\n\n";
 
 
 int main(int argc, const char * argv[]) {
-    if(argc != 2) {
-        if(argc == 1) {     // No arguments will print all tags users owns
-            // Open ptag proc entry for reading
-            int ptags_pfd = open("/proc/ptags", O_RDONLY);
-            if(ptags_pfd < 0) {
-                fprintf(stderr, "tagstat: error accessing /proc/ptags: %s\n", strerror(errno));
-                
-                return 5;
-            }
-            
-            /*
-             * proc entry reads are confined to PAGESIZE bytes,
-             * apparently there is some sort of limit on single
-             * proc entry reads? I'm not sure if the information
-             * I found was only for old kernels, the web was
-             * very confusing so I decided to just stick with
-             * PAGESIZE reads
-             */
-            long pagesize = sysconf(_SC_PAGESIZE);
-            
-            // Make some space for proc entry contents
-            char* ptags = malloc(pagesize);
-            if(ptags == NULL) {
-                fprintf(stderr, "tagstat: out of memory. qutting...\n");
-                close(ptags_pfd);
-                
-                return 3;
-            }
-            
-            /*
-             * Copy contents of /proc/ptags to ptags buffer, this is done so that
-             * tagstat operation is atomic.
-             */
-            long proc_len;
-            if( (proc_len = read(ptags_pfd, ptags, pagesize)) < 0) {
-                fprintf(stderr, "tagstat: error reading /proc/ptags: %s\n", strerror(errno));
-                
-                free(ptags);
-                close(ptags_pfd);
-                
-                return 5;
-            }
-            
-            close(ptags_pfd);
-            
-            if(proc_len > 0) {
-                write(STDOUT_FILENO, ptags, proc_len);
-            } else {
-                printf("You do not currently own any tagged processes.\n");
-            }
-            
-            free(ptags);
-            
-            return 0;
-        } else {            // Anything else is incorrect usage
-            fprintf(stderr, "tagstat: Incorrect usage.\n");
-            fprintf(stderr, "Try tagstat --help for more info.\n");
-            
-            return 1;
+    if(argc == 1) {     // No arguments will print all tags users owns
+        /*
+         * Copy contents of /proc/ptags to memory, this is done so that
+         * tagstat operation is atomic.
+         */
+        long proc_len;
+        char* ptags = read_ptags(&proc_len);
+        
+        if(proc_len > 0) {
+            write(STDOUT_FILENO, ptags, proc_len);
+        } else {
+            printf("You do not currently own any tagged processes.\n");
         }
+        
+        free(ptags);
+        
+        return 0;
     }
     
     // Check if argument was --help
@@ -813,119 +4264,119 @@ int main(int argc, const char * argv[]) {
         return 0;
     }
     
-    // Build parse table and check if expression is valid
-    build_parse_table((char*)argv[1]);
+    // Options have to come before the expression
+    const char* rules_path = NULL;
     
-    struct parse_node* root = &parse_table[index_of(n, 1, 0, n)];
-    if(root->nt1 == 0) {
-        fprintf(stderr, "tagstat: Syntax error: invalid expression.\n");
-        fprintf(stderr, "Try tagstat --help for more info.\n");
-        
-        return 2;
+    int argi;
+    for(argi = 1; argi < argc; argi++) {
+        if(strncmp(argv[argi], "--stats", sizeof("--stats")) == 0) {
+            show_stats = 1;
+        } else if(strncmp(argv[argi], "--batch", sizeof("--batch")) == 0) {
+            batch_mode = 1;
+        } else if(strncmp(argv[argi], "--threads", sizeof("--threads")) == 0 && argi+1 < argc) {
+            char* num_end;
+            long threads = strtol(argv[++argi], &num_end, 10);
+            
+            if(*num_end != '\0' || threads < 1 || threads > SCAN_MAX_THREADS) {
+                fprintf(stderr, "tagstat: Invalid number of threads '%s'.\n", argv[argi]);
+                fprintf(stderr, "Try tagstat --help for more info.\n");
+                
+                return 1;
+            }
+            
+            scan_threads = (int)threads;
+        } else if(strncmp(argv[argi], "--watch", sizeof("--watch")) == 0) {
+            watch_mode = 1;
+        } else if(strncmp(argv[argi], "--daemon", sizeof("--daemon")) == 0) {
+            daemon_mode = 1;
+        } else if(strncmp(argv[argi], "--explain", sizeof("--explain")) == 0) {
+            explain_mode = 1;
+        } else if(strncmp(argv[argi], "--rules", sizeof("--rules")) == 0) {
+            // Without a file argi ends up at argc, which is incorrect usage
+            if(++argi == argc) {
+                break;
+            }
+            
+            rules_path = argv[argi];
+        } else {
+            break;
+        }
     }
     
-    // Open ptag proc entry for reading
-    int ptags_pfd = open("/proc/ptags", O_RDONLY);
-    if(ptags_pfd < 0) {
-        fprintf(stderr, "tagstat: error accessing /proc/ptags: %s\n", strerror(errno));
+    if(rules_path != NULL || argc - argi > 1) {
+        // Several selectors are matched in a single scan, see struct rule
+        if(batch_mode || scan_threads != 0 || watch_mode || daemon_mode || explain_mode || show_stats) {
+            fprintf(stderr, "tagstat: --batch, --threads, --watch, --daemon, --explain and --stats take a single expression.\n");
+            fprintf(stderr, "Try tagstat --help for more info.\n");
+            
+            return 1;
+        }
         
-        return 5;
+        return print_rules(rules_path, argv + argi, argc - argi);
     }
     
-    /*
-     * proc entry reads are confined to PAGESIZE bytes,
-     * apparently there is some sort of limit on single
-     * proc entry reads? I'm not sure if the information
-     * I found was only for old kernels, the web was
-     * very confusing so I decided to just stick with
-     * PAGESIZE reads
-     */
-    long pagesize = sysconf(_SC_PAGESIZE);
-    
-    // Make some space for proc entry contents
-    char* ptags = malloc(pagesize);
-    if(ptags == NULL) {
-        fprintf(stderr, "tagstat: out of memory. qutting...\n");
-        close(ptags_pfd);
+    if(argc - argi != 1) {  // Anything but a single expression is incorrect usage
+        fprintf(stderr, "tagstat: Incorrect usage.\n");
+        fprintf(stderr, "Try tagstat --help for more info.\n");
         
-        return 3;
+        return 1;
     }
     
+    // Build syntax tree and check if expression is valid
+    parse_expression((char*)argv[argi]);
+    
     /*
-     * Copy contents of /proc/ptags to ptags buffer, this is done so that
-     * tagstat operation is atomic.
+     * Copy contents of /proc/ptags to memory, this is done so that
+     * tagstat operation is atomic. The expression is optimized for
+     * the same copy, --watch and --daemon read /proc/ptags themselves.
      */
-    long proc_len;
-    if( (proc_len = read(ptags_pfd, ptags, pagesize)) < 0) {
-        fprintf(stderr, "tagstat: error reading /proc/ptags: %s\n", strerror(errno));
+    long proc_len = 0;
+    char* ptags = NULL;
+    
+    if(expr_root != NULL) {
+        if(!watch_mode && !daemon_mode) {
+            ptags = read_ptags(&proc_len);
+        }
         
-        free(ptags);
-        close(ptags_pfd);
+        plan_expression(ptags, proc_len);
+        compile_expression();
         
-        return 5;
+        if(batch_mode) {
+            compile_columns();
+        }
     }
     
-    close(ptags_pfd);
+    if(show_stats) {
+        print_stats();
+    }
     
-    if(proc_len > 0) {
-        int found_match = 0;
+    if(explain_mode && expr_root != NULL) {
+        print_explain();
+    }
+    
+    if(expr_root == NULL) {
+        fprintf(stderr, "tagstat: Syntax error: invalid expression.\n");
+        fprintf(stderr, "Try tagstat --help for more info.\n");
         
-        char* cur_line = ptags;
-        char* proc_end = ptags + proc_len;
+        return 2;
+    }
+    
+    if(watch_mode) {
+        watch_ptags();
+    }
+    
+    if(daemon_mode) {
+        if(print_daemon()) {
+            return 0;
+        }
         
-        /*
-         * This loop scans all tags for each process and
-         * determines whether or not the processes tags
-         * match the given expression and if so copies
-         * the lines in the proc entry to stdout.
-         */
-        do {
-            // Get the pid of the current process to scan
-            pid_t cur_pid = (pid_t)strtoul(cur_line, NULL, 10);
-            
-            // Count its ptags and the number of bytes needed to store them
-            long tag_count;
-            long tags_bytes;
-            count_ptags(cur_line, proc_end, &tag_count, &tags_bytes, cur_pid);
-            
-            // Allocate some memory to store the ptags
-            char** tags     = malloc(sizeof(char*)*(tag_count+1));
-            char*  tag_pool = malloc(tags_bytes);
-            tags[tag_count] = NULL; // NULL terminate tag pointers
-            
-            if(tags == NULL || tag_pool == NULL) {
-                fprintf(stderr, "tagstat: out of memory. qutting...\n");
-                free(ptags);
-                
-                // Clean up memory
-                if(tags) {
-                    free(tags);
-                }
-                if(tag_pool) {
-                    free(tag_pool);
-                }
-                
-                return 3;
-            }
-            
-            // Extract the tags out of the proc entry contents
-            char* tmp_line;
-            tmp_line = copy_ptags(cur_line, proc_end, tags, tag_pool, cur_pid);
-            
-            /*
-             * Test expression against the current set of tags and
-             * print them if there's a match
-             */
-            if(evaluate(root, tags)) {
-                print_ptags(cur_line, proc_end, cur_pid);
-                found_match = 1;
-            }
-            
-            free(tag_pool); // Free the tag pool
-            free(tags);     // Free tag pointers
-            
-            cur_line = tmp_line;
-        } while(cur_line != NULL);
+        // tagd isn't running
+        ptags = read_ptags(&proc_len);
+    }
+    
+    if(proc_len > 0) {
+        // Copy the lines of the matching processes to stdout
+        int found_match = match_ptags(ptags, ptags + proc_len, NULL);
         
         if(!found_match) {
             printf("No matching tagged processes found.\n");
@@ -934,6 +4385,10 @@ int main(int argc, const char * argv[]) {
         printf("You do not currently own any tagged processes.\n");
     }
     
+    if(show_stats && !batch_mode) {
+        print_memo_stats();
+    }
+    
     // Free proc entry contents
     free(ptags);
     
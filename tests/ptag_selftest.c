@@ -0,0 +1,313 @@
+//
+// ptag_selftest - tests of the tag set semantics of the patched kernel
+// ---------------------------------------------------------------------------------------------------
+//
+// ptag_selftest.c
+//
+// Description:
+// ---------------------------------------------------------------------------------------------------
+//
+// Tags a child process through sys_ptag and checks what it ends up with through sys_ptag_query and
+// /proc/ptags. Covers what the per-process tag hash tables have to get right: adding a tag twice
+// keeps one copy, removing a tag that isn't there succeeds and changes nothing, tags that are
+// prefixes of each other are told apart, tags of every slab size class are found again, and sets
+// grown well past their first table keep every tag when some are removed in between. Every check
+// prints a line starting with 'ok' or 'not ok'.
+//
+// USAGE
+//   ptag_selftest
+//
+// COMPILE WITH
+//   make
+//
+// EXIT CODES
+//   0 - Exit success:              every check passed
+//
+//   1 - Test failure:              at least one check failed
+//
+//   5 - IO error:                  the child could not be started or /proc/ptags read
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// System call numbers of sys_ptag and sys_ptag_query in the patched kernel
+#if defined(__x86_64__)
+#define SYS_PTAG       299
+#define SYS_PTAG_QUERY 300
+#else
+#define SYS_PTAG       337
+#define SYS_PTAG_QUERY 338
+#endif
+
+#define MANY_TAGS 300   // Enough to grow a set's table several times
+
+
+static pid_t child;     // The process being tagged
+static int failures;    // Number of checks that failed
+static int checks;      // Number of checks done
+
+
+static void check(int passed, const char* what) {
+    checks++;
+    
+    if(passed) {
+        printf("ok %d - %s\n", checks, what);
+    } else {
+        printf("not ok %d - %s\n", checks, what);
+        failures++;
+    }
+}
+
+
+static long ptag(const char* tag, char mode) {
+    return syscall(SYS_PTAG, child, tag, mode);
+}
+
+
+/*
+ * Returns non-zero if sys_ptag_query lists the child for the tag
+ */
+static int has_tag(const char* tag) {
+    pid_t pids[4096];
+    
+    long count = syscall(SYS_PTAG_QUERY, tag, pids, 4096L);
+    
+    long i;
+    for(i = 0; i < count && i < 4096; i++) {
+        if(pids[i] == child) {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+
+/*
+ * Counts the lines of /proc/ptags that give the child the tag, or all
+ * of the child's lines if tag is NULL. Exits with code 5 if /proc/ptags
+ * can't be read.
+ */
+static long count_lines(const char* tag) {
+    static char* buf;
+    static size_t size;
+    
+    int fd = open("/proc/ptags", O_RDONLY);
+    if(fd < 0) {
+        perror("ptag_selftest: error opening /proc/ptags");
+        exit(5);
+    }
+    
+    size_t len = 0;
+    ssize_t bytes;
+    
+    do {
+        if(size - len < 65536) {
+            size = size*2 + 65536;
+            
+            buf = realloc(buf, size);
+            if(buf == NULL) {
+                fprintf(stderr, "ptag_selftest: out of memory. qutting...\n");
+                exit(5);
+            }
+        }
+        
+        bytes = read(fd, buf + len, size - len - 1);
+        len += (bytes > 0) ? bytes : 0;
+    } while(bytes > 0 || (bytes < 0 && errno == EINTR));
+    
+    close(fd);
+    
+    if(bytes < 0) {
+        perror("ptag_selftest: error reading /proc/ptags");
+        exit(5);
+    }
+    
+    char prefix[64];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%d : ", (int)child);
+    size_t tag_len = (tag != NULL) ? strlen(tag) : 0;
+    
+    // Lines are '<pid> : <tag> : <state>\n' followed by a null byte
+    long count = 0;
+    char* line = buf;
+    char* end = buf + len;
+    
+    while(line < end) {
+        char* next = memchr(line, '\n', end - line);
+        next = (next != NULL) ? next + 2 : end;
+        
+        if(next - line > prefix_len && memcmp(line, prefix, prefix_len) == 0) {
+            char* t = line + prefix_len;
+            
+            if(tag == NULL || (end - t >= (long)tag_len + 3 && memcmp(t, tag, tag_len) == 0 &&
+                               memcmp(t + tag_len, " : ", 3) == 0)) {
+                count++;
+            }
+        }
+        
+        line = next;
+    }
+    
+    return count;
+}
+
+
+static void test_duplicates() {
+    check(ptag("dup", 'a') == 0, "adding a tag succeeds");
+    check(ptag("dup", 'a') == 0, "adding it again succeeds");
+    check(count_lines("dup") == 1, "a tag added twice is listed once");
+    check(has_tag("dup"), "sys_ptag_query finds it");
+    
+    check(ptag("dup", 'r') == 0, "removing it succeeds");
+    check(count_lines("dup") == 0 && !has_tag("dup"), "a tag added twice is gone after one removal");
+    check(ptag("dup", 'r') == 0, "removing it again succeeds");
+    check(count_lines(NULL) == 0, "the process has no tags left");
+}
+
+
+static void test_missing() {
+    ptag("keep", 'a');
+    
+    check(ptag("never-added", 'r') == 0, "removing a tag the process doesn't have succeeds");
+    check(count_lines(NULL) == 1 && has_tag("keep"), "and leaves the other tags alone");
+    
+    ptag("keep", 'r');
+}
+
+
+static void test_prefixes() {
+    ptag("ab", 'a');
+    ptag("abc", 'a');
+    ptag("a", 'a');
+    
+    check(count_lines(NULL) == 3, "tags that are prefixes of each other are all added");
+    
+    ptag("ab", 'r');
+    check(!has_tag("ab") && has_tag("a") && has_tag("abc"), "removing 'ab' leaves 'a' and 'abc'");
+    
+    ptag("ab", 'a');
+    check(count_lines("ab") == 1 && count_lines(NULL) == 3, "'ab' can be added back once");
+    
+    check(ptag(NULL, 'c') == 0 && count_lines(NULL) == 0, "clearing removes every tag");
+}
+
+
+static void test_sizes() {
+    static const int lens[] = { 1, 31, 32, 63, 64, 255, 256, 1000 };
+    char tag[1001];
+    
+    unsigned i;
+    for(i = 0; i < sizeof(lens)/sizeof(lens[0]); i++) {
+        memset(tag, 'a' + i, lens[i]);
+        tag[lens[i]] = '\0';
+        
+        ptag(tag, 'a');
+        ptag(tag, 'a');
+    }
+    
+    check(count_lines(NULL) == sizeof(lens)/sizeof(lens[0]), "tags of every size class are added once");
+    
+    int found = 1;
+    for(i = 0; i < sizeof(lens)/sizeof(lens[0]); i++) {
+        memset(tag, 'a' + i, lens[i]);
+        tag[lens[i]] = '\0';
+        
+        found &= has_tag(tag) && count_lines(tag) == 1;
+    }
+    
+    check(found, "and found again");
+    
+    ptag(NULL, 'c');
+}
+
+
+static void test_many() {
+    char tag[32];
+    
+    int i;
+    for(i = 0; i < MANY_TAGS; i++) {
+        snprintf(tag, sizeof(tag), "many%d", i);
+        ptag(tag, 'a');
+    }
+    
+    // Duplicates after the table has grown must still be found
+    for(i = 0; i < MANY_TAGS; i++) {
+        snprintf(tag, sizeof(tag), "many%d", i);
+        ptag(tag, 'a');
+    }
+    
+    check(count_lines(NULL) == MANY_TAGS, "a large set has every tag once");
+    
+    for(i = 0; i < MANY_TAGS; i += 2) {
+        snprintf(tag, sizeof(tag), "many%d", i);
+        ptag(tag, 'r');
+    }
+    
+    // The odd tags may have been placed past the removed ones in the table
+    int kept = 1;
+    for(i = 0; i < MANY_TAGS; i++) {
+        snprintf(tag, sizeof(tag), "many%d", i);
+        kept &= (has_tag(tag) == (i % 2 == 1));
+    }
+    
+    check(count_lines(NULL) == MANY_TAGS/2 && kept, "removing every other tag keeps the rest");
+    
+    for(i = 0; i < MANY_TAGS; i += 2) {
+        snprintf(tag, sizeof(tag), "many%d", i);
+        ptag(tag, 'a');
+    }
+    
+    check(count_lines(NULL) == MANY_TAGS, "the removed tags can be added back");
+    
+    for(i = MANY_TAGS - 1; i >= 0; i--) {
+        snprintf(tag, sizeof(tag), "many%d", i);
+        ptag(tag, 'r');
+    }
+    
+    check(count_lines(NULL) == 0, "removing every tag empties the set");
+}
+
+
+int main() {
+    child = fork();
+    if(child < 0) {
+        perror("ptag_selftest: error starting the child");
+        return 5;
+    }
+    
+    if(child == 0) {
+        pause();
+        _exit(0);
+    }
+    
+    if(ptag("selftest", 'a') != 0 || !has_tag("selftest")) {
+        fprintf(stderr, "ptag_selftest: the kernel doesn't have sys_ptag and sys_ptag_query\n");
+        
+        kill(child, SIGKILL);
+        waitpid(child, NULL, 0);
+        return 5;
+    }
+    
+    ptag(NULL, 'c');
+    
+    test_duplicates();
+    test_missing();
+    test_prefixes();
+    test_sizes();
+    test_many();
+    
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    
+    printf("%d of %d checks passed\n", checks - failures, checks);
+    
+    return (failures == 0) ? 0 : 1;
+}
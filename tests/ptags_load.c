@@ -0,0 +1,323 @@
+//
+// ptags_load - /proc/ptags with a lot of tagged processes
+// ---------------------------------------------------------------------------------------------------
+//
+// ptags_load.c
+//
+// Description:
+// ---------------------------------------------------------------------------------------------------
+//
+// Starts 100000 processes (or the given number) that do nothing but wait, gives each of them the tag
+// 'ptags_load' and a tag of its own with sys_ptag_batch, and then reads /proc/ptags the way tagstat
+// does. Checks that every one of the processes is listed with exactly its two tags, that no line was
+// cut short and that the pids are in ascending order. At around 40 bytes a line this is several MB of
+// tag data, far past the single page /proc/ptags used to be limited to.
+//
+// The system has to allow this many processes, see /proc/sys/kernel/pid_max and ulimit -u.
+//
+// USAGE
+//   ptags_load [<processes>]
+//
+// COMPILE WITH
+//   make
+//
+// EXIT CODES
+//   0 - Exit success:              every line was returned
+//
+//   1 - Test failure:              lines were missing, duplicated or out of order
+//
+//   3 - Out of memory:             malloc failed
+//
+//   5 - IO error:                  the processes could not be started or tagged, or /proc/ptags read
+//
+
+#include "libptag.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// System call number of sys_ptag_batch in the patched kernel
+#if defined(__x86_64__)
+#define SYS_PTAG_BATCH 301
+#else
+#define SYS_PTAG_BATCH 339
+#endif
+
+
+static pid_t* pids;         // The started processes, in the order they were started
+static long pid_count;      // Number of processes started
+
+
+static void* test_alloc(size_t size) {
+    void* mem = calloc(1, size);
+    if(mem == NULL) {
+        fprintf(stderr, "ptags_load: out of memory. qutting...\n");
+        exit(3);
+    }
+    
+    return mem;
+}
+
+
+/*
+ * Kills and reaps every started process
+ */
+static void stop_processes() {
+    long i;
+    for(i = 0; i < pid_count; i++) {
+        kill(pids[i], SIGKILL);
+    }
+    
+    for(i = 0; i < pid_count; i++) {
+        waitpid(pids[i], NULL, 0);
+    }
+}
+
+
+static int compare_pids(const void* a, const void* b) {
+    pid_t x = *(const pid_t*)a;
+    pid_t y = *(const pid_t*)b;
+    
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Returns the index of a pid in the sorted array or -1
+ */
+static long find_pid(const pid_t* sorted, long count, pid_t pid) {
+    long lo = 0;
+    long hi = count;
+    
+    while(lo < hi) {
+        long mid = lo + (hi - lo)/2;
+        
+        if(sorted[mid] < pid) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    
+    return (lo < count && sorted[lo] == pid) ? lo : -1;
+}
+
+
+/*
+ * Reads all of /proc/ptags in a loop, like tagstat and tagkill
+ *
+ *  RETURN VALUE
+ *      The contents, has to be free'd, or NULL if it couldn't be read
+ */
+static char* read_ptags(size_t* len) {
+    int fd = open("/proc/ptags", O_RDONLY);
+    if(fd < 0) {
+        return NULL;
+    }
+    
+    size_t size = 1 << 20;
+    char* buf = test_alloc(size);
+    
+    *len = 0;
+    
+    ssize_t bytes;
+    do {
+        if(size - *len < 65536) {
+            size *= 2;
+            
+            buf = realloc(buf, size);
+            if(buf == NULL) {
+                fprintf(stderr, "ptags_load: out of memory. qutting...\n");
+                exit(3);
+            }
+        }
+        
+        bytes = read(fd, buf + *len, size - *len);
+        *len += (bytes > 0) ? bytes : 0;
+    } while(bytes > 0 || (bytes < 0 && errno == EINTR));
+    
+    close(fd);
+    
+    if(bytes < 0) {
+        free(buf);
+        return NULL;
+    }
+    
+    return buf;
+}
+
+
+int main(int argc, const char* argv[]) {
+    long count = (argc > 1) ? strtol(argv[1], NULL, 10) : 100000;
+    
+    if(argc > 2 || count <= 0) {
+        fprintf(stderr, "ptags_load: Incorrect usage.\n");
+        fprintf(stderr, "Usage:\n\tptags_load [<processes>]\n");
+        
+        return 1;
+    }
+    
+    pids = test_alloc(count*sizeof(pid_t));
+    
+    for(pid_count = 0; pid_count < count; pid_count++) {
+        pid_t pid = fork();
+        
+        if(pid == 0) {
+            pause();
+            _exit(0);
+        }
+        
+        if(pid < 0) {
+            fprintf(stderr, "ptags_load: error starting process %ld: %s\n", pid_count + 1, strerror(errno));
+            
+            stop_processes();
+            return 5;
+        }
+        
+        pids[pid_count] = pid;
+    }
+    
+    // Every process gets the common tag and 'n<index>'
+    char (*own)[24] = test_alloc(count*sizeof(*own));
+    struct ptag_batch_entry* entries = test_alloc(2*count*sizeof(struct ptag_batch_entry));
+    
+    long i;
+    for(i = 0; i < count; i++) {
+        snprintf(own[i], sizeof(own[i]), "n%ld", i);
+        
+        entries[2*i].tag    = "ptags_load";
+        entries[2*i].pid    = pids[i];
+        entries[2*i].mode   = 'a';
+        entries[2*i+1].tag  = own[i];
+        entries[2*i+1].pid  = pids[i];
+        entries[2*i+1].mode = 'a';
+    }
+    
+    for(i = 0; i < 2*count; i += PTAG_BATCH_MAX) {
+        long n = (2*count - i < PTAG_BATCH_MAX) ? 2*count - i : PTAG_BATCH_MAX;
+        
+        if(syscall(SYS_PTAG_BATCH, entries + i, n) != 0) {
+            fprintf(stderr, "ptags_load: error tagging the processes, is this the patched kernel?\n");
+            
+            stop_processes();
+            return 5;
+        }
+    }
+    
+    size_t len;
+    char* ptags = read_ptags(&len);
+    
+    if(ptags == NULL) {
+        perror("ptags_load: error reading /proc/ptags");
+        
+        stop_processes();
+        return 5;
+    }
+    
+    // seen[i] has bit 1 for the common tag and bit 2 for the process's own one
+    pid_t* sorted = test_alloc(count*sizeof(pid_t));
+    long*  index  = test_alloc(count*sizeof(long));
+    char*  seen   = test_alloc(count);
+    
+    memcpy(sorted, pids, count*sizeof(pid_t));
+    qsort(sorted, count, sizeof(pid_t), compare_pids);
+    
+    for(i = 0; i < count; i++) {
+        index[find_pid(sorted, count, pids[i])] = i;
+    }
+    
+    long lines = 0;
+    long bad_lines = 0;
+    long out_of_order = 0;
+    long repeated = 0;
+    pid_t last_pid = 0;
+    
+    // Lines are '<pid> : <tag> : <state>\n' followed by a null byte
+    char* line = ptags;
+    char* end = ptags + len;
+    
+    while(line < end) {
+        char* nl = memchr(line, '\n', end - line);
+        if(nl == NULL) {
+            bad_lines++;
+            break;
+        }
+        
+        *nl = '\0';
+        lines++;
+        
+        char* sep = strstr(line, " : ");
+        char* state = (sep != NULL) ? strstr(sep + 3, " : ") : NULL;
+        
+        if(sep == NULL || state == NULL) {
+            bad_lines++;
+        } else {
+            pid_t pid = (pid_t)strtol(line, NULL, 10);
+            
+            if(pid < last_pid) {
+                out_of_order++;
+            }
+            
+            last_pid = pid;
+            
+            long at = find_pid(sorted, count, pid);
+            if(at >= 0) {
+                long started = index[at];
+                const char* tag = sep + 3;
+                size_t tag_len = state - tag;
+                
+                int bit = 0;
+                if(tag_len == strlen("ptags_load") && memcmp(tag, "ptags_load", tag_len) == 0) {
+                    bit = 1;
+                } else if(tag_len == strlen(own[started]) && memcmp(tag, own[started], tag_len) == 0) {
+                    bit = 2;
+                } else {
+                    bad_lines++;
+                }
+                
+                if(seen[started] & bit) {
+                    repeated++;
+                }
+                
+                seen[started] |= bit;
+            }
+        }
+        
+        // Skip the null byte after the newline
+        line = nl + 2;
+    }
+    
+    long missing = 0;
+    for(i = 0; i < count; i++) {
+        missing += (seen[i] != 3);
+    }
+    
+    stop_processes();
+    
+    printf("%zu bytes, %ld lines\n", len, lines);
+    printf("processes missing a tag: %ld\n", missing);
+    printf("lines repeated:          %ld\n", repeated);
+    printf("malformed lines:         %ld\n", bad_lines);
+    printf("pids out of order:       %ld\n", out_of_order);
+    
+    int ok = (missing == 0 && repeated == 0 && bad_lines == 0 && out_of_order == 0);
+    printf("%s - all %ld processes are listed with both tags\n", ok ? "ok" : "not ok", count);
+    
+    free(ptags);
+    free(sorted);
+    free(index);
+    free(seen);
+    free(own);
+    free(entries);
+    free(pids);
+    
+    return ok ? 0 : 1;
+}